@@ -0,0 +1,246 @@
+#include "cache.h"
+#include "defaults.h"
+#include "macro.h"
+#include "struct.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <inttypes.h>
+#include <limits.h>
+#include <openssl/evp.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/file.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#define INDEX_MAGIC "nddcach1"
+
+// Entries are placed by their hash with linear probing. An entry is marked
+// used only once its block is in the data file, at slot blocks from its
+// start. A dropped one keeps its place in the probing, and its slot goes
+// to the next block which is put there.
+enum { FREE, USED, DROPPED };
+
+struct entry {
+  unsigned char hash[BLOCK_HASH_SIZE];
+  uint64_t slot;
+  uint32_t size;
+  uint32_t used;
+};
+
+struct index {
+  char magic[8];
+  uint64_t capacity;
+  uint64_t count;
+  struct entry entries[];
+};
+
+struct cache {
+  int index_fd;
+  int data_fd;
+  struct index *index;
+  size_t index_size;
+  unsigned char *block;
+  char dir[];
+};
+
+#define WITH_THIS(act) PERROR1("failed to " act " for cache", this->dir)
+
+bool hash_block(const void *buf, size_t size, unsigned char *hash) {
+  unsigned int hash_size;
+  CHECK(EVP_Digest(buf, size, hash, &hash_size, EVP_sha256(), NULL) == 1 &&
+        hash_size == BLOCK_HASH_SIZE,
+        ERROR("failed to hash block"), return false);
+  return true;
+}
+
+static size_t get_index_size(uint64_t capacity) {
+  return sizeof(struct index) + capacity * sizeof(struct entry);
+}
+
+// A new index is all zeroes until its header is written, so one which was
+// cut short by a crash is set up again.
+static bool map_index(struct cache *this) {
+  struct stat stat;
+  CHECK(SYSCALL(fstat(this->index_fd, &stat)), WITH_THIS("call fstat"),
+        return false);
+  this->index_size = stat.st_size;
+  if (!this->index_size) {
+    this->index_size = get_index_size(CACHE_INDEX_ENTRIES);
+    CHECK(SYSCALL(ftruncate(this->index_fd, this->index_size)),
+          WITH_THIS("size index"), return false);
+  }
+  CHECK(this->index_size >= sizeof(struct index),
+        fprintf(stderr, "bad index of cache %s\n", this->dir), return false);
+
+  void *map = mmap(NULL, this->index_size, PROT_READ | PROT_WRITE,
+                   MAP_SHARED, this->index_fd, 0);
+  CHECK(map != MAP_FAILED, WITH_THIS("map index"), return false);
+  this->index = map;
+
+  static const char empty[sizeof(this->index->magic)] = {0};
+  if (memcmp(this->index->magic, empty, sizeof(empty)) == 0) {
+    this->index->capacity = (this->index_size - sizeof(struct index)) /
+        sizeof(struct entry);
+    this->index->count = 0;
+    memcpy(this->index->magic, INDEX_MAGIC, sizeof(this->index->magic));
+  }
+  CHECK(memcmp(this->index->magic, INDEX_MAGIC,
+               sizeof(this->index->magic)) == 0 &&
+        this->index->capacity &&
+        get_index_size(this->index->capacity) == this->index_size,
+        fprintf(stderr, "bad index of cache %s\n", this->dir), return false);
+  return true;
+}
+
+bool open_cache(const char *dir, struct cache **cache) {
+  *cache = NULL;
+  struct cache *this = malloc(sizeof(struct cache) + strlen(dir) + 1);
+  CHECK(this, ERROR("can't allocate memory for cache"), return false);
+  this->index_fd = -1;
+  this->data_fd = -1;
+  this->index = NULL;
+  this->index_size = 0;
+  this->block = NULL;
+  strcpy(this->dir, dir);
+
+  char path[PATH_MAX];
+  CHECK(SYSCALL(mkdir(dir, S_IRWXU)) || errno == EEXIST,
+        WITH_THIS("create directory"), goto fail);
+  snprintf(path, sizeof(path), "%s/index", dir);
+  CHECK(SYSCALL(this->index_fd = open(path, O_RDWR | O_CREAT,
+                                      S_IRUSR | S_IWUSR)),
+        WITH_THIS("open index"), goto fail);
+  if (!SYSCALL(flock(this->index_fd, LOCK_EX | LOCK_NB))) {
+    CHECK(errno == EWOULDBLOCK, WITH_THIS("lock index"), goto fail);
+    fprintf(stderr, "warning: cache %s is in use, going without it\n", dir);
+    close_cache(this);
+    return true;
+  }
+  snprintf(path, sizeof(path), "%s/data", dir);
+  CHECK(SYSCALL(this->data_fd = open(path, O_RDWR | O_CREAT,
+                                     S_IRUSR | S_IWUSR)),
+        WITH_THIS("open data"), goto fail);
+  if (!map_index(this))
+    goto fail;
+  CHECK(this->block = malloc(CACHE_BLOCK_SIZE),
+        ERROR("can't allocate memory for cache"), goto fail);
+
+  *cache = this;
+  return true;
+
+fail:
+  close_cache(this);
+  return false;
+}
+
+void close_cache(struct cache *this) {
+  if (!this)
+    return;
+  if (this->index)
+    CHECK(SYSCALL(munmap(this->index, this->index_size)),
+          WITH_THIS("unmap index"), ;);
+  COND_CHECK(this->data_fd, -1, SYSCALL(close(this->data_fd)),
+             WITH_THIS("close data"));
+  COND_CHECK(this->index_fd, -1, SYSCALL(close(this->index_fd)),
+             WITH_THIS("close index"));
+  free(this->block);
+  free(this);
+}
+
+// The entry with the hash, or the dropped or free one where it would go,
+// or NULL if the index is full.
+static struct entry *find(struct cache *this, const unsigned char *hash) {
+  uint64_t capacity = this->index->capacity;
+  uint64_t start;
+  memcpy(&start, hash, sizeof(start));
+  struct entry *dropped = NULL;
+  for (uint64_t i = 0; i != capacity; ++i) {
+    struct entry *entry = &this->index->entries[(start + i) % capacity];
+    if (entry->used == FREE)
+      return dropped ? dropped : entry;
+    if (entry->used == DROPPED && !dropped)
+      dropped = entry;
+    if (entry->used == USED &&
+        memcmp(entry->hash, hash, BLOCK_HASH_SIZE) == 0)
+      return entry;
+  }
+  return dropped;
+}
+
+// A damaged block is dropped, so that later transfers don't count on it.
+static bool read_block(struct cache *this, struct entry *entry, void *buf) {
+  for (size_t done = 0; done != entry->size;) {
+    ssize_t rv = pread(this->data_fd, (char *)buf + done, entry->size - done,
+                       entry->slot * CACHE_BLOCK_SIZE + done);
+    CHECK(SYSCALL(rv), WITH_THIS("read block"), return false);
+    CHECK(rv, fprintf(stderr, "warning: block is cut short in cache %s, "
+                      "dropped\n", this->dir),
+          entry->used = DROPPED; return false);
+    done += rv;
+  }
+
+  unsigned char actual[BLOCK_HASH_SIZE];
+  if (!hash_block(buf, entry->size, actual))
+    return false;
+  CHECK(memcmp(actual, entry->hash, BLOCK_HASH_SIZE) == 0,
+        fprintf(stderr, "warning: block is damaged in cache %s, dropped\n",
+                this->dir),
+        entry->used = DROPPED; return false);
+  return true;
+}
+
+bool cache_has(struct cache *this, const unsigned char *hash) {
+  struct entry *entry = find(this, hash);
+  return entry && entry->used == USED && entry->size <= CACHE_BLOCK_SIZE &&
+      read_block(this, entry, this->block);
+}
+
+bool cache_get(struct cache *this, const unsigned char *hash, void *buf,
+               size_t *size) {
+  struct entry *entry = find(this, hash);
+  CHECK(entry && entry->used == USED && entry->size <= CACHE_BLOCK_SIZE,
+        fprintf(stderr, "block is missing from cache %s\n", this->dir),
+        return false);
+  if (!read_block(this, entry, buf))
+    return false;
+  *size = entry->size;
+  return true;
+}
+
+// The index is kept at most three quarters full, so that blocks which are
+// missing are found to be missing quickly. The block is on disk before
+// its entry is marked used, so that a crash doesn't leave the entry
+// pointing at what was there before.
+bool cache_put(struct cache *this, const unsigned char *hash, const void *buf,
+               size_t size) {
+  struct index *index = this->index;
+  struct entry *entry = find(this, hash);
+  if (!entry || entry->used == USED)
+    return true;
+  bool reused = (entry->used == DROPPED);
+  if (!reused && index->count >= index->capacity / 4 * 3)
+    return true;
+
+  uint64_t slot = reused ? entry->slot : index->count;
+  for (size_t done = 0; done != size;) {
+    ssize_t rv = pwrite(this->data_fd, (const char *)buf + done, size - done,
+                        slot * CACHE_BLOCK_SIZE + done);
+    CHECK(SYSCALL(rv), WITH_THIS("write block"), return false);
+    done += rv;
+  }
+  CHECK(SYSCALL(fdatasync(this->data_fd)), WITH_THIS("sync block"),
+        return false);
+  memcpy(entry->hash, hash, BLOCK_HASH_SIZE);
+  entry->slot = slot;
+  entry->size = size;
+  entry->used = USED;
+  if (!reused)
+    ++index->count;
+  return true;
+}
+
+#undef WITH_THIS
@@ -0,0 +1,27 @@
+#pragma once
+
+#include <stdbool.h>
+#include <stddef.h>
+
+// A store of blocks by their hash, which a destination keeps in a directory
+// across transfers: a hash table mapped from the index file, and the blocks
+// themselves in the data file. Blocks are only added, and dropped when
+// they are found damaged, a full cache is only read from.
+struct cache;
+
+// SHA-256 of the block, BLOCK_HASH_SIZE bytes.
+extern bool hash_block(const void *buf, size_t size, unsigned char *hash);
+
+// Opens the cache in dir, creating it if it's missing. Only one process
+// uses a cache at a time, *cache is left NULL if another one holds it.
+extern bool open_cache(const char *dir, struct cache **cache);
+extern void close_cache(struct cache *cache);
+
+// Whether the block is in the cache, intact: it's read and checked, so that
+// a damaged one is dropped before a source is told it's there.
+extern bool cache_has(struct cache *cache, const unsigned char *hash);
+// Reads the block into buf, of CACHE_BLOCK_SIZE bytes, and checks its hash.
+extern bool cache_get(struct cache *cache, const unsigned char *hash,
+                      void *buf, size_t *size);
+extern bool cache_put(struct cache *cache, const unsigned char *hash,
+                      const void *buf, size_t size);
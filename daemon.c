@@ -0,0 +1,445 @@
+#include "daemon.h"
+#include "defaults.h"
+#include "macro.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <linux/landlock.h>
+#include <netdb.h>
+#include <openssl/crypto.h>
+#include <openssl/evp.h>
+#include <openssl/hmac.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/prctl.h>
+#include <sys/random.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <sys/types.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+#define MAX_KEY_FILE_SIZE 4096
+#define MIN_KEY_FILE_SIZE 16
+
+#ifndef LANDLOCK_ACCESS_FS_TRUNCATE
+#define LANDLOCK_ACCESS_FS_TRUNCATE (1ULL << 14)
+#endif
+
+// Rights a job has under an allowed path, of the ones the kernel knows.
+// Devices may still be ioctl()ed, which block devices need.
+#define ACCESS_FS_V1 ((LANDLOCK_ACCESS_FS_MAKE_SYM << 1) - 1)
+#define ACCESS_FILE \
+  (LANDLOCK_ACCESS_FS_READ_FILE | LANDLOCK_ACCESS_FS_WRITE_FILE | \
+   LANDLOCK_ACCESS_FS_TRUNCATE)
+#define ACCESS_READ \
+  (LANDLOCK_ACCESS_FS_READ_FILE | LANDLOCK_ACCESS_FS_READ_DIR)
+
+// Anyone who can connect could run ndd as the daemon's user, so a daemon
+// only listens on loopback or a unix socket unless it's told otherwise,
+// takes jobs from its own user or clients with the key, and jobs only get
+// to the allowed paths.
+struct control {
+  const char *address;
+  bool local;
+  unsigned char key[MAX_KEY_FILE_SIZE];
+  size_t key_size;
+  int allowed[MAX_ALLOWED_PATHS];
+  size_t num_allowed;
+  uint64_t handled;
+};
+
+// The ring is preallocated once and shared with the jobs rather than
+// copied on write. Only one job at a time uses it, the one holding the
+// record lock on it, which goes away with the process however it ends.
+struct ring {
+  int fd;
+  char *buffer;
+  size_t size;
+};
+
+static bool create_ring(struct ring *ring) {
+  CHECK(SYSCALL(ring->fd = memfd_create("ndd-ring", 0)),
+        perror("failed to create ring"), return false);
+  CHECK(SYSCALL(ftruncate(ring->fd, ring->size)),
+        perror("failed to size ring"), return false);
+  ring->buffer = mmap(NULL, ring->size, PROT_READ | PROT_WRITE,
+                      MAP_SHARED | MAP_POPULATE, ring->fd, 0);
+  CHECK(ring->buffer != MAP_FAILED, perror("failed to map ring"),
+        ring->buffer = NULL; return false);
+  return true;
+}
+
+static bool take_ring(const struct ring *ring) {
+  struct flock lock = {
+    .l_type = F_WRLCK, .l_whence = SEEK_SET, .l_start = 0, .l_len = 0
+  };
+  return fcntl(ring->fd, F_SETLK, &lock) != -1;
+}
+
+static int listen_on_path(const char *path) {
+  struct sockaddr_un address = { .sun_family = AF_UNIX };
+  CHECK(strlen(path) < sizeof(address.sun_path),
+        fprintf(stderr, "control socket path %s is too long\n", path),
+        return -1);
+  strcpy(address.sun_path, path);
+  CHECK(SYSCALL(unlink(path)) || errno == ENOENT,
+        PERROR1("failed to remove old control socket", path), return -1);
+
+  int sock;
+  CHECK(SYSCALL(sock = socket(AF_UNIX, SOCK_STREAM, 0)),
+        PERROR1("failed to create control socket", path), return -1);
+  mode_t mask = umask(S_IRWXG | S_IRWXO);
+  bool bound = SYSCALL(bind(sock, (struct sockaddr *)&address,
+                            sizeof(address)));
+  umask(mask);
+  CHECK(bound && SYSCALL(listen(sock, SOMAXCONN)),
+        PERROR1("failed to listen for jobs on", path),
+        close(sock); return -1);
+  return sock;
+}
+
+// The spec is a path to a unix socket, or [host:]port, on 127.0.0.1 without
+// a host.
+static int listen_on(const char *spec) {
+  if (strchr(spec, '/'))
+    return listen_on_path(spec);
+
+  int sock = -1;
+  char *host = strdup(spec);
+  CHECK(host, ERROR("can't allocate memory for control address"),
+        return -1);
+  char *port = strrchr(host, ':');
+  if (port)
+    *port++ = 0;
+  else
+    port = host;
+
+  struct addrinfo hints;
+  memset(&hints, 0, sizeof(hints));
+  hints.ai_family = AF_UNSPEC;
+  hints.ai_socktype = SOCK_STREAM;
+
+  struct addrinfo *result;
+  int gai_rv = -1;
+  CHECK((gai_rv = getaddrinfo(port != host && *host ? host : "127.0.0.1",
+                              port, &hints, &result)) == 0,
+        GAI_PERROR1("getaddrinfo() failed for", spec, gai_rv), goto cleanup);
+
+  for (struct addrinfo *i = result; i != NULL; i = i->ai_next) {
+    int reuse = 1;
+    if (SYSCALL(sock = socket(i->ai_family, i->ai_socktype,
+                              i->ai_protocol)) &&
+        SYSCALL(setsockopt(sock, SOL_SOCKET, SO_REUSEADDR,
+                           &reuse, sizeof(reuse))) &&
+        SYSCALL(bind(sock, i->ai_addr, i->ai_addrlen)))
+      break;
+    PERROR1("warning: failed to bind one of addresses for", spec);
+    COND_CHECK(sock, -1, SYSCALL(close(sock)),
+               PERROR1("warning: close() failed for one of addresses for",
+                       spec));
+  }
+  freeaddrinfo(result);
+
+  CHECK(sock != -1,
+        fprintf(stderr, "failed to listen for jobs on %s\n", spec),
+        goto cleanup);
+  CHECK(SYSCALL(listen(sock, SOMAXCONN)), PERROR1("listen() failed for", spec),
+        COND_CHECK(sock, -1, SYSCALL(close(sock)), ;));
+
+cleanup:
+  free(host);
+  return sock;
+}
+
+// Splits the job into arguments, returns false until all of it is there.
+// The ones past MAX_JOB_ARGS are only counted.
+static bool parse_job(char *request, size_t size, char **argv, int *argc) {
+  *argc = 1;
+  for (size_t begin = 0; begin != size;) {
+    char *end = memchr(request + begin, 0, size - begin);
+    if (!end)
+      return false;
+    if (end == request + begin) {
+      if (*argc <= MAX_JOB_ARGS)
+        argv[*argc] = NULL;
+      return true;
+    }
+    if (*argc < MAX_JOB_ARGS)
+      argv[*argc] = request + begin;
+    ++*argc;
+    begin = end - request + 1;
+  }
+  return false;
+}
+
+static bool send_reply(int conn, const char *reply, size_t size) {
+  for (size_t sent = 0; sent != size;) {
+    ssize_t rv = send(conn, reply + sent, size - sent, MSG_NOSIGNAL);
+    CHECK(SYSCALL(rv), perror("failed to reply to job client"),
+          return false);
+    sent += rv;
+  }
+  return true;
+}
+
+static bool read_key(struct control *control, const char *key_file) {
+  int fd;
+  CHECK(SYSCALL(fd = open(key_file, O_RDONLY)),
+        PERROR1("failed to open key file", key_file), return false);
+  ssize_t size = read(fd, control->key, sizeof(control->key));
+  close(fd);
+  CHECK(SYSCALL(size), PERROR1("failed to read key file", key_file),
+        return false);
+  CHECK(size >= MIN_KEY_FILE_SIZE,
+        fprintf(stderr, "key file %s should be at least %d bytes long\n",
+                key_file, MIN_KEY_FILE_SIZE),
+        return false);
+  control->key_size = size;
+  return true;
+}
+
+// A unix socket's client has to be the daemon's user, and one with the key
+// has to answer a challenge with its HMAC.
+static bool authenticate(int conn, const struct control *control) {
+  if (control->local) {
+    struct ucred cred;
+    socklen_t len = sizeof(cred);
+    CHECK(SYSCALL(getsockopt(conn, SOL_SOCKET, SO_PEERCRED, &cred, &len)),
+          perror("failed to get credentials of job client"), return false);
+    CHECK(cred.uid == geteuid(),
+          fprintf(stderr, "refused job from user %u\n", (unsigned)cred.uid),
+          return false);
+  }
+  if (!control->key_size)
+    return true;
+
+  unsigned char challenge[DAEMON_CHALLENGE_SIZE];
+  unsigned char expected[EVP_MAX_MD_SIZE];
+  unsigned char answer[DAEMON_CHALLENGE_SIZE];
+  unsigned int size;
+  CHECK(getrandom(challenge, sizeof(challenge), 0) == sizeof(challenge),
+        perror("failed to generate challenge"), return false);
+  CHECK(HMAC(EVP_sha256(), control->key, control->key_size, challenge,
+             sizeof(challenge), expected, &size) &&
+        size == sizeof(answer),
+        ERROR("failed to compute answer to challenge"), return false);
+  if (!send_reply(conn, (const char *)challenge, sizeof(challenge)))
+    return false;
+  CHECK(recv(conn, answer, sizeof(answer), MSG_WAITALL) == sizeof(answer),
+        ERROR("connection closed before answer to challenge"),
+        return false);
+  CHECK(CRYPTO_memcmp(answer, expected, sizeof(answer)) == 0,
+        ERROR("refused job with wrong answer to challenge"), return false);
+  return true;
+}
+
+static int get_landlock_abi(void) {
+  return syscall(SYS_landlock_create_ruleset, NULL, 0,
+                 LANDLOCK_CREATE_RULESET_VERSION);
+}
+
+static bool allow(int ruleset, int fd, uint64_t access) {
+  struct stat stat;
+  CHECK(SYSCALL(fstat(fd, &stat)), perror("failed to stat allowed path"),
+        return false);
+  if (!S_ISDIR(stat.st_mode))
+    access &= ACCESS_FILE;
+  struct landlock_path_beneath_attr rule = {
+    .allowed_access = access, .parent_fd = fd
+  };
+  CHECK(SYSCALL(syscall(SYS_landlock_add_rule, ruleset,
+                        LANDLOCK_RULE_PATH_BENEATH, &rule, 0)),
+        perror("failed to allow path to job"), return false);
+  return true;
+}
+
+// The job can read what placing threads needs, besides the allowed paths.
+static bool confine(const struct control *control) {
+  const char *readable[] = {"/sys", "/proc/self"};
+  struct landlock_ruleset_attr attr = {
+    .handled_access_fs = control->handled
+  };
+  int ruleset;
+  CHECK(SYSCALL(ruleset = syscall(SYS_landlock_create_ruleset, &attr,
+                                  sizeof(attr), 0)),
+        perror("failed to create ruleset for job"), return false);
+
+  bool rv = true;
+  for (size_t i = 0; rv && i != control->num_allowed; ++i)
+    rv = allow(ruleset, control->allowed[i],
+               control->handled & ~LANDLOCK_ACCESS_FS_EXECUTE);
+  for (size_t i = 0; rv && i != arraysize(readable); ++i) {
+    int fd = open(readable[i], O_PATH | O_CLOEXEC);
+    rv = fd == -1 || allow(ruleset, fd, control->handled & ACCESS_READ);
+    if (fd != -1)
+      close(fd);
+  }
+  CHECK(rv && SYSCALL(prctl(PR_SET_NO_NEW_PRIVS, 1, 0, 0, 0)) &&
+        SYSCALL(syscall(SYS_landlock_restrict_self, ruleset, 0)),
+        perror("failed to confine job"), rv = false);
+  close(ruleset);
+  return rv;
+}
+
+static bool parse_options(struct control *control, char *options) {
+  enum { KEY, ALLOW };
+  char *const tokens[] = {
+    [KEY] = "key",
+    [ALLOW] = "allow",
+    NULL
+  };
+
+  while (*options) {
+    char *value = NULL;
+    switch (getsubopt(&options, tokens, &value)) {
+    case KEY:
+      CHECK(value && read_key(control, value),
+            fprintf(stderr, "bad key option for %s\n", control->address),
+            return false);
+      break;
+    case ALLOW: {
+      CHECK(value && control->num_allowed != MAX_ALLOWED_PATHS,
+            fprintf(stderr, "bad allow option for %s\n", control->address),
+            return false);
+      int fd = open(value, O_PATH | O_CLOEXEC);
+      CHECK(SYSCALL(fd), PERROR1("failed to open allowed path", value),
+            return false);
+      control->allowed[control->num_allowed++] = fd;
+      break;
+    }
+    default:
+      fprintf(stderr, "unknown option %s for %s\n", value,
+              control->address);
+      return false;
+    }
+  }
+  return true;
+}
+
+// The spec is the address, optionally followed by a key file and paths
+// jobs are allowed to, the current directory if there are none.
+static bool parse_control(char *spec, struct control *control) {
+  control->address = spec;
+  char *options = strchr(spec, ',');
+  if (options)
+    *options++ = 0;
+  control->local = strchr(spec, '/');
+  if (options && !parse_options(control, options))
+    return false;
+  CHECK(control->local || control->key_size,
+        fprintf(stderr, "jobs on %s have to be authenticated with a key\n",
+                spec),
+        return false);
+  if (!control->num_allowed) {
+    int fd = open(".", O_PATH | O_CLOEXEC);
+    CHECK(SYSCALL(fd), perror("failed to open current directory"),
+          return false);
+    control->allowed[control->num_allowed++] = fd;
+  }
+
+  int abi = get_landlock_abi();
+  CHECK(SYSCALL(abi), perror("jobs can't be confined without Landlock"),
+        return false);
+  control->handled = ACCESS_FS_V1;
+  if (abi >= 2)
+    control->handled |= LANDLOCK_ACCESS_FS_REFER;
+  if (abi >= 3)
+    control->handled |= LANDLOCK_ACCESS_FS_TRUNCATE;
+  return true;
+}
+
+static void serve_job(int conn, struct ring *ring,
+                      const struct control *control,
+                      int (*job)(int, char *[], char *, size_t)) {
+  char request[MAX_JOB_SIZE];
+  char *argv[MAX_JOB_ARGS + 1] = {"ndd"};
+  int argc = 0;
+  size_t size = 0;
+
+  signal(SIGCHLD, SIG_DFL);
+  if (!authenticate(conn, control))
+    exit(1);
+  do {
+    CHECK(size != sizeof(request), ERROR("job is too long"), exit(1));
+    ssize_t rv = recv(conn, request + size, sizeof(request) - size, 0);
+    CHECK(SYSCALL(rv), perror("failed to receive job"), exit(1));
+    CHECK(rv != 0, ERROR("connection closed before the whole job"),
+          exit(1));
+    size += rv;
+  } while (!parse_job(request, size, argv, &argc));
+  CHECK(argc <= MAX_JOB_ARGS, ERROR("job has too many arguments"), exit(1));
+
+  int null_fd = open("/dev/null", O_RDWR);
+  CHECK(SYSCALL(null_fd) && SYSCALL(dup2(null_fd, STDIN_FILENO)) &&
+        SYSCALL(dup2(null_fd, STDOUT_FILENO)) &&
+        SYSCALL(dup2(conn, STDERR_FILENO)),
+        perror("failed to redirect job output"), exit(1));
+  close(null_fd);
+  if (!confine(control))
+    exit(1);
+
+  // getopt() is in the state the daemon's own command line left it in.
+  optind = 0;
+  bool own_ring = take_ring(ring);
+  int status = job(argc, argv, own_ring ? ring->buffer : NULL,
+                   own_ring ? ring->size : 0);
+
+  char reply[16];
+  int len = snprintf(reply, sizeof(reply), "%c%d", 0, status);
+  exit(send_reply(conn, reply, len) ? status : 1);
+}
+
+bool run_daemon(const char *spec, size_t ring_size,
+                int (*job)(int, char *[], char *, size_t)) {
+  bool rv = true;
+  struct ring ring = {-1, NULL, ring_size};
+  struct control control = {0};
+  int sock = -1;
+  char *address = strdup(spec);
+
+#define FAIL_IF_NOT(cond, alert) \
+  CHECK(cond, alert, GOTO_WITH(cleanup, rv, false))
+
+  FAIL_IF_NOT(address, ERROR("can't allocate memory for control address"));
+  FAIL_IF_NOT(parse_control(address, &control), ;);
+  FAIL_IF_NOT(create_ring(&ring), ;);
+  FAIL_IF_NOT(SYSCALL(sock = listen_on(control.address)), ;);
+  // Finished jobs are reaped by the kernel.
+  FAIL_IF_NOT(signal(SIGCHLD, SIG_IGN) != SIG_ERR,
+              perror("failed to ignore SIGCHLD"));
+
+  for (;;) {
+    int conn = accept(sock, NULL, NULL);
+    if (conn == -1 && (errno == EINTR || errno == ECONNABORTED))
+      continue;
+    FAIL_IF_NOT(SYSCALL(conn), perror("accept() failed for jobs"));
+
+    pid_t pid = fork();
+    if (pid == 0) {
+      close(sock);
+      serve_job(conn, &ring, &control, job);
+    }
+    CHECK(SYSCALL(pid), perror("failed to start job"), ;);
+    CHECK(SYSCALL(close(conn)), perror("failed to close job connection"), ;);
+  }
+
+#undef FAIL_IF_NOT
+
+cleanup:
+  COND_CHECK(sock, -1, SYSCALL(close(sock)),
+             perror("failed to close control socket"));
+  if (ring.buffer)
+    munmap(ring.buffer, ring.size);
+  COND_CHECK(ring.fd, -1, SYSCALL(close(ring.fd)),
+             perror("failed to close ring"));
+  for (size_t i = 0; i != control.num_allowed; ++i)
+    close(control.allowed[i]);
+  memset(control.key, 0, sizeof(control.key));
+  free(address);
+  return rv;
+}
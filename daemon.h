@@ -0,0 +1,21 @@
+#pragma once
+
+#include <stdbool.h>
+#include <stddef.h>
+
+// Long-running mode: transfer jobs are submitted over a control connection
+// as ndd command lines, and each of them runs in a process of its own.
+//
+// The daemon listens on a unix socket, for its own user, or on a port, on
+// loopback unless a host is given, and then only takes jobs from clients
+// with the key. A job only gets to the allowed paths and what's below them.
+//
+// With a key, the daemon first sends a random challenge of
+// DAEMON_CHALLENGE_SIZE bytes, which the client answers with its
+// HMAC-SHA256 keyed with the contents of the key file. A job is then sent
+// as its arguments without the program name, every one of them terminated
+// by NUL, and the list terminated by an empty argument. The reply is what
+// the job printed to stderr, then NUL and the job's exit status in decimal.
+extern bool run_daemon(const char *spec, size_t ring_size,
+                       int (*job)(int argc, char *argv[],
+                                  char *ring, size_t ring_size));
@@ -3,8 +3,47 @@
 #define DEFAULT_BUFFER_SIZE (16*1024*1024)
 #define DEFAULT_BLOCK_SIZE   (8*1024*1024)
 #define DEFAULT_LO_WATERMARK (8*1024*1024)
+#define DEFAULT_READ_AHEAD 1
+
+#define MAX_READ_AHEAD 16
+#define DIRECT_IO_ALIGNMENT 4096
 
 #define MAX_CONSUMERS 10
 
+#define DEFAULT_SPILL_SIZE (4ULL*1024*1024*1024)
+
 #define DEFAULT_PORT "3634"
-static const unsigned int CONNECT_BACKOFF[] = {0, 1, 3, 5};
+
+#define CRYPTO_RECORD_SIZE (256*1024)
+#define DEFAULT_CRYPTO_WORKERS 2
+#define MAX_CRYPTO_WORKERS 16
+#define MAX_CONNECT_ADDRESSES 16
+#define CONNECT_TIMEOUT_MS 30000
+#define CONNECT_RETRY_MIN_MS 10
+#define CONNECT_RETRY_MAX_MS 1000
+#define DRAIN_TIMEOUT_MS 30000
+#define TCP_INFO_INTERVAL_MS 100
+
+#define MAX_JOB_SIZE (64*1024)
+#define MAX_JOB_ARGS 256
+#define MAX_ALLOWED_PATHS 16
+#define DAEMON_CHALLENGE_SIZE 32
+
+#define PIPE_DRAIN_POLL_US 200
+
+#define DEFAULT_TRACE_EVENTS (256*1024)
+
+#define MAX_EXTENTS (1024*1024)
+
+#define CACHE_BLOCK_SIZE (1024*1024)
+#define CACHE_INDEX_ENTRIES (1024*1024)
+#define MAX_HASHES (4*1024*1024)
+
+#define NBD_MAX_REQUEST (32*1024*1024)
+#define NBD_MAX_FETCHED 64
+
+#define FETCH_SIZE (1024*1024)
+#define MAX_FETCHES 64
+
+#define REPORT_INTERVAL_MS 1000
+#define MAX_REPORTS 128
@@ -1,13 +1,19 @@
+#include "defaults.h"
 #include "engine.h"
 #include "macro.h"
+#include "placement.h"
+#include "report.h"
 #include "stats.h"
 #include "struct.h"
+#include "trace.h"
+#include "util.h"
 
 #include <assert.h>
 #include <errno.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <sys/epoll.h>
+#include <sys/mman.h>
 #include <time.h>
 #include <unistd.h>
 
@@ -18,15 +24,38 @@ uint64_t min(uint64_t a, uint64_t b) {
   return a < b ? a : b;
 }
 
+uint64_t max(uint64_t a, uint64_t b) {
+  return a > b ? a : b;
+}
+
+// Besides the producer and consumers, there are the consumers listening for
+// receivers which join late, and the ones watched for ranges they want, or
+// the producer for the ranges it fetched.
 struct entry {
-  enum { P, C } type;
+  enum { P, C, L, W } type;
   union {
     struct producer *producer;
     struct consumer *consumer;
   };
   uint64_t offset;
+  size_t block_size;
   bool was_busy;
   bool busy;
+  // What was offered to the entry in the call it's busy with.
+  uint64_t pending;
+  bool finished;
+  // Since when the entry waits for the others, for the trace.
+  uint64_t stalled_since;
+
+  // Consumers with a spill area keep the stream from spill_from to spilled
+  // there instead of in the buffer, and are fed from it through bounce.
+  struct spill spill;
+  uint64_t spill_from;
+  uint64_t spilled;
+  char *bounce;
+
+  // Where the wanted ranges come, until there will be no more.
+  int wanted_fd;
 };
 
 uint64_t min_offset(struct entry *index, size_t num_consumers) {
@@ -36,6 +65,69 @@ uint64_t min_offset(struct entry *index, size_t num_consumers) {
   return rv;
 }
 
+static bool reads_spill(const struct entry *entry) {
+  return entry->spilled > entry->offset && entry->offset >= entry->spill_from;
+}
+
+// Offset from which the consumer still needs the data in the buffer.
+static uint64_t hold_offset(const struct entry *entry) {
+  return reads_spill(entry) ? entry->spilled : entry->offset;
+}
+
+static uint64_t min_hold_offset(struct entry *index, size_t num_consumers) {
+  uint64_t rv = UINT64_MAX;
+  for (size_t i = 0; i != num_consumers; ++i)
+    rv = min(rv, hold_offset(&index[1+i]));
+  return rv;
+}
+
+// Moves up to a block of the consumer's backlog from the buffer to its
+// spill area. Returns the number of bytes moved.
+static ssize_t spill_block(struct entry *entry, const char *buffer,
+                           size_t buffer_size, uint64_t begin) {
+  if (entry->spill.fd == -1)
+    return 0;
+
+  // The part the consumer is busy with stays in the buffer, and the rest is
+  // freed once it's done with it.
+  if (entry->spilled <= entry->offset)
+    entry->spill_from = entry->spilled =
+        entry->offset + (entry->busy ? entry->pending : 0);
+
+  uint64_t room = entry->spill.size -
+      (entry->spilled - max(entry->offset, entry->spill_from));
+  uint64_t count = min(min(entry->block_size, begin - entry->spilled), room);
+  count = min(count, buffer_size - entry->spilled % buffer_size);
+  count = min(count, entry->spill.size - entry->spilled % entry->spill.size);
+  if (!count)
+    return 0;
+
+  const char *from = buffer + entry->spilled % buffer_size;
+  off_t to = entry->spilled % entry->spill.size;
+  for (size_t written = 0; written != count;) {
+    ssize_t rv = pwrite(entry->spill.fd, from + written, count - written,
+                        to + written);
+    CHECK(SYSCALL(rv),
+          PERROR1("failed to spill for", CALL0(*entry->consumer, name)),
+          return -1);
+    written += rv;
+  }
+
+  entry->spilled += count;
+  return count;
+}
+
+static ssize_t read_spill(struct entry *entry) {
+  uint64_t count = min(entry->block_size, entry->spilled - entry->offset);
+  count = min(count, entry->spill.size - entry->offset % entry->spill.size);
+  ssize_t rv = pread(entry->spill.fd, entry->bounce, count,
+                     entry->offset % entry->spill.size);
+  CHECK(SYSCALL(rv) && rv != 0,
+        PERROR1("failed to read spill for", CALL0(*entry->consumer, name)),
+        return -1);
+  return rv;
+}
+
 static bool adjust_wait(int epoll_fd, struct entry *entry) {
   if (entry->was_busy == entry->busy)
     return true;
@@ -65,59 +157,409 @@ static bool adjust_wait(int epoll_fd, struct entry *entry) {
   return true;
 }
 
-static void prepare(struct state *const state, struct entry *const index) {
+static struct entry consumer_entry(struct consumer *consumer,
+                                   uint64_t offset) {
+  return (struct entry) {
+    .type = C,
+    .consumer = consumer,
+    .offset = offset,
+    .block_size = CALL0(*consumer, get_block_size),
+    .was_busy = false,
+    .busy = false,
+    .pending = 0,
+    .finished = false,
+    .stalled_since = 0,
+    .spill = { -1, 0 },
+    .spill_from = 0,
+    .spilled = 0,
+    .bounce = NULL
+  };
+}
+
+// Consumers are served in the order of their priority, and otherwise in
+// the order they were given. Consumer i goes after the ones before it.
+static void place_in_order(struct state *const state, size_t *const order,
+                           size_t i) {
+  int priority = CALL0(state->consumers[i], get_priority);
+  size_t j = i;
+  for (; j != 0 &&
+         CALL0(state->consumers[order[j-1]], get_priority) < priority; --j)
+    order[j] = order[j-1];
+  order[j] = i;
+}
+
+static bool prepare(struct state *const state, struct entry *const index,
+                    size_t *const order) {
   index[0] = (struct entry) {
     .type = P,
     .producer = &state->producer,
     .offset = 0,
+    .block_size = CALL0(state->producer, get_block_size),
     .was_busy = false,
-    .busy = false
+    .busy = false,
+    .pending = 0,
+    .finished = false,
+    .stalled_since = 0,
+    .spill = { -1, 0 },
+    .bounce = NULL
   };
 
+  for (size_t i = 0; i != state->num_consumers; ++i)
+    index[1+i] = consumer_entry(&state->consumers[i], 0);
+
   for (size_t i = 0; i != state->num_consumers; ++i) {
-    index[1+i] = (struct entry) {
-      .type = C,
-      .consumer = &state->consumers[i],
-      .offset = 0,
-      .was_busy = false,
-      .busy = false
-    };
+    struct entry *entry = &index[1+i];
+    if (CALL(*entry->consumer, get_spill, &entry->spill))
+      CHECK(posix_memalign((void **)&entry->bounce, DIRECT_IO_ALIGNMENT,
+                           entry->block_size) == 0,
+            ERROR("can't allocate memory for spill"), return false);
+    else
+      entry->spill.fd = -1;
   }
+
+  for (size_t i = 0; i != state->num_consumers; ++i)
+    place_in_order(state, order, i);
+  return true;
 }
 
-bool transfer(size_t buffer_size, size_t block_size,
-              struct state *const state) {
+// Consumers are finished as soon as they are done with the stream, so that
+// the next hop sees its end without waiting for slower local consumers.
+static bool finish(struct entry *entry) {
+  if (entry->finished)
+    return true;
+  entry->finished = true;
+  CHECK(CALL0(*entry->consumer, finish),
+        fprintf(stderr, "failed to finish %s\n",
+                CALL0(*entry->consumer, name)),
+        return false);
+  return true;
+}
+
+// Free part of the buffer the producer can fill next. When it's cut by the
+// end of the buffer, it won't grow no matter how much is consumed.
+static uint64_t free_region(uint64_t begin, uint64_t end, size_t buffer_size,
+                            uint64_t *offset, bool *clip) {
+  uint64_t sbegin = begin % buffer_size;
+  uint64_t send = end % buffer_size;
+
+  *offset = sbegin;
+  *clip = true;
+  if (sbegin > send)
+    return buffer_size - sbegin;
+  else if (sbegin < send) {
+    *clip = false;
+    return send - sbegin;
+  } else if (begin == end)
+    return buffer_size - sbegin;
+  return 0;
+}
+
+// Endpoints wait for their peers all at once, so that a chain is set up in
+// the time of its slowest hop rather than the sum of them.
+bool connect_endpoints(struct state *const state) {
   bool rv = true;
-  struct entry index[1+MAX_CONSUMERS];
+  bool ready[1+MAX_CONSUMERS] = {false};
+  bool watched[1+MAX_CONSUMERS] = {false};
   struct epoll_event events[1+MAX_CONSUMERS];
+  int epoll_fd = -1;
+
+#define FAIL_IF_NOT(cond, alert) \
+  CHECK(cond, alert, GOTO_WITH(cleanup, rv, false))
+
+  FAIL_IF_NOT(SYSCALL(epoll_fd = epoll_create(1)),
+              perror("failed to create epoll fd"));
+
+  for (;;) {
+    size_t waiting = 0;
+    for (size_t i = 0; i != 1 + state->num_consumers; ++i) {
+      if (ready[i])
+        continue;
+
+      int fd = -1;
+      int status = (i == 0) ?
+          CALL(state->producer, setup, &fd) :
+          CALL(state->consumers[i-1], setup, &fd);
+      FAIL_IF_NOT(status != -1, ;);
+      if (status == 1) {
+        ready[i] = true;
+        continue;
+      }
+
+      // One shot, so that endpoints which are ready are not watched anymore
+      // and the ones still waiting are rearmed.
+      struct epoll_event ev = {
+        .events = EPOLLIN | EPOLLONESHOT, .data.u32 = i
+      };
+      FAIL_IF_NOT(SYSCALL(epoll_ctl(epoll_fd,
+                                    watched[i] ? EPOLL_CTL_MOD : EPOLL_CTL_ADD,
+                                    fd, &ev)),
+                  perror("epoll_ctl() failed"));
+      watched[i] = true;
+      ++waiting;
+    }
+
+    if (!waiting)
+      break;
+
+    int num_events = epoll_wait(epoll_fd, events, waiting, -1);
+    if (num_events == -1 && errno == EINTR)
+      continue;
+    FAIL_IF_NOT(SYSCALL(num_events), perror("epoll_wait failed"));
+  }
+
+#undef FAIL_IF_NOT
+
+cleanup:
+  COND_CHECK(epoll_fd, -1, SYSCALL(close(epoll_fd)),
+             perror("failed to close epoll fd"));
+  return rv;
+}
+
+// A receiver which joins gets the stream from where the producer is, and
+// the part before that once the stream is over, so only producers which
+// can start over take them. The stream goes on without the ones which
+// can't be taken.
+static void join(struct state *const state, struct entry *const index,
+                 size_t *const order, struct consumer *listener, bool eof) {
+  struct consumer joiner = {NULL, NULL};
+  CHECK(CALL(*listener, accept_joiner, &joiner),
+        ERROR("warning: failed to accept late receiver"), return);
+  if (is_empty_consumer(&joiner))
+    return;
+
+  struct stream_info info = state->info;
+  info.origin = index[0].offset;
+  CHECK(!eof && state->num_consumers != MAX_CONSUMERS &&
+        info.size_known && !state->info.origin &&
+        CALL0(state->producer, can_rewind),
+        ERROR("warning: can't take late receiver"), goto reject);
+  CHECK(CALL(joiner, start, &info),
+        ERROR("warning: failed to start late receiver"), goto reject);
+
+  size_t i = state->num_consumers++;
+  state->consumers[i] = joiner;
+  index[1+i] = consumer_entry(&state->consumers[i], info.origin);
+  place_in_order(state, order, i);
+  return;
+
+reject:
+  CALL0(joiner, destroy);
+}
+
+// Ranges which consumers want ahead of their turn are asked of the producer
+// as soon as they come, and what it fetched goes to all the consumers which
+// are still on the stream.
+static bool pass_fetched(struct state *const state, struct entry *const index,
+                         struct entry *wanted, size_t num_wanted,
+                         int epoll_fd, bool *progressed) {
+  for (size_t i = 0; i != num_wanted; ++i) {
+    struct entry *entry = &wanted[i];
+    if (entry->wanted_fd == -1)
+      continue;
+    struct extent extent;
+    // Those the producer can't fetch come with the rest of the stream.
+    while (CALL(*entry->consumer, get_wanted, &extent))
+      CALL(state->producer, fetch, &extent);
+    if (CALL0(*entry->consumer, get_wanted_fd) == -1) {
+      CHECK(SYSCALL(epoll_ctl(epoll_fd, EPOLL_CTL_DEL, entry->wanted_fd,
+                              NULL)),
+            perror("epoll_ctl() failed"), return false);
+      entry->wanted_fd = -1;
+    }
+  }
+
+  struct fetched fetched;
+  while (CALL(state->producer, take_fetched, &fetched)) {
+    *progressed = true;
+    for (size_t i = 0; i != state->num_consumers; ++i)
+      if (!index[1+i].finished)
+        CHECK(CALL(state->consumers[i], put_fetched, &fetched),
+              fprintf(stderr, "failed to pass fetched range to %s\n",
+                      CALL0(state->consumers[i], name)),
+              return false);
+  }
+  return true;
+}
+
+// Rather than sleep right away, look for a while for the busy endpoints to
+// be done, both through their poll() and epoll without blocking. Returns
+// what epoll_wait() would, with no events when the budget ran out.
+static int spin(int epoll_fd, struct entry *const index, size_t num_entries,
+                struct epoll_event *events, size_t waiting,
+                uint64_t budget_ns) {
+  uint64_t deadline = get_time_ns() + budget_ns;
+  do {
+    int num_events = 0;
+    for (size_t i = 0; i != num_entries; ++i) {
+      struct entry *entry = &index[i];
+      if (entry->busy && (entry->type == P ?
+                          CALL0(*entry->producer, poll) :
+                          CALL0(*entry->consumer, poll)))
+        events[num_events++].data.ptr = entry;
+    }
+    if (!num_events)
+      num_events = epoll_wait(epoll_fd, events, waiting, 0);
+    if (num_events)
+      return num_events;
+  } while (get_time_ns() < deadline);
+  return 0;
+}
+
+bool transfer(size_t buffer_size, struct state *const state) {
+  bool rv = true;
+  struct entry index[1+MAX_CONSUMERS];
+  size_t order[MAX_CONSUMERS];
+  struct entry listeners[MAX_CONSUMERS];
+  size_t num_listeners = 0;
+  struct entry wanted[MAX_CONSUMERS];
+  size_t num_wanted = 0;
+  struct entry fetcher = { .type = W };
+  struct epoll_event events[2+3*MAX_CONSUMERS];
   char *buffer = NULL;
+  char *allocated = NULL;
   int epoll_fd = -1;
   bool eof = false;
   size_t waiting = 0;
+  size_t watched = 0;
+  bool progressed = false;
+  struct meter meter;
+  // The consumer which held the buffer when the producer stalled.
+  size_t held_by = 0;
+  uint64_t held_at = 0;
+  uint64_t transfer_begin = get_time_ns();
+  uint64_t idle_ns = 0;
 
 #define FAIL_IF_NOT(cond, alert) \
   CHECK(cond, alert, GOTO_WITH(cleanup, rv, false))
 
+  for (size_t i = 0; i != state->num_consumers; ++i)
+    index[1+i].bounce = NULL;
+
   FAIL_IF_NOT(SYSCALL(epoll_fd = epoll_create(1)),
               perror("failed to create epoll fd"));
 
-  FAIL_IF_NOT(buffer = malloc(buffer_size),
-              ERROR("can't allocate memory for buffer"));
+  // A consumer which shares its ring with other processes hands them the
+  // stream without copies when the engine uses the ring as its buffer.
+  for (size_t i = 0; i != state->num_consumers; ++i) {
+    char *ring = NULL;
+    FAIL_IF_NOT(CALL(state->consumers[i], map_ring, buffer_size, &ring), ;);
+    if (!buffer)
+      buffer = ring;
+  }
 
-  prepare(state, index);
+  // Page-aligned for the producers and consumers which bypass page cache,
+  // and for the producers which map their input into the buffer.
+  if (!buffer && state->ring && state->ring_size >= buffer_size)
+    buffer = state->ring;
+  if (!buffer) {
+    allocated = mmap(NULL, buffer_size, PROT_READ | PROT_WRITE,
+                     MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    FAIL_IF_NOT(allocated != MAP_FAILED,
+                allocated = NULL; ERROR("can't allocate memory for buffer"));
+    buffer = allocated;
+  }
+  CALL(state->producer, set_private_ring, buffer == allocated);
+  if (state->node != NODE_UNKNOWN)
+    FAIL_IF_NOT(bind_to_node(buffer, buffer_size, state->node), ;);
+
+  FAIL_IF_NOT(prepare(state, index, order), ;);
+  for (size_t i = 0; i != state->num_consumers; ++i) {
+    int fd = CALL0(state->consumers[i], get_listen_fd);
+    if (fd == -1)
+      continue;
+    if (!CALL0(state->producer, can_rewind))
+      ERROR("warning: the stream can't be replayed, late receivers will be "
+            "turned away");
+    struct entry *listener = &listeners[num_listeners++];
+    listener->type = L;
+    listener->consumer = &state->consumers[i];
+    struct epoll_event ev = { .events = EPOLLIN, .data.ptr = listener };
+    FAIL_IF_NOT(SYSCALL(epoll_ctl(epoll_fd, EPOLL_CTL_ADD, fd, &ev)),
+                perror("epoll_ctl() failed"));
+  }
+  for (size_t i = 0; i != state->num_consumers; ++i) {
+    int fd = CALL0(state->consumers[i], get_wanted_fd);
+    if (fd == -1)
+      continue;
+    struct entry *entry = &wanted[num_wanted++];
+    entry->type = W;
+    entry->consumer = &state->consumers[i];
+    entry->wanted_fd = fd;
+    struct epoll_event ev = { .events = EPOLLIN, .data.ptr = entry };
+    FAIL_IF_NOT(SYSCALL(epoll_ctl(epoll_fd, EPOLL_CTL_ADD, fd, &ev)),
+                perror("epoll_ctl() failed"));
+  }
+  watched = num_listeners + num_wanted;
+  if (num_wanted && CALL0(state->producer, get_fetched_fd) != -1) {
+    fetcher.producer = &state->producer;
+    struct epoll_event ev = { .events = EPOLLIN, .data.ptr = &fetcher };
+    FAIL_IF_NOT(SYSCALL(epoll_ctl(epoll_fd, EPOLL_CTL_ADD,
+                                  CALL0(state->producer, get_fetched_fd),
+                                  &ev)),
+                perror("epoll_ctl() failed"));
+    ++watched;
+  }
+  start_meter(&meter, 0);
 
   for (;;) {
     INC(state->stats, total_cycles);
 
+    if (!get_report_timeout(&meter)) {
+      uint64_t begin = index[0].offset;
+      CHECK(send_reports(state, &meter, begin,
+                         begin - min_offset(index, state->num_consumers),
+                         buffer_size),
+            ERROR("warning: failed to report on the chain"), ;);
+    }
+
+    // Only block when nothing could be done without waiting, so that the
+    // others are not held back until the slowest busy endpoint is done.
     if (waiting) {
-      INC(state->stats, waited_cycles);
-      int num_events;
-      num_events = epoll_wait(epoll_fd, events, waiting, -1);
+      if (!progressed)
+        INC(state->stats, waited_cycles);
+      int num_events = 0;
+      uint64_t wait_begin = get_time_ns();
+      if (!progressed && state->busy_poll_ns) {
+        num_events = spin(epoll_fd, index, 1 + state->num_consumers,
+                          events, waiting + watched,
+                          state->busy_poll_ns);
+        uint64_t spun = get_time_ns() - wait_begin;
+        ADD(state->stats, spin_ns, spun);
+        meter.spin_ns += spun;
+        idle_ns += spun;
+        if (num_events)
+          INC(state->stats, spin_wakeups);
+        else
+          INC(state->stats, spin_timeouts);
+      }
+      if (!num_events) {
+        uint64_t sleep_begin = get_time_ns();
+        num_events = epoll_wait(epoll_fd, events, waiting + watched,
+                                progressed ? 0 : get_report_timeout(&meter));
+        if (!progressed) {
+          uint64_t slept = get_time_ns() - sleep_begin;
+          ADD(state->stats, sleep_ns, slept);
+          idle_ns += slept;
+        }
+      }
+      if (!progressed) {
+        uint64_t waited = get_time_ns() - wait_begin;
+        meter_wait(&meter, waited,
+                   index[0].offset == min_offset(index, state->num_consumers));
+        if (num_events > 0)
+          TRACE(wakeup, NULL, wait_begin, waited, index[0].offset, num_events);
+      }
       if (num_events == -1 && errno == EINTR)
         continue;
       FAIL_IF_NOT(SYSCALL(num_events), perror("epoll_wait failed"));
       for (int i = 0; i != num_events; ++i) {
         struct entry *entry = events[i].data.ptr;
+        if (entry->type == L) {
+          join(state, index, order, entry->consumer, eof);
+          continue;
+        }
+        if (entry->type == W)
+          continue;
         assert(entry->busy);
         ssize_t moved;
         switch (entry->type) {
@@ -137,45 +579,77 @@ bool transfer(size_t buffer_size, size_t block_size,
         waiting -= 1;
       }
     }
+    progressed = false;
 
+    meter.full = false;
     {
       uint64_t begin = index[0].offset;
-      uint64_t end = min_offset(index, state->num_consumers);
-      assert(begin >= end);
+      assert(begin >= min_offset(index, state->num_consumers));
 
-      if (begin == end && eof)
+      if (begin == min_offset(index, state->num_consumers) && eof)
         break;
 
-      uint64_t sbegin = begin % buffer_size;
-      uint64_t send = end % buffer_size;
-
       if (!index[0].busy) {
-        uint64_t offset = 0, size = 0;
-        if (sbegin > send) {
-          offset = sbegin;
-          size = buffer_size - sbegin;
-        } else if (sbegin < send) {
-          offset = sbegin;
-          size = send - sbegin;
-        } else if (begin == end) {
-          offset = sbegin;
-          size = buffer_size - sbegin;
+        uint64_t end = min_hold_offset(index, state->num_consumers);
+        uint64_t offset;
+        bool clip;
+        uint64_t size = free_region(begin, end, buffer_size, &offset, &clip);
+        size_t lo_watermark = CALL0(*index[0].producer, get_lo_watermark);
+
+        // Rather than wait for the consumers holding up the buffer, move
+        // their backlog to spill areas.
+        for (bool spilled = true;
+             !eof && spilled && !(size && (clip || size >= lo_watermark));) {
+          spilled = false;
+          for (size_t i = 0; i != state->num_consumers; ++i) {
+            struct entry *entry = &index[1+i];
+            if (hold_offset(entry) != end)
+              continue;
+            ssize_t moved = spill_block(entry, buffer, buffer_size, begin);
+            FAIL_IF_NOT(moved != -1, ;);
+            ADD(state->stats, spilled_bytes[i], moved);
+            spilled = spilled || moved;
+            progressed = progressed || moved;
+          }
+          end = min_hold_offset(index, state->num_consumers);
+          size = free_region(begin, end, buffer_size, &offset, &clip);
         }
 
         if (!eof) {
-          if (size) {
+          if (size && (clip || size >= lo_watermark)) {
+            if (index[0].stalled_since) {
+              uint64_t now = get_time_ns();
+              TRACE(overrun, CALL0(state->consumers[held_by], name),
+                    index[0].stalled_since, now - index[0].stalled_since,
+                    held_at, begin - held_at);
+              index[0].stalled_since = 0;
+            }
             ssize_t produced;
+            size_t read_ahead = CALL0(*index[0].producer, get_read_ahead);
+            uint64_t call_begin = get_time_ns();
             FAIL_IF_NOT(
                 (produced = CALL(*index[0].producer, produce,
-                    buffer+offset, min(block_size, size), &eof)) != -1, ;);
-
-            waiting += (index[0].busy = (produced == 0));
+                    buffer+offset,
+                    min(index[0].block_size * read_ahead, size),
+                    &eof)) != -1, ;);
+            meter.producer_ns += get_time_ns() - call_begin;
+
+            // There's nothing to wait for once the stream is over.
+            waiting += (index[0].busy = (produced == 0 && !eof));
+            progressed = progressed || produced;
             index[0].offset += produced;
           } else {
             INC(state->stats, buffer_overruns);
+            meter.full = true;
             for (size_t i = 0; i != state->num_consumers; ++i) {
-              if (index[1+i].offset == end)
+              meter.holding[i] = (hold_offset(&index[1+i]) == end);
+              if (meter.holding[i])
                 INC(state->stats, consumer_slowdowns[i]);
+              if (meter.holding[i] && !index[0].stalled_since) {
+                index[0].stalled_since = get_time_ns();
+                held_by = i;
+                held_at = end;
+              }
             }
           }
         }
@@ -184,10 +658,28 @@ bool transfer(size_t buffer_size, size_t block_size,
       }
     }
 
+    FAIL_IF_NOT(pass_fetched(state, index, wanted, num_wanted, epoll_fd,
+                             &progressed), ;);
+
     {
       uint64_t begin = index[0].offset;
-      for (size_t i = 0; i != state->num_consumers; ++i) {
-        if (!index[1+i].busy) {
+      for (size_t k = 0; k != state->num_consumers; ++k) {
+        size_t i = order[k];
+        if (!index[1+i].busy && reads_spill(&index[1+i])) {
+          ssize_t count, consumed;
+          FAIL_IF_NOT((count = read_spill(&index[1+i])) != -1, ;);
+          index[1+i].pending = count;
+          uint64_t call_begin = get_time_ns();
+          FAIL_IF_NOT(
+              (consumed = CALL(*index[1+i].consumer, consume,
+                               index[1+i].bounce, count)) != -1, ;);
+          meter.consumer_ns[i] += get_time_ns() - call_begin;
+
+          waiting += (index[1+i].busy = (consumed == 0));
+          progressed = progressed || consumed;
+          index[1+i].offset += consumed;
+          FAIL_IF_NOT(adjust_wait(epoll_fd, &index[1+i]), ;);
+        } else if (!index[1+i].busy) {
           uint64_t end = index[1+i].offset;
           assert(begin >= end);
 
@@ -211,30 +703,78 @@ bool transfer(size_t buffer_size, size_t block_size,
           if (size) {
             if (eof || clip ||
                 size >= CALL0(*index[1+i].consumer, get_lo_watermark)) {
+              if (index[1+i].stalled_since) {
+                uint64_t now = get_time_ns();
+                TRACE(underrun, CALL0(*index[1+i].consumer, name),
+                      index[1+i].stalled_since,
+                      now - index[1+i].stalled_since, end, size);
+                index[1+i].stalled_since = 0;
+              }
               ssize_t consumed;
+              index[1+i].pending = min(index[1+i].block_size, size);
+              uint64_t call_begin = get_time_ns();
               FAIL_IF_NOT(
                   (consumed = CALL(*index[1+i].consumer, consume,
                                    buffer+offset,
-                                   min(block_size, size))) != -1, ;);
+                                   index[1+i].pending)) != -1, ;);
+              meter.consumer_ns[i] += get_time_ns() - call_begin;
 
               waiting += (index[1+i].busy = (consumed == 0));
+              progressed = progressed || consumed;
               index[1+i].offset += consumed;
             }
           } else {
             INC(state->stats, buffer_underruns);
+            if (!index[1+i].stalled_since)
+              index[1+i].stalled_since = get_time_ns();
           }
 
           FAIL_IF_NOT(adjust_wait(epoll_fd, &index[1+i]), ;);
         }
+
+        if (eof && !index[1+i].busy && index[1+i].offset == begin)
+          FAIL_IF_NOT(finish(&index[1+i]), ;);
       }
     }
   }
 
+  for (size_t i = 0; i != state->num_consumers; ++i)
+    FAIL_IF_NOT(finish(&index[1+i]), ;);
+  ADD(state->stats, work_ns, get_time_ns() - transfer_begin - idle_ns);
+
 #undef FAIL_IF_NOT
 
 cleanup:
-  free(buffer);
+  for (size_t i = 0; i != state->num_consumers; ++i)
+    free(index[1+i].bounce);
+  if (allocated)
+    CHECK(SYSCALL(munmap(allocated, buffer_size)),
+          perror("failed to free buffer"), rv = false);
   COND_CHECK(epoll_fd, -1, SYSCALL(close(epoll_fd)),
              perror("failed to close epoll fd"));
   return rv;
 }
+
+// Receivers which joined late get the beginning of the stream they missed
+// in one more pass over the source, which serves all of them at once.
+bool replay(size_t buffer_size, struct state *const state) {
+  struct state missed = *state;
+  missed.num_consumers = 0;
+  missed.stats = NULL;
+  missed.chain_filename = NULL;
+
+  uint64_t end = 0;
+  for (size_t i = 0; i != state->num_consumers; ++i) {
+    uint64_t count = CALL0(state->consumers[i], get_missed);
+    if (count) {
+      missed.consumers[missed.num_consumers++] = state->consumers[i];
+      end = max(end, count);
+    }
+  }
+  if (!missed.num_consumers)
+    return true;
+
+  CHECK(CALL(state->producer, rewind, end),
+        ERROR("can't replay the stream for late receivers"), return false);
+  return transfer(buffer_size, &missed);
+}
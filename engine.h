@@ -4,4 +4,6 @@
 #include "stddef.h"
 
 struct state;
-bool transfer(size_t buffer_size, size_t block_size, struct state *const state);
+bool connect_endpoints(struct state *const state);
+bool transfer(size_t buffer_size, struct state *const state);
+bool replay(size_t buffer_size, struct state *const state);
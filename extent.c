@@ -0,0 +1,138 @@
+#include "defaults.h"
+#include "extent.h"
+#include "macro.h"
+#include "struct.h"
+
+#include <linux/fiemap.h>
+#include <linux/fs.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <sys/ioctl.h>
+
+#define FIEMAP_BATCH 256
+
+static bool append(struct extent **extents, size_t *num_extents,
+                   size_t *capacity, uint64_t offset, uint64_t length) {
+  CHECK(*num_extents != MAX_EXTENTS,
+        fprintf(stderr, "more than %d extents\n", MAX_EXTENTS), return false);
+  if (*num_extents == *capacity) {
+    size_t size = *capacity ? 2 * *capacity : FIEMAP_BATCH;
+    struct extent *grown = realloc(*extents, size * sizeof(struct extent));
+    CHECK(grown, ERROR("can't allocate memory for extents"), return false);
+    *extents = grown;
+    *capacity = size;
+  }
+  (*extents)[(*num_extents)++] = (struct extent) {offset, length};
+  return true;
+}
+
+bool read_extent_list(const char *path, struct extent **extents,
+                      size_t *num_extents) {
+  FILE *file = fopen(path, "r");
+  CHECK(file, PERROR1("failed to open extent list", path), return false);
+
+  bool rv = true;
+  size_t capacity = 0;
+  *extents = NULL;
+  *num_extents = 0;
+  uint64_t offset, length;
+  int read;
+  while (rv && (read = fscanf(file, "%"SCNu64" %"SCNu64,
+                              &offset, &length)) == 2)
+    rv = append(extents, num_extents, &capacity, offset, length);
+  CHECK(!rv || (read == EOF && !ferror(file)),
+        fprintf(stderr, "bad extent list %s\n", path), rv = false);
+
+  fclose(file);
+  if (!rv)
+    free(*extents);
+  return rv;
+}
+
+bool get_file_extents(int fd, const char *name, struct extent **extents,
+                      size_t *num_extents) {
+  struct fiemap *map = malloc(sizeof(struct fiemap) +
+                              FIEMAP_BATCH * sizeof(struct fiemap_extent));
+  CHECK(map, ERROR("can't allocate memory for extent map"), return false);
+
+  bool rv = true;
+  size_t capacity = 0;
+  *extents = NULL;
+  *num_extents = 0;
+  for (uint64_t start = 0; rv;) {
+    map->fm_start = start;
+    map->fm_length = FIEMAP_MAX_OFFSET - start;
+    map->fm_flags = FIEMAP_FLAG_SYNC;
+    map->fm_extent_count = FIEMAP_BATCH;
+    map->fm_reserved = 0;
+    CHECK(SYSCALL(ioctl(fd, FS_IOC_FIEMAP, map)),
+          PERROR1("failed to map extents of", name), rv = false; break);
+    if (!map->fm_mapped_extents)
+      break;
+
+    bool last = false;
+    for (uint32_t i = 0; rv && i != map->fm_mapped_extents; ++i) {
+      const struct fiemap_extent *extent = &map->fm_extents[i];
+      rv = append(extents, num_extents, &capacity, extent->fe_logical,
+                  extent->fe_length);
+      last = extent->fe_flags & FIEMAP_EXTENT_LAST;
+      start = extent->fe_logical + extent->fe_length;
+    }
+    if (last)
+      break;
+  }
+
+  free(map);
+  if (!rv)
+    free(*extents);
+  return rv;
+}
+
+bool check_extents(const struct extent *extents, size_t num_extents,
+                   uint64_t size, uint64_t total) {
+  uint64_t end = 0;
+  for (size_t i = 0; i != num_extents; ++i) {
+    const struct extent *extent = &extents[i];
+    if (extent->offset < end || !extent->length || extent->offset > size ||
+        extent->length > size - extent->offset ||
+        extent->length > total)
+      return false;
+    end = extent->offset + extent->length;
+    total -= extent->length;
+  }
+  return !total;
+}
+
+static int compare_extents(const void *a, const void *b) {
+  uint64_t x = ((const struct extent *)a)->offset;
+  uint64_t y = ((const struct extent *)b)->offset;
+  return (x > y) - (x < y);
+}
+
+size_t normalize_extents(struct extent *extents, size_t num_extents,
+                         uint64_t size, uint64_t alignment) {
+  qsort(extents, num_extents, sizeof(struct extent), compare_extents);
+
+  size_t num = 0;
+  for (size_t i = 0; i != num_extents; ++i) {
+    uint64_t begin = extents[i].offset;
+    uint64_t end = (begin > size || extents[i].length > size - begin) ?
+        size : begin + extents[i].length;
+    begin -= begin % alignment;
+    if (end % alignment && end < size)
+      end += alignment - end % alignment;
+    if (end > size)
+      end = size;
+    if (begin >= end)
+      continue;
+
+    struct extent *last = num ? &extents[num-1] : NULL;
+    if (last && begin <= last->offset + last->length) {
+      if (end > last->offset + last->length)
+        last->length = end - last->offset;
+    } else {
+      extents[num++] = (struct extent) {begin, end - begin};
+    }
+  }
+  return num;
+}
@@ -0,0 +1,26 @@
+#pragma once
+
+#include <inttypes.h>
+#include <stdbool.h>
+#include <stddef.h>
+
+// Lists of the extents of an image which an incremental transfer sends,
+// such as the ones which changed since a snapshot.
+struct extent;
+
+// A text file with the offset and length of an extent in bytes per line.
+extern bool read_extent_list(const char *path, struct extent **extents,
+                             size_t *num_extents);
+// The extents of a file which are allocated on its filesystem.
+extern bool get_file_extents(int fd, const char *name,
+                             struct extent **extents, size_t *num_extents);
+
+// Whether the extents are in order, don't overlap, aren't empty and lie
+// within an image of size bytes, adding up to total.
+extern bool check_extents(const struct extent *extents, size_t num_extents,
+                          uint64_t size, uint64_t total);
+
+// Sorts the extents and widens them to the alignment, clipped to the size
+// of the image, merging the ones which then touch. Returns the new number.
+extern size_t normalize_extents(struct extent *extents, size_t num_extents,
+                                uint64_t size, uint64_t alignment);
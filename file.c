@@ -1,41 +1,301 @@
+#include "cache.h"
+#include "defaults.h"
+#include "extent.h"
 #include "file.h"
 #include "macro.h"
+#include "nbd.h"
+#include "stats.h"
 #include "struct.h"
+#include "trace.h"
+#include "util.h"
 
 #include <assert.h>
 #include <errno.h>
 #include <fcntl.h>
 #include <linux/aio_abi.h>
+#include <linux/fs.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <sys/epoll.h>
 #include <sys/eventfd.h>
+#include <sys/ioctl.h>
 #include <sys/stat.h>
 #include <sys/syscall.h>
 #include <sys/types.h>
 #include <unistd.h>
 
+struct request {
+  struct iocb cb;
+  int64_t res;
+  bool done;
+  uint64_t submitted_ns;
+};
+
+// Requests are kept in a ring in submission order, so that their results
+// are delivered to the engine in order even if they complete out of it.
 struct data {
   size_t lo_watermark;
+  size_t block_size;
+  size_t read_ahead;
+  size_t depth;
   int fd;
+  // Parts of the stream which can't be written bypassing page cache are
+  // written through this one, and ranges fetched ahead of the stream are
+  // read through it.
+  int bfd;
   int afd;
   aio_context_t ctx;
-  struct iocb cb;
+  struct request requests[MAX_READ_AHEAD];
+  size_t head;
+  size_t queued;
 
   uint64_t offset;
+  uint64_t submitted;
+  bool eof;
+  bool direct;
+  bool regular;
+  uint64_t size;
+  // A reader which is rewound ends at end. A writer of a stream which
+  // starts at origin wraps around to the start of the file at its size.
+  uint64_t end;
+  uint64_t origin;
+  uint64_t stream_size;
+  // A reader of stripe `stripe` of `stripes` reads stream_size bytes of the
+  // file from base on, and a writer of a stripe puts the stream there.
+  size_t stripe;
+  size_t stripes;
+  uint64_t base;
+  // A reader with a list of extents, from extents_path or, with fiemap,
+  // from the filesystem, only reads those, and a writer of an incremental
+  // stream only writes them. starts are their offsets in the stream.
+  const char *extents_path;
+  bool fiemap;
+  bool incremental;
+  struct extent *extents;
+  uint64_t *starts;
+  size_t num_extents;
+  // A reader with hash hashes the blocks of the stream before it starts,
+  // for the destinations to find the ones they have in their caches.
+  bool hash;
+  unsigned char *hashes;
+  size_t num_hashes;
+
+  // Writeback is started for every `writeback` bytes written, and the
+  // previous range is waited for and dropped from page cache at that time.
+  size_t writeback;
+  uint64_t written_back;
+  uint64_t dropped;
+  enum { NO_SYNC, DATA_SYNC, FULL_SYNC } sync;
+  // Whoever starts ndd can't always truncate the output beforehand.
+  bool truncate;
+  // A writer with nbd serves the output on the unix socket at nbd_path
+  // while it's being written, and after that until the client leaves.
+  const char *nbd_path;
+  struct nbd_server *nbd;
+  // Ranges of the stream which are asked for ahead of the rest are read in
+  // pieces of up to FETCH_SIZE, one at a time, on an aio context of their
+  // own which completes on fetch_fd. fetch_size is the size of the piece
+  // in flight, or 0, and fetch_done how much of it is read.
+  struct extent fetches[MAX_FETCHES];
+  size_t num_fetches;
+  char *fetch_buf;
+  int fetch_fd;
+  aio_context_t fetch_ctx;
+  struct iocb fetch_cb;
+  size_t fetch_size;
+  size_t fetch_done;
+  struct {
+    uint64_t readahead_ns;
+    uint64_t writeback_ns;
+    uint64_t wait_ns;
+    uint64_t drop_ns;
+    uint64_t sync_ns;
+    uint64_t fallocate_ns;
+    uint64_t hash_ns;
+  } times;
+
+  // Scratch file or device where the engine moves the backlog when the
+  // file is written slower than the rest of the chain goes.
+  const char *spill_path;
+  size_t spill_size;
+  int spill_fd;
+
   enum { R, W } mode;
   char filename[];
 };
 
 #define WITH_THIS(act) PERROR1("failed to " act " for", this->filename)
 
+// The extent which the stream's data at offset comes from.
+static size_t find_extent(const struct data *this, uint64_t offset) {
+  size_t first = 0;
+  for (size_t count = this->num_extents; count > 1;) {
+    size_t half = count / 2;
+    if (this->starts[first + half] <= offset)
+      first += half;
+    count -= half;
+  }
+  return first;
+}
+
+static uint64_t position(const struct data *this, uint64_t offset) {
+  if (this->origin)
+    offset = (this->origin + offset) % this->stream_size;
+  if (this->incremental) {
+    size_t i = find_extent(this, offset);
+    return this->extents[i].offset + (offset - this->starts[i]);
+  }
+  return this->base + offset;
+}
+
+// Reading the whole file, or its last stripe or extent, goes on until the
+// file ends, so that direct reads of its unaligned end come out short.
+static uint64_t stream_end(const struct data *this) {
+  uint64_t last = this->base + this->stream_size;
+  if (this->incremental) {
+    if (!this->num_extents)
+      return 0;
+    const struct extent *extent = &this->extents[this->num_extents - 1];
+    last = extent->offset + extent->length;
+  }
+  return last == this->size ? UINT64_MAX : this->stream_size;
+}
+
+// How much of the stream from offset on goes to the file in one piece.
+static uint64_t contiguous(const struct data *this, uint64_t offset,
+                           uint64_t count) {
+  uint64_t room = UINT64_MAX;
+  if (this->origin) {
+    offset = (this->origin + offset) % this->stream_size;
+    room = this->stream_size - offset;
+  }
+  if (this->incremental) {
+    size_t i = find_extent(this, offset);
+    uint64_t left = this->starts[i] + this->extents[i].length - offset;
+    bool open_ended = this->mode == R && this->end == UINT64_MAX &&
+                      i == this->num_extents - 1;
+    if (!open_ended && left < room)
+      room = left;
+  }
+  return count < room ? count : room;
+}
+
+static bool map_extents(struct data *this) {
+  this->starts = malloc((this->num_extents ? this->num_extents : 1) *
+                        sizeof(uint64_t));
+  CHECK(this->starts, ERROR("can't allocate memory for extents"),
+        return false);
+  this->stream_size = 0;
+  for (size_t i = 0; i != this->num_extents; ++i) {
+    this->starts[i] = this->stream_size;
+    this->stream_size += this->extents[i].length;
+  }
+  this->incremental = true;
+  return true;
+}
+
+// The list is cleaned up so that direct reads and writes of the extents
+// stay aligned.
+static bool load_extents(struct data *this) {
+  CHECK(!this->stripes,
+        fprintf(stderr, "%s can't be striped and incremental at once\n",
+                this->filename),
+        return false);
+  if (!(this->fiemap ?
+        get_file_extents(this->fd, this->filename, &this->extents,
+                         &this->num_extents) :
+        read_extent_list(this->extents_path, &this->extents,
+                         &this->num_extents)))
+    return false;
+  this->num_extents = normalize_extents(this->extents, this->num_extents,
+                                        this->size, DIRECT_IO_ALIGNMENT);
+  return map_extents(this);
+}
+
+// The blocks are read through page cache, where the stream then finds them
+// if they fit.
+static bool hash_stream(struct data *this) {
+  uint64_t num = (this->stream_size + CACHE_BLOCK_SIZE - 1) / CACHE_BLOCK_SIZE;
+  CHECK(num <= MAX_HASHES,
+        fprintf(stderr, "%s has too many blocks to hash\n", this->filename),
+        return false);
+  this->hashes = malloc(num ? num * BLOCK_HASH_SIZE : 1);
+  CHECK(this->hashes, ERROR("can't allocate memory for hashes"),
+        return false);
+  char *block = malloc(CACHE_BLOCK_SIZE);
+  CHECK(block, ERROR("can't allocate memory for hashing"), return false);
+  int fd = open(this->filename, O_RDONLY | O_LARGEFILE);
+  CHECK(SYSCALL(fd), WITH_THIS("open for hashing"), free(block); return false);
+
+  bool rv = true;
+  uint64_t begin = get_time_ns();
+  for (uint64_t i = 0; rv && i != num; ++i) {
+    uint64_t offset = i * CACHE_BLOCK_SIZE;
+    size_t size = (this->stream_size - offset < CACHE_BLOCK_SIZE) ?
+        this->stream_size - offset : CACHE_BLOCK_SIZE;
+    for (size_t done = 0; rv && done != size;) {
+      ssize_t read = pread(fd, block + done,
+                           contiguous(this, offset + done, size - done),
+                           position(this, offset + done));
+      CHECK(SYSCALL(read), WITH_THIS("read for hashing"), rv = false);
+      CHECK(!rv || read,
+            fprintf(stderr, "%s got shorter while hashing\n",
+                    this->filename),
+            rv = false);
+      done += rv ? read : 0;
+    }
+    rv = rv && hash_block(block, size, this->hashes + i * BLOCK_HASH_SIZE);
+  }
+  this->times.hash_ns = get_time_ns() - begin;
+  this->num_hashes = num;
+
+  CHECK(SYSCALL(close(fd)), WITH_THIS("close after hashing"), ;);
+  free(block);
+  return rv;
+}
+
+static bool advise(struct data *this, uint64_t offset, uint64_t len,
+                   int advice, uint64_t *time) {
+  uint64_t begin = get_time_ns();
+  int rv = posix_fadvise(this->fd, offset, len, advice);
+  *time += get_time_ns() - begin;
+  errno = rv;
+  CHECK(rv == 0, WITH_THIS("call posix_fadvise"), return false);
+  return true;
+}
+
 static bool init(void *data, size_t block_size) {
   GET(struct data, this, data);
+  if (!this->block_size)
+    this->block_size = block_size;
   int mode = (this->mode == R) ? O_RDONLY : O_WRONLY | O_CREAT;
   mode |= (O_NONBLOCK | O_LARGEFILE);
-  CHECK(SYSCALL(this->fd = open(this->filename, mode, S_IWUSR|S_IRUSR)),
-        WITH_THIS("call open"), return false);
+  if (this->truncate)
+    mode |= O_TRUNC;
+
+  // Buffered AIO is performed synchronously by the kernel, so multiple
+  // readers can only run in parallel when bypassing the page cache. The
+  // same goes for a writer with a spill area: it's only useful if a slow
+  // disk makes the writer lag instead of blocking the engine.
+  this->direct = (this->mode == R && this->read_ahead > 1 &&
+                  this->block_size % DIRECT_IO_ALIGNMENT == 0) ||
+                 (this->mode == W && this->spill_path);
+  if (this->direct) {
+    this->fd = open(this->filename, mode | O_DIRECT, S_IWUSR|S_IRUSR);
+    if (this->fd == -1 && errno == EINVAL) {
+      fprintf(stderr, "warning: %s does not support O_DIRECT, "
+              "using page cache\n", this->filename);
+      this->direct = false;
+    }
+  }
+  if (!this->direct)
+    this->fd = open(this->filename, mode, S_IWUSR|S_IRUSR);
+  CHECK(SYSCALL(this->fd), WITH_THIS("call open"), return false);
+
+  if (this->direct)
+    CHECK(SYSCALL(this->bfd = open(this->filename, mode)),
+          WITH_THIS("call open"), return false);
 
   struct stat stat;
   CHECK(SYSCALL(fstat(this->fd, &stat)), WITH_THIS("call fstat"),
@@ -45,18 +305,71 @@ static bool init(void *data, size_t block_size) {
                 this->filename),
         return false);
 
+  this->regular = S_ISREG(stat.st_mode);
+  if (this->regular)
+    this->size = stat.st_size;
+  else
+    CHECK(SYSCALL(ioctl(this->fd, BLKGETSIZE64, &this->size)),
+          WITH_THIS("get block device size"), return false);
+
+  if (this->lo_watermark > this->block_size)
+    this->lo_watermark = this->block_size;
+
+  // Stripes are aligned, so that they can be read and written directly.
+  this->stream_size = this->size;
+  if (this->stripes) {
+    uint64_t stripe_size = (this->size + this->stripes - 1) / this->stripes;
+    stripe_size += (DIRECT_IO_ALIGNMENT - stripe_size % DIRECT_IO_ALIGNMENT) %
+                   DIRECT_IO_ALIGNMENT;
+    this->base = this->stripe * stripe_size;
+    CHECK(this->base < this->size,
+          fprintf(stderr, "%s is too small for %zu stripes\n",
+                  this->filename, this->stripes),
+          return false);
+    this->stream_size = this->size - this->base;
+    if (this->stream_size > stripe_size)
+      this->stream_size = stripe_size;
+  }
+  if ((this->extents_path || this->fiemap) && !load_extents(this))
+    return false;
+  this->end = stream_end(this);
+  if (this->hash && !hash_stream(this))
+    return false;
+
+  if (this->mode == R && !this->direct &&
+      !advise(this, 0, 0, POSIX_FADV_SEQUENTIAL, &this->times.readahead_ns))
+    return false;
+
+  if (this->spill_path) {
+    CHECK(SYSCALL(this->spill_fd = open(this->spill_path,
+                                        O_RDWR | O_CREAT | O_TRUNC |
+                                        O_LARGEFILE, S_IWUSR|S_IRUSR)),
+          PERROR1("failed to open spill area", this->spill_path),
+          return false);
+  }
+
   CHECK(SYSCALL(this->afd = eventfd(0, 0)),
         WITH_THIS("initialize eventfd"), return false);
 
-  CHECK(SYSCALL(syscall(SYS_io_setup, 1, &this->ctx)),
+  CHECK(SYSCALL(syscall(SYS_io_setup, this->read_ahead, &this->ctx)),
         WITH_THIS("initalize aio control block"), return false);
 
-  this->cb.aio_fildes = this->fd;
-  this->cb.aio_lio_opcode =
-      (this->mode == R) ? IOCB_CMD_PREAD : IOCB_CMD_PWRITE;
-  this->cb.aio_reqprio = 0;
-  this->cb.aio_flags = IOCB_FLAG_RESFD;
-  this->cb.aio_resfd = this->afd;
+  if (this->mode == R) {
+    CHECK(SYSCALL(this->fetch_fd = eventfd(0, EFD_NONBLOCK)),
+          WITH_THIS("initialize eventfd"), return false);
+    CHECK(SYSCALL(syscall(SYS_io_setup, 1, &this->fetch_ctx)),
+          WITH_THIS("initalize aio control block"), return false);
+  }
+
+  for (size_t i = 0; i != this->read_ahead; ++i) {
+    struct iocb *cb = &this->requests[i].cb;
+    cb->aio_data = i;
+    cb->aio_fildes = this->fd;
+    cb->aio_lio_opcode = (this->mode == R) ? IOCB_CMD_PREAD : IOCB_CMD_PWRITE;
+    cb->aio_reqprio = 0;
+    cb->aio_flags = IOCB_FLAG_RESFD;
+    cb->aio_resfd = this->afd;
+  }
 
   return true;
 }
@@ -69,8 +382,12 @@ static const char *name(void *data) {
 static void destroy(void *data) {
   GET(struct data, this, data);
 
+  if (this->nbd)
+    stop_nbd_server(this->nbd, this->offset == this->stream_size);
   this->offset = 0;
-  memset(&this->cb, 0, sizeof(this->cb));
+  this->submitted = 0;
+  this->head = this->queued = 0;
+  memset(this->requests, 0, sizeof(this->requests));
 
   COND_CHECK(this->ctx, 0,
              SYSCALL(syscall(SYS_io_destroy, this->ctx)),
@@ -79,11 +396,147 @@ static void destroy(void *data) {
   COND_CHECK(this->afd, -1, SYSCALL(close(this->afd)),
              WITH_THIS("close eventfd"));
 
+  COND_CHECK(this->fetch_ctx, 0,
+             SYSCALL(syscall(SYS_io_destroy, this->fetch_ctx)),
+             WITH_THIS("close aio control block"));
+  COND_CHECK(this->fetch_fd, -1, SYSCALL(close(this->fetch_fd)),
+             WITH_THIS("close eventfd"));
+
   COND_CHECK(this->fd, -1, SYSCALL(close(this->fd)), WITH_THIS("call close"));
+  COND_CHECK(this->bfd, -1, SYSCALL(close(this->bfd)),
+             WITH_THIS("call close"));
 
+  // The spill area is scratch space, give it back.
+  if (this->spill_fd != -1) {
+    struct stat stat;
+    if (fstat(this->spill_fd, &stat) == 0 && S_ISREG(stat.st_mode))
+      CHECK(SYSCALL(ftruncate(this->spill_fd, 0)),
+            PERROR1("failed to truncate spill area", this->spill_path), ;);
+    CHECK(SYSCALL(close(this->spill_fd)),
+          PERROR1("failed to close spill area", this->spill_path), ;);
+  }
+
+  free(this->extents);
+  free(this->starts);
+  free(this->hashes);
+  free(this->fetch_buf);
   free(data);
 }
 
+static bool get_info(void *data, struct stream_info *info) {
+  GET(struct data, this, data);
+  info->size_known = true;
+  info->size = this->stream_size;
+  info->base = this->base;
+  info->image_size = this->size;
+  info->extents = this->extents;
+  info->num_extents = this->num_extents;
+  info->sparse = this->fiemap;
+  info->hashes = this->hashes;
+  info->num_hashes = this->num_hashes;
+  set_local_source(info, this->filename);
+  return true;
+}
+
+// Whatever the output had between the extents of a sparse image is stale,
+// so it's punched out, or zeroed where holes aren't supported.
+static bool zero_range(struct data *this, uint64_t offset, uint64_t length) {
+  if (fallocate(this->fd, FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE,
+                offset, length) == 0)
+    return true;
+  CHECK(errno == EOPNOTSUPP, WITH_THIS("punch holes"), return false);
+  CHECK(SYSCALL(fallocate(this->fd, FALLOC_FL_ZERO_RANGE | FALLOC_FL_KEEP_SIZE,
+                          offset, length)),
+        WITH_THIS("zero holes"), return false);
+  return true;
+}
+
+static bool punch_holes(struct data *this, uint64_t image_size) {
+  uint64_t end = (this->size < image_size) ? this->size : image_size;
+  uint64_t hole = 0;
+  for (size_t i = 0; i <= this->num_extents && hole < end; ++i) {
+    uint64_t next = (i == this->num_extents) ? end : this->extents[i].offset;
+    if (next > end)
+      next = end;
+    if (next > hole && !zero_range(this, hole, next - hole))
+      return false;
+    if (i != this->num_extents)
+      hole = this->extents[i].offset + this->extents[i].length;
+  }
+  return true;
+}
+
+// Preallocating the whole output up front keeps it from being fragmented
+// and saves metadata updates while it's being written. The other stripes of
+// an image are written alongside, so its output can't be truncated, and is
+// only cut down to the image instead. A sparse image keeps its holes.
+static bool start(void *data, const struct stream_info *info) {
+  GET(struct data, this, data);
+  CHECK(!info->origin || (info->size_known && info->origin < info->size),
+        fprintf(stderr, "bad start of stream for %s\n", this->filename),
+        return false);
+  CHECK(!info->size_known || info->base + info->size <= info->image_size,
+        fprintf(stderr, "bad stripe of stream for %s\n", this->filename),
+        return false);
+  this->origin = info->origin;
+  this->stream_size = info->size;
+  this->base = info->base;
+
+  // Whatever isn't written yet is in the way of the stream, so the clients
+  // wait for it.
+  if (this->nbd_path) {
+    CHECK(info->size_known && is_whole_stream(info),
+          fprintf(stderr, "%s can only be served if it's written whole\n",
+                  this->filename),
+          return false);
+    CHECK(this->nbd = start_nbd_server(this->nbd_path, this->filename,
+                                       info->size),
+          ;, return false);
+  }
+
+  if (info->num_extents) {
+    this->extents = malloc(info->num_extents * sizeof(struct extent));
+    CHECK(this->extents, ERROR("can't allocate memory for extents"),
+          return false);
+    memcpy(this->extents, info->extents,
+           info->num_extents * sizeof(struct extent));
+    this->num_extents = info->num_extents;
+    CHECK(info->size_known &&
+          check_extents(this->extents, this->num_extents, info->image_size,
+                        info->size),
+          fprintf(stderr, "bad extents of stream for %s\n", this->filename),
+          return false);
+    if (!map_extents(this))
+      return false;
+  }
+  if (info->sparse && !punch_holes(this, info->image_size))
+    return false;
+
+  if (!info->size_known || !this->regular)
+    return true;
+
+  if (info->size != info->image_size && this->size > info->image_size) {
+    CHECK(SYSCALL(ftruncate(this->fd, info->image_size)),
+          WITH_THIS("cut output to image"), return false);
+    this->size = info->image_size;
+  }
+  if (info->image_size <= this->size)
+    return true;
+  if (info->sparse) {
+    CHECK(SYSCALL(ftruncate(this->fd, info->image_size)),
+          WITH_THIS("extend output to image"), return false);
+    return true;
+  }
+
+  uint64_t begin = get_time_ns();
+  if (fallocate(this->fd, 0, 0, info->image_size) == -1) {
+    CHECK(errno == EOPNOTSUPP, WITH_THIS("preallocate space"), return false);
+    WITH_THIS("warning: preallocate space");
+  }
+  this->times.fallocate_ns += get_time_ns() - begin;
+  return true;
+}
+
 static uint32_t get_epoll_event(void *data) {
   return EPOLLIN;
 }
@@ -93,22 +546,97 @@ static int get_fd(void *data) {
   return this->afd;
 }
 
-static ssize_t enqueue(void *data, void *buf, size_t count, bool *eof) {
+static size_t get_read_ahead(void *data) {
   GET(struct data, this, data);
+  return this->read_ahead;
+}
 
+static struct request *prepare_request(struct data *this, void *buf,
+                                       size_t count, uint64_t offset) {
   static_assert(
       sizeof(uint64_t) >= sizeof(void *) && sizeof(uint64_t) >= sizeof(size_t),
       "can't use io_submit on this platform");
-  this->cb.aio_buf = (uint64_t) buf;
-  this->cb.aio_nbytes = count;
-  this->cb.aio_offset = this->offset;
+  assert(this->queued != this->read_ahead);
+  struct request *req =
+      &this->requests[(this->head + this->queued++) % this->read_ahead];
+  req->cb.aio_buf = (uint64_t) buf;
+  req->cb.aio_nbytes = count;
+  req->cb.aio_offset = offset;
+  req->done = false;
+  return req;
+}
 
-  struct iocb *cbs = {&this->cb};
-  CHECK(SYSCALL(syscall(SYS_io_submit, this->ctx, 1, &cbs)),
-        WITH_THIS("submit aio request"), return -1);
+static bool submit(struct data *this, struct iocb **cbs, size_t num) {
+  uint64_t now = get_time_ns();
+  for (size_t i = 0; i != num; ++i) {
+    this->requests[cbs[i]->aio_data].submitted_ns = now;
+    TRACE(submit, this->filename, now, 0, cbs[i]->aio_offset,
+          cbs[i]->aio_nbytes);
+  }
+  CHECK(SYSCALL(syscall(SYS_io_submit, this->ctx, num, cbs)),
+        WITH_THIS("submit aio request"), return false);
+  return true;
+}
 
-  // Here we don't know.
-  *eof = false;
+// buf always corresponds to this->offset, so requests which are already in
+// flight occupy its beginning, and new ones are appended right after them
+// until either the ring space or the current read-ahead depth runs out.
+static ssize_t enqueue(void *data, void *buf, size_t count, bool *eof) {
+  GET(struct data, this, data);
+
+  uint64_t pending = this->submitted - this->offset;
+  assert(pending <= count);
+
+  struct iocb *cbs[MAX_READ_AHEAD];
+  size_t num = 0;
+  while (!this->eof && this->queued != this->depth && pending != count &&
+         this->submitted != this->end) {
+    size_t size = count - pending;
+    if (size > this->block_size)
+      size = this->block_size;
+    if (size > this->end - this->submitted)
+      size = this->end - this->submitted;
+    size = contiguous(this, this->submitted, size);
+
+    // Writers can't wait for more data, so whatever is not aligned goes
+    // through page cache, up to the next aligned offset if that helps.
+    int fd = this->fd;
+    size_t misalignment =
+        position(this, this->submitted) % DIRECT_IO_ALIGNMENT;
+    if (this->direct && this->mode == W &&
+        ((uintptr_t)((char *)buf + pending) % DIRECT_IO_ALIGNMENT !=
+             misalignment ||
+         misalignment || size < DIRECT_IO_ALIGNMENT)) {
+      fd = this->bfd;
+      if (misalignment && size > DIRECT_IO_ALIGNMENT - misalignment &&
+          (uintptr_t)((char *)buf + pending) % DIRECT_IO_ALIGNMENT ==
+              misalignment)
+        size = DIRECT_IO_ALIGNMENT - misalignment;
+    } else if (this->direct) {
+      size -= size % DIRECT_IO_ALIGNMENT;
+    }
+    if (!size)
+      break;
+
+    struct request *req = prepare_request(
+        this, (char *)buf + pending, size, position(this, this->submitted));
+    req->cb.aio_fildes = fd;
+    cbs[num++] = &req->cb;
+    this->submitted += size;
+    pending += size;
+  }
+
+  if (num && !submit(this, cbs, num))
+    return -1;
+
+  // The ring is full, so there is no point in keeping more readers ahead.
+  if (pending == count && this->queued < this->depth && this->depth > 1)
+    --this->depth;
+
+  // Here we don't know, unless there's nothing to read at all.
+  if (!this->end)
+    this->eof = true;
+  *eof = !this->end;
   return 0;
 }
 
@@ -117,6 +645,18 @@ static size_t get_lo_watermark(void *data) {
   return this->lo_watermark;
 }
 
+static size_t get_input_lo_watermark(void *data) {
+  GET(struct data, this, data);
+  if (this->direct && this->lo_watermark < DIRECT_IO_ALIGNMENT)
+    return DIRECT_IO_ALIGNMENT;
+  return this->lo_watermark;
+}
+
+static size_t get_block_size(void *data) {
+  GET(struct data, this, data);
+  return this->block_size;
+}
+
 static ssize_t consume(void *data, void *buf, size_t count) {
   bool unused;
   return enqueue(data, buf, count, &unused);
@@ -125,74 +665,590 @@ static ssize_t consume(void *data, void *buf, size_t count) {
 static ssize_t signal(void *data, bool *eof) {
   GET(struct data, this, data);
 
-  struct io_event event = {0};
-  CHECK(SYSCALL(syscall(SYS_io_getevents, this->ctx, 1, 1, &event, NULL)),
+  uint64_t completed;
+  CHECK(read(this->afd, &completed, sizeof(completed)) == sizeof(completed),
+        WITH_THIS("read eventfd"), return -1);
+  assert(completed <= this->queued);
+
+  struct io_event events[MAX_READ_AHEAD];
+  long num_events;
+  CHECK(SYSCALL(num_events = syscall(SYS_io_getevents, this->ctx,
+                                     completed, completed, events, NULL)),
         WITH_THIS("get completed aio events"), return -1);
+  uint64_t now = get_time_ns();
 
-  if (event.res < 0) {
-    errno = -event.res;
-    CHECK(SYSCALL(-1), WITH_THIS("complete aio requests"), return -1);
+  for (long i = 0; i != num_events; ++i) {
+    if (events[i].res < 0) {
+      errno = -events[i].res;
+      CHECK(SYSCALL(-1), WITH_THIS("complete aio requests"), return -1);
+    }
+    struct request *req = &this->requests[events[i].data];
+    req->res = events[i].res;
+    req->done = true;
+    TRACE(complete, this->filename, req->submitted_ns,
+          now - req->submitted_ns, req->cb.aio_offset, req->res);
+  }
+
+  ssize_t moved = 0;
+  while (this->queued && this->requests[this->head].done) {
+    struct request *req = &this->requests[this->head];
+    if (!this->eof && req->res == 0 && this->mode == R)
+      this->eof = true;
+
+    // Requests submitted past the end of input are just dropped.
+    if (!this->eof) {
+      moved += req->res;
+      this->offset += req->res;
+
+      // Direct reads can only come out short at the end of input, the rest
+      // of any other short request is submitted again, ahead of the ones
+      // after it.
+      if (this->mode == R && this->direct && req->res < req->cb.aio_nbytes)
+        this->eof = true;
+      else if (req->res < req->cb.aio_nbytes) {
+        CHECK(req->res, fprintf(stderr, "%s can't be written any further\n",
+                                this->filename), return -1);
+        req->cb.aio_buf += req->res;
+        req->cb.aio_nbytes -= req->res;
+        req->cb.aio_offset += req->res;
+        req->done = false;
+        struct iocb *cb = &req->cb;
+        if (!submit(this, &cb, 1))
+          return -1;
+        break;
+      }
+    }
+
+    this->head = (this->head + 1) % this->read_ahead;
+    --this->queued;
   }
+  if (this->offset == this->end)
+    this->eof = true;
 
-  this->offset += event.res;
-  *eof = (event.res == 0);
-  return event.res;
+  // The engine has nothing more to wait for, let more readers run ahead.
+  if (!this->queued && !this->eof && this->depth < this->read_ahead)
+    this->depth = (2 * this->depth < this->read_ahead) ?
+        2 * this->depth : this->read_ahead;
+
+  *eof = this->eof && !this->queued;
+  return moved;
+}
+
+// The kernel maps the completion ring of the aio context into the process,
+// events which are in it can be seen without a system call.
+#define AIO_RING_MAGIC 0xa10a10a1
+
+struct aio_ring {
+  unsigned id;
+  unsigned nr;
+  unsigned head;
+  unsigned tail;
+  unsigned magic;
+  unsigned compat_features;
+  unsigned incompat_features;
+  unsigned header_length;
+};
+
+static bool poll_completions(void *data) {
+  GET(struct data, this, data);
+  const struct aio_ring *ring = (const struct aio_ring *)this->ctx;
+  if (!ring || ring->magic != AIO_RING_MAGIC)
+    return false;
+  return __atomic_load_n(&ring->tail, __ATOMIC_ACQUIRE) != ring->head;
+}
+
+static bool sync_range(struct data *this, uint64_t begin, uint64_t end,
+                       unsigned int flags) {
+  for (uint64_t count; begin != end; begin += count) {
+    count = contiguous(this, begin, end - begin);
+    if (sync_file_range(this->fd, position(this, begin), count, flags) == -1)
+      return false;
+  }
+  return true;
+}
+
+static bool write_back(struct data *this, bool final) {
+  uint64_t begin = get_time_ns();
+  CHECK(sync_range(this, this->written_back, this->offset,
+                   SYNC_FILE_RANGE_WRITE),
+        WITH_THIS("start writeback"), return false);
+  this->times.writeback_ns += get_time_ns() - begin;
+
+  // The previous range has most likely hit the disk by now, so this wait
+  // only blocks when the disk can't keep up with the stream.
+  uint64_t end = final ? this->offset : this->written_back;
+  if (end != this->dropped) {
+    begin = get_time_ns();
+    CHECK(sync_range(this, this->dropped, end,
+                     SYNC_FILE_RANGE_WAIT_BEFORE | SYNC_FILE_RANGE_WRITE |
+                     SYNC_FILE_RANGE_WAIT_AFTER),
+          WITH_THIS("wait for writeback"), return false);
+    this->times.wait_ns += get_time_ns() - begin;
+
+    for (uint64_t count; this->dropped != end; this->dropped += count) {
+      count = contiguous(this, this->dropped, end - this->dropped);
+      if (!advise(this, position(this, this->dropped), count,
+                  POSIX_FADV_DONTNEED, &this->times.drop_ns))
+        return false;
+    }
+  }
+
+  this->written_back = this->offset;
+  return true;
 }
 
 static ssize_t consume_signal(void *data) {
+  GET(struct data, this, data);
   bool unused;
-  return signal(data, &unused);
+  ssize_t rv = signal(data, &unused);
+  if (rv > 0 && this->nbd)
+    set_nbd_arrived(this->nbd, this->offset);
+  if (rv > 0 && this->writeback &&
+      this->offset - this->written_back >= this->writeback &&
+      !write_back(this, false))
+    return -1;
+  return rv;
+}
+
+static bool finish(void *data) {
+  GET(struct data, this, data);
+  if (this->writeback && !write_back(this, true))
+    return false;
+
+  if (this->sync != NO_SYNC) {
+    uint64_t begin = get_time_ns();
+    CHECK(SYSCALL(this->sync == DATA_SYNC ? fdatasync(this->fd) :
+                                            fsync(this->fd)),
+          WITH_THIS("sync"), return false);
+    this->times.sync_ns += get_time_ns() - begin;
+  }
+  return true;
+}
+
+static bool can_rewind(void *data) {
+  return true;
+}
+
+// Receivers which joined late get the beginning of the file in one more
+// pass. Direct reads stay aligned, since the stream is only joined at
+// offsets the reader has got to, and those are aligned but at the end.
+static bool rewind_input(void *data, uint64_t end) {
+  GET(struct data, this, data);
+  assert(!this->queued);
+  this->offset = this->submitted = 0;
+  this->end = (end < this->stream_size) ? end : stream_end(this);
+  this->eof = false;
+  this->depth = 1;
+  return true;
+}
+
+static bool fetch(void *data, const struct extent *extent) {
+  GET(struct data, this, data);
+  if (this->num_fetches == MAX_FETCHES || !extent->length ||
+      extent->offset >= this->stream_size ||
+      extent->length > this->stream_size - extent->offset)
+    return false;
+  this->fetches[this->num_fetches++] = *extent;
+  return true;
+}
+
+// What can't be read comes with the stream, or fails there.
+static void drop_fetch(struct data *this) {
+  memmove(&this->fetches[0], &this->fetches[1],
+          --this->num_fetches * sizeof(struct extent));
+  this->fetch_size = 0;
+}
+
+// Submits the rest of the piece in flight, or else the next one. A piece
+// doesn't cross the extents the stream is made of.
+static bool submit_fetch(struct data *this) {
+  if (!this->fetch_size) {
+    const struct extent *extent = &this->fetches[0];
+    size_t size = (extent->length < FETCH_SIZE) ? extent->length : FETCH_SIZE;
+    if (this->incremental) {
+      size_t i = find_extent(this, extent->offset);
+      uint64_t left = this->starts[i] + this->extents[i].length -
+                      extent->offset;
+      if (size > left)
+        size = left;
+    }
+    this->fetch_size = size;
+    this->fetch_done = 0;
+  }
+
+  struct iocb *cb = &this->fetch_cb;
+  cb->aio_fildes = (this->bfd != -1) ? this->bfd : this->fd;
+  cb->aio_lio_opcode = IOCB_CMD_PREAD;
+  cb->aio_buf = (uint64_t) (this->fetch_buf + this->fetch_done);
+  cb->aio_nbytes = this->fetch_size - this->fetch_done;
+  cb->aio_offset = position(this, this->fetches[0].offset) + this->fetch_done;
+  cb->aio_flags = IOCB_FLAG_RESFD;
+  cb->aio_resfd = this->fetch_fd;
+  CHECK(SYSCALL(syscall(SYS_io_submit, this->fetch_ctx, 1, &cb)),
+        WITH_THIS("submit fetch request"), return false);
+  return true;
+}
+
+// The engine never waits for a piece, it's taken once fetch_fd says it's
+// read.
+static bool take_fetched(void *data, struct fetched *fetched) {
+  GET(struct data, this, data);
+  if (!this->fetch_buf)
+    CHECK(this->fetch_buf = malloc(FETCH_SIZE),
+          ERROR("can't allocate memory for fetched ranges"), return false);
+
+  while (!this->fetch_size) {
+    if (!this->num_fetches)
+      return false;
+    if (submit_fetch(this))
+      return false;
+    drop_fetch(this);
+  }
+
+  uint64_t completed;
+  if (read(this->fetch_fd, &completed, sizeof(completed)) == -1) {
+    CHECK(errno == EAGAIN, WITH_THIS("read eventfd"), ;);
+    return false;
+  }
+  struct io_event event;
+  CHECK(SYSCALL(syscall(SYS_io_getevents, this->fetch_ctx, 1, 1, &event,
+                        NULL)),
+        WITH_THIS("get fetched range"), return false);
+  if (event.res < 0) {
+    errno = -event.res;
+    CHECK(SYSCALL(-1), WITH_THIS("read fetched range"), ;);
+  } else if (!event.res) {
+    fprintf(stderr, "%s ends before the range fetched at %" PRIu64 "\n",
+            this->filename, this->fetches[0].offset + this->fetch_done);
+  } else if ((this->fetch_done += event.res) != this->fetch_size) {
+    if (submit_fetch(this))
+      return false;
+  } else {
+    struct extent *extent = &this->fetches[0];
+    *fetched = (struct fetched) { extent->offset, this->fetch_size,
+                                  this->fetch_buf };
+    extent->offset += this->fetch_size;
+    extent->length -= this->fetch_size;
+    this->fetch_size = 0;
+    if (!extent->length)
+      drop_fetch(this);
+    return true;
+  }
+  drop_fetch(this);
+  return take_fetched(data, fetched);
+}
+
+static int get_fetched_fd(void *data) {
+  GET(struct data, this, data);
+  return this->fetch_fd;
+}
+
+static int get_wanted_fd(void *data) {
+  GET(struct data, this, data);
+  return this->nbd ? get_nbd_wanted_fd(this->nbd) : -1;
+}
+
+static bool get_wanted(void *data, struct extent *extent) {
+  GET(struct data, this, data);
+  return this->nbd && take_nbd_wanted(this->nbd, extent);
+}
+
+// Only the clients of a writer which serves its output need the ranges
+// ahead of the stream.
+static bool put_fetched(void *data, const struct fetched *fetched) {
+  GET(struct data, this, data);
+  if (!this->nbd)
+    return true;
+  int fd = (this->bfd != -1) ? this->bfd : this->fd;
+  for (size_t done = 0; done != fetched->size;) {
+    ssize_t rv = pwrite(fd, fetched->data + done, fetched->size - done,
+                        position(this, fetched->offset) + done);
+    if (rv == -1 && errno == EINTR)
+      continue;
+    CHECK(SYSCALL(rv), WITH_THIS("write fetched range"), return false);
+    done += rv;
+  }
+  set_nbd_fetched(this->nbd, fetched->offset, fetched->size);
+  return true;
+}
+
+static bool get_spill(void *data, struct spill *spill) {
+  GET(struct data, this, data);
+  if (this->spill_fd == -1)
+    return false;
+  *spill = (struct spill) { this->spill_fd, this->spill_size };
+  return true;
+}
+
+static size_t get_counters(void *data, struct counter *counters) {
+  GET(struct data, this, data);
+  size_t num = 0;
+#define COUNTER(name) \
+  counters[num++] = (struct counter) {# name, this->times.name}
+  if (this->mode == R && !this->direct)
+    COUNTER(readahead_ns);
+  if (this->writeback) {
+    COUNTER(writeback_ns);
+    COUNTER(wait_ns);
+    COUNTER(drop_ns);
+  }
+  if (this->sync != NO_SYNC)
+    COUNTER(sync_ns);
+  if (this->times.fallocate_ns)
+    COUNTER(fallocate_ns);
+  if (this->hash)
+    COUNTER(hash_ns);
+#undef COUNTER
+  return num;
 }
 
 static const struct producer_ops input_ops = {
   .init             = init,
+  .setup            = setup_nothing,
   .name             = name,
   .destroy          = destroy,
+  .get_info         = get_info,
 
   .get_epoll_event  = get_epoll_event,
   .get_fd           = get_fd,
+  .get_lo_watermark = get_input_lo_watermark,
+  .get_block_size   = get_block_size,
+  .get_read_ahead   = get_read_ahead,
   .produce          = enqueue,
   .signal           = signal,
+  .poll             = poll_completions,
+
+  .get_node         = get_no_node,
+  .get_counters     = get_counters,
+  .put_reports      = put_no_reports,
+  .can_rewind       = can_rewind,
+  .rewind           = rewind_input,
+  .set_private_ring = ignore_private_ring,
+  .fetch            = fetch,
+  .take_fetched     = take_fetched,
+  .get_fetched_fd   = get_fetched_fd,
 };
 
 static const struct consumer_ops output_ops = {
   .init             = init,
+  .setup            = setup_nothing,
   .name             = name,
   .destroy          = destroy,
+  .start            = start,
 
   .get_epoll_event  = get_epoll_event,
   .get_fd           = get_fd,
   .get_lo_watermark = get_lo_watermark,
+  .get_block_size   = get_block_size,
+  .get_priority     = get_no_priority,
   .consume          = consume,
   .signal           = consume_signal,
+  .poll             = poll_completions,
+  .finish           = finish,
+  .get_spill        = get_spill,
+  .map_ring         = map_no_ring,
+
+  .get_node         = get_no_node,
+  .get_counters     = get_counters,
+  .get_reports      = get_no_reports,
+
+  .get_listen_fd    = get_no_listen_fd,
+  .accept_joiner    = accept_no_joiner,
+  .get_missed       = get_no_missed,
+  .get_wanted_fd    = get_wanted_fd,
+  .get_wanted       = get_wanted,
+  .put_fetched      = put_fetched,
 };
 
-static struct data *construct(const char *filename, int mode,
-                              size_t lo_watermark) {
-  assert(filename);
-  struct data *data = malloc(sizeof(struct data) + strlen(filename) + 1);
+static bool parse_options(struct data *this, char *options) {
+  enum {
+    BLOCK, LO, WRITEBACK, SYNC, SPILL, SPILL_SIZE, TRUNC, STRIPE, EXTENTS,
+    FIEMAP, HASH, NBD
+  };
+  char *const tokens[] = {
+    [BLOCK] = "block",
+    [LO] = "lo",
+    [WRITEBACK] = "writeback",
+    [SYNC] = "sync",
+    [SPILL] = "spill",
+    [SPILL_SIZE] = "spill_size",
+    [TRUNC] = "trunc",
+    [STRIPE] = "stripe",
+    [EXTENTS] = "extents",
+    [FIEMAP] = "fiemap",
+    [HASH] = "hash",
+    [NBD] = "nbd",
+    NULL
+  };
+
+  while (*options) {
+    char *value = NULL;
+    switch (getsubopt(&options, tokens, &value)) {
+    case BLOCK:
+      CHECK(value && parse_size(value, &this->block_size),
+            fprintf(stderr, "bad block option for %s\n", this->filename),
+            return false);
+      break;
+    case LO:
+      CHECK(value && parse_size(value, &this->lo_watermark),
+            fprintf(stderr, "bad lo option for %s\n", this->filename),
+            return false);
+      break;
+    case WRITEBACK:
+      CHECK(this->mode == W && value && parse_size(value, &this->writeback),
+            fprintf(stderr, "bad writeback option for %s\n", this->filename),
+            return false);
+      break;
+    case SYNC:
+      CHECK(this->mode == W && value &&
+            (strcmp(value, "data") == 0 || strcmp(value, "full") == 0),
+            fprintf(stderr, "bad sync option for %s\n", this->filename),
+            return false);
+      this->sync = (strcmp(value, "data") == 0) ? DATA_SYNC : FULL_SYNC;
+      break;
+    case SPILL:
+      CHECK(this->mode == W && value && *value,
+            fprintf(stderr, "bad spill option for %s\n", this->filename),
+            return false);
+      this->spill_path = value;
+      break;
+    case SPILL_SIZE:
+      CHECK(this->mode == W && value && parse_size(value, &this->spill_size),
+            fprintf(stderr, "bad spill_size option for %s\n", this->filename),
+            return false);
+      break;
+    case TRUNC:
+      CHECK(this->mode == W && !value,
+            fprintf(stderr, "bad trunc option for %s\n", this->filename),
+            return false);
+      this->truncate = true;
+      break;
+    case STRIPE: {
+      int end = 0;
+      CHECK(this->mode == R && value &&
+            sscanf(value, "%zu/%zu%n", &this->stripe, &this->stripes,
+                   &end) == 2 &&
+            !value[end] && this->stripe < this->stripes,
+            fprintf(stderr, "bad stripe option for %s\n", this->filename),
+            return false);
+      break;
+    }
+    case EXTENTS:
+      CHECK(this->mode == R && value && *value && !this->fiemap,
+            fprintf(stderr, "bad extents option for %s\n", this->filename),
+            return false);
+      this->extents_path = value;
+      break;
+    case FIEMAP:
+      CHECK(this->mode == R && !value && !this->extents_path,
+            fprintf(stderr, "bad fiemap option for %s\n", this->filename),
+            return false);
+      this->fiemap = true;
+      break;
+    case HASH:
+      CHECK(this->mode == R && !value,
+            fprintf(stderr, "bad hash option for %s\n", this->filename),
+            return false);
+      this->hash = true;
+      break;
+    case NBD:
+      CHECK(this->mode == W && value && *value,
+            fprintf(stderr, "bad nbd option for %s\n", this->filename),
+            return false);
+      this->nbd_path = value;
+      break;
+    default:
+      fprintf(stderr, "unknown option %s for %s\n", value, this->filename);
+      return false;
+    }
+  }
+  return true;
+}
+
+// The spec is a file name optionally followed by comma-separated options.
+static struct data *construct(const char *spec, int mode,
+                              size_t lo_watermark, size_t read_ahead) {
+  assert(spec);
+  struct data *data = malloc(sizeof(struct data) + strlen(spec) + 1);
 
   if (data) {
     data->lo_watermark = lo_watermark;
+    data->block_size = 0;
+    data->read_ahead = read_ahead;
+    data->depth = 1;
     data->fd = -1;
+    data->bfd = -1;
     data->afd = -1;
     data->ctx = 0;
-    memset(&data->cb, 0, sizeof(data->cb));
+    memset(data->requests, 0, sizeof(data->requests));
+    data->head = data->queued = 0;
 
     data->offset = 0;
+    data->submitted = 0;
+    data->eof = false;
+    data->direct = false;
+    data->regular = false;
+    data->size = 0;
+    data->end = UINT64_MAX;
+    data->origin = 0;
+    data->stream_size = 0;
+    data->stripe = 0;
+    data->stripes = 0;
+    data->base = 0;
+    data->extents_path = NULL;
+    data->fiemap = false;
+    data->incremental = false;
+    data->extents = NULL;
+    data->starts = NULL;
+    data->num_extents = 0;
+    data->hash = false;
+    data->hashes = NULL;
+    data->num_hashes = 0;
+
+    data->writeback = 0;
+    data->written_back = 0;
+    data->dropped = 0;
+    data->sync = NO_SYNC;
+    data->truncate = false;
+    data->nbd_path = NULL;
+    data->nbd = NULL;
+    data->num_fetches = 0;
+    data->fetch_buf = NULL;
+    data->fetch_fd = -1;
+    data->fetch_ctx = 0;
+    memset(&data->fetch_cb, 0, sizeof(data->fetch_cb));
+    data->fetch_size = data->fetch_done = 0;
+    memset(&data->times, 0, sizeof(data->times));
+
+    data->spill_path = NULL;
+    data->spill_size = DEFAULT_SPILL_SIZE;
+    data->spill_fd = -1;
+
     data->mode = mode;
-    strcpy(data->filename, filename);
+    strcpy(data->filename, spec);
+
+    char *options = strchr(data->filename, ',');
+    if (options) {
+      *options++ = 0;
+      if (!parse_options(data, options))
+        goto cleanup;
+    }
   }
 
   return data;
+
+cleanup:
+  free(data);
+  return NULL;
 }
 
-struct producer get_file_reader(const char *filename) {
-  return (struct producer) {&input_ops, construct(filename, R, 0)};
+struct producer get_file_reader(const char *filename, size_t read_ahead) {
+  return (struct producer) {&input_ops, construct(filename, R, 0, read_ahead)};
 }
 
 struct consumer get_file_writer(const char *filename, size_t lo_watermark) {
-  return (struct consumer) {&output_ops, construct(filename, W, lo_watermark)};
+  return (struct consumer) {&output_ops,
+                            construct(filename, W, lo_watermark, 1)};
 }
 
 #undef WITH_THIS
@@ -5,6 +5,7 @@
 struct producer;
 struct consumer;
 
-extern struct producer get_file_reader(const char *filename);
+extern struct producer get_file_reader(const char *filename,
+                                       size_t read_ahead);
 extern struct consumer get_file_writer(const char *filename,
                                        size_t lo_watermark);
@@ -1,25 +1,27 @@
+#include "daemon.h"
 #include "defaults.h"
 #include "engine.h"
 #include "file.h"
 #include "macro.h"
+#include "mmap.h"
 #include "pipe.h"
+#include "placement.h"
+#include "shm.h"
 #include "socket.h"
 #include "stats.h"
 #include "struct.h"
+#include "trace.h"
+#include "util.h"
 
 #include <assert.h>
-#include <errno.h>
-#include <limits.h>
 #include <getopt.h>
 #include <stdio.h>
 #include <stdlib.h>
 
 static bool init_producer(struct producer *producer,
-                          struct producer (*fn)(const char*), const char *arg) {
-  CHECK(is_empty_producer(producer),
-        ERROR("there can only be one producer"), return false);
-
-  *producer = fn(arg);
+                          struct producer (*fn)(const char*, size_t),
+                          size_t read_ahead, const char *arg) {
+  *producer = fn(arg, read_ahead);
   CHECK(!is_empty_producer(producer),
         ERROR("failed to construct producer"), return false);
   return true;
@@ -37,58 +39,91 @@ static bool add_consumer(struct consumer *consumers, size_t *num_consumers,
   return true;
 }
 
-static bool strtoll_overflew(long long value) {
-  return (value == LLONG_MIN || value == LLONG_MAX) && errno == ERANGE;
-}
-
-static bool strtol_overflew(long value) {
-  return (value == LONG_MIN || value == LONG_MAX) && errno == ERANGE;
+// In the automatic mode, the node is the one of the first endpoint which
+// knows it, normally the NIC of the upstream or downstream connection.
+static int find_node(struct state *state) {
+  int node = CALL0(state->producer, get_node);
+  for (size_t i = 0; node == NODE_UNKNOWN && i != state->num_consumers; ++i)
+    node = CALL0(state->consumers[i], get_node);
+  return node;
 }
 
-static bool size_overflew(size_t value) {
-  return sizeof(size_t) == sizeof(long) ?
-      strtol_overflew(value) :
-      strtoll_overflew(value);
-}
-
-int main(int argc, char *argv[]) {
+// Runs a transfer, or a daemon which runs them with the ring it has
+// preallocated, if it's free.
+static int run(int argc, char *argv[], char *ring, size_t ring_size) {
   int rv = 0;
 
   struct state state = EMPTY_STATE;
 
   struct stats stats = EMPTY_STATS;
   const char *stats_filename = NULL;
+  const char *trace_filename = NULL;
 
   size_t buffer_size = DEFAULT_BUFFER_SIZE;
   size_t block_size = DEFAULT_BLOCK_SIZE;
   size_t lo_watermark = DEFAULT_LO_WATERMARK;
+  size_t read_ahead = DEFAULT_READ_AHEAD;
   size_t raw_size;
-  static_assert(sizeof(size_t) == sizeof(long long) ||
-                sizeof(size_t) == sizeof(long),
-                "can't manipulate buffer sizes on this platform");
+
+  int node = NODE_UNKNOWN;
+  cpu_set_t cpus;
+  bool pin = false;
+
+  const char *daemon_spec = NULL;
+  // The producer is made once all options are in, since it takes -j.
+  struct producer (*producer_fn)(const char*, size_t) = NULL;
+  const char *producer_arg = NULL;
 
 #define FAIL_IF_NOT(cond, alert) CHECK(cond, alert, GOTO_WITH(cleanup, rv, 1))
 
-  for (int opt; (opt = getopt(argc, argv, "B:b:i:o:I:O:r:s:S:")) != -1;) {
+  for (int opt; (opt = getopt(argc, argv,
+                              "B:b:C:c:D:i:j:m:M:n:o:I:O:p:r:s:S:T:")) != -1;) {
     switch (opt) {
     case 'B':
-    case 'b': {
-      char *end = NULL;
-      raw_size = (sizeof(size_t) == sizeof(long)) ?
-          strtol(optarg, &end, 10) :
-          strtoll(optarg, &end, 10);
-      FAIL_IF_NOT(*end == 0 && raw_size > 0ll && !size_overflew(raw_size),
+    case 'b':
+      FAIL_IF_NOT(parse_size(optarg, &raw_size),
                   ERROR("can't read buffer/block size"));
       (opt == 'B') ? (buffer_size = raw_size) : (block_size = raw_size);
       break;
+    case 'j': {
+      char *end = NULL;
+      long value = strtol(optarg, &end, 10);
+      FAIL_IF_NOT(*end == 0 && value > 0 && value <= MAX_READ_AHEAD,
+                  ERROR("can't read number of parallel readers"));
+      read_ahead = value;
+      break;
     }
+    case 'c':
+      FAIL_IF_NOT(parse_cpu_list(optarg, &cpus), ERROR("can't read cpu list"));
+      pin = true;
+      break;
+    case 'n':
+      FAIL_IF_NOT(parse_node(optarg, &node), ERROR("can't read numa node"));
+      break;
+    case 'p':
+      FAIL_IF_NOT(parse_size(optarg, &raw_size),
+                  ERROR("can't read busy-poll time"));
+      state.busy_poll_ns = (uint64_t)raw_size * 1000;
+      break;
+    case 'D':
+      FAIL_IF_NOT(!ring, ERROR("a job can't start a daemon"));
+      daemon_spec = optarg;
+      break;
+    case 'C':
+      state.chain_filename = optarg;
+      break;
     case 'S':
       stats_filename = optarg;
       state.stats = &stats;
       break;
+    case 'T':
+      trace_filename = optarg;
+      break;
 #define PRODUCER(letter, func) \
     case letter: \
-      FAIL_IF_NOT(init_producer(&state.producer, func, optarg), ;); \
+      FAIL_IF_NOT(!producer_fn, ERROR("there can only be one producer")); \
+      producer_fn = func; \
+      producer_arg = optarg; \
       break
 #define CONSUMER(letter, func) \
     case letter: \
@@ -98,6 +133,7 @@ int main(int argc, char *argv[]) {
     PRODUCER('i', get_file_reader);   CONSUMER('o', get_file_writer);
     PRODUCER('I', get_pipe_reader);   CONSUMER('O', get_pipe_writer);
     PRODUCER('r', get_socket_reader); CONSUMER('s', get_socket_writer);
+    PRODUCER('m', get_mmap_reader);   CONSUMER('M', get_shm_writer);
     }
   }
 
@@ -105,11 +141,17 @@ int main(int argc, char *argv[]) {
               ERROR("buffer size should be greather than block size"));
   FAIL_IF_NOT(buffer_size % block_size == 0,
               ERROR("buffer size should be a multiple of block size"));
-  FAIL_IF_NOT(lo_watermark <= block_size,
-              ERROR("lo watermark must not be greather than block size"));
 
-  FAIL_IF_NOT(!is_empty_producer(&state.producer),
-              ERROR("please specify a producer"));
+  if (daemon_spec) {
+    FAIL_IF_NOT(!producer_fn && !state.num_consumers,
+                ERROR("a daemon gets producers and consumers from jobs"));
+    FAIL_IF_NOT(run_daemon(daemon_spec, buffer_size, run), ;);
+    goto cleanup;
+  }
+
+  FAIL_IF_NOT(producer_fn, ERROR("please specify a producer"));
+  FAIL_IF_NOT(init_producer(&state.producer, producer_fn, read_ahead,
+                            producer_arg), ;);
 
   FAIL_IF_NOT(state.num_consumers > 0,
               ERROR("please specify at least one consumer"));
@@ -119,15 +161,51 @@ int main(int argc, char *argv[]) {
                 ERROR("failed to initialize consumer"));
   FAIL_IF_NOT(CALL(state.producer, init, block_size),
               ERROR("failed to initialize producer"));
+  FAIL_IF_NOT(connect_endpoints(&state),
+              ERROR("failed to set up endpoints"));
 
-  FAIL_IF_NOT(transfer(buffer_size, block_size, &state),
+  state.info.block_size = block_size;
+  FAIL_IF_NOT(CALL(state.producer, get_info, &state.info),
+              ERROR("failed to get stream info from producer"));
+  for (size_t i = 0; i != state.num_consumers; ++i)
+    FAIL_IF_NOT(CALL(state.consumers[i], start, &state.info),
+                ERROR("failed to start consumer"));
+
+  // Endpoints are placed once they are initialized, when their threads
+  // are running and the connections show which NICs are used.
+  if (node == NODE_AUTO) {
+    node = find_node(&state);
+    if (node == NODE_UNKNOWN)
+      ERROR("warning: can't find numa node of endpoints, not placing");
+  }
+  if (node != NODE_UNKNOWN && !pin) {
+    FAIL_IF_NOT(get_node_cpus(node, &cpus), ;);
+    pin = true;
+  }
+  if (pin)
+    FAIL_IF_NOT(pin_threads(&cpus), ERROR("failed to pin threads"));
+  state.node = node;
+  state.ring = ring;
+  state.ring_size = ring_size;
+
+  if (trace_filename)
+    FAIL_IF_NOT(start_tracing(DEFAULT_TRACE_EVENTS), ;);
+  FAIL_IF_NOT(transfer(buffer_size, &state),
               ERROR("transfer failed"));
+  FAIL_IF_NOT(replay(buffer_size, &state),
+              ERROR("replay failed"));
 
   if (stats_filename)
     FAIL_IF_NOT(dump_stats(&state, stats_filename),
                 ERROR("failed to dump stats"));
 
 cleanup:
+  // The trace is most useful when the transfer went wrong.
+  if (tracer) {
+    CHECK(dump_trace(trace_filename), ERROR("failed to dump trace"), rv = 1);
+    stop_tracing();
+  }
+
   if (!is_empty_producer(&state.producer))
     CALL0(state.producer, destroy);
 
@@ -136,3 +214,7 @@ cleanup:
       CALL0(state.consumers[i], destroy);
   return rv;
 }
+
+int main(int argc, char *argv[]) {
+  return run(argc, argv, NULL, 0);
+}
@@ -0,0 +1,363 @@
+#include "defaults.h"
+#include "macro.h"
+#include "mmap.h"
+#include "stats.h"
+#include "struct.h"
+#include "util.h"
+
+#include <assert.h>
+#include <fcntl.h>
+#include <setjmp.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/epoll.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+// A reader of a regular file, which is best warm in page cache. The file
+// is mapped once to read ahead and copy from. When the engine's buffer is
+// its own, the pages of the file are mapped into it in place of copies,
+// copy-on-write, and stay there until the producer comes around the ring
+// again, which is after the slowest consumer is done with them.
+struct data {
+  int fd;
+  size_t block_size;
+  size_t lo_watermark;
+  size_t read_ahead;
+  size_t page_size;
+  const char *map;
+  uint64_t size;
+
+  uint64_t offset;
+  uint64_t end;
+  uint64_t advised;
+  uint64_t dropped;
+  bool private_ring;
+
+  uint64_t mapped_bytes;
+  uint64_t copied_bytes;
+  char filename[];
+};
+
+#define WITH_THIS(act) PERROR1("failed to " act " for", this->filename)
+
+// A file which shrinks while it's mapped faults with SIGBUS where it's gone.
+// The producer touches the mapping under a guard, so that the transfer
+// fails then rather than the process. Pages mapped into the buffer are
+// touched as they are mapped, but if the file is cut short after that,
+// they fault wherever a consumer reads them; so the file shouldn't be
+// truncated while it's read.
+static _Thread_local sigjmp_buf *volatile guard = NULL;
+
+static void on_sigbus(int signum) {
+  if (guard)
+    siglongjmp(*guard, 1);
+  // Elsewhere the fault is fatal, as it would be without the handler.
+  signal(SIGBUS, SIG_DFL);
+}
+
+static bool init(void *data, size_t block_size) {
+  GET(struct data, this, data);
+  if (!this->block_size)
+    this->block_size = block_size;
+  if (this->lo_watermark > this->block_size)
+    this->lo_watermark = this->block_size;
+  this->page_size = sysconf(_SC_PAGESIZE);
+
+  struct sigaction action = { .sa_handler = on_sigbus };
+  sigemptyset(&action.sa_mask);
+  CHECK(SYSCALL(sigaction(SIGBUS, &action, NULL)),
+        WITH_THIS("handle SIGBUS"), return false);
+
+  CHECK(SYSCALL(this->fd = open(this->filename, O_RDONLY | O_LARGEFILE)),
+        WITH_THIS("call open"), return false);
+  struct stat stat;
+  CHECK(SYSCALL(fstat(this->fd, &stat)), WITH_THIS("call fstat"),
+        return false);
+  CHECK(S_ISREG(stat.st_mode),
+        fprintf(stderr, "%s is not a regular file\n", this->filename),
+        return false);
+  this->size = this->end = stat.st_size;
+  if (!this->size)
+    return true;
+
+  void *map = mmap(NULL, this->size, PROT_READ, MAP_SHARED, this->fd, 0);
+  CHECK(map != MAP_FAILED, WITH_THIS("map"), return false);
+  this->map = map;
+  CHECK(SYSCALL(madvise(map, this->size, MADV_SEQUENTIAL)),
+        WITH_THIS("advise"), ;);
+  return true;
+}
+
+static const char *name(void *data) {
+  GET(struct data, this, data);
+  return this->filename;
+}
+
+static void destroy(void *data) {
+  GET(struct data, this, data);
+  if (this->map)
+    CHECK(SYSCALL(munmap((void *)this->map, this->size)), WITH_THIS("unmap"),
+          ;);
+  COND_CHECK(this->fd, -1, SYSCALL(close(this->fd)), WITH_THIS("call close"));
+  free(data);
+}
+
+static bool get_info(void *data, struct stream_info *info) {
+  GET(struct data, this, data);
+  info->size_known = true;
+  info->size = this->size;
+  info->image_size = this->size;
+  set_local_source(info, this->filename);
+  return true;
+}
+
+static uint32_t get_epoll_event(void *data) {
+  return EPOLLIN;
+}
+
+// The producer never waits, the pages which aren't in page cache are read
+// when they are touched.
+static int get_fd(void *data) {
+  return -1;
+}
+
+static size_t get_lo_watermark(void *data) {
+  GET(struct data, this, data);
+  return this->lo_watermark;
+}
+
+static size_t get_block_size(void *data) {
+  GET(struct data, this, data);
+  return this->block_size;
+}
+
+static size_t get_read_ahead(void *data) {
+  GET(struct data, this, data);
+  return this->read_ahead;
+}
+
+static uint64_t page_floor(struct data *this, uint64_t offset) {
+  return offset - offset % this->page_size;
+}
+
+// Reading ahead is asked for a window past what is produced, so that the
+// consumers don't wait for the disk on the pages they touch.
+static void read_ahead(struct data *this, uint64_t until) {
+  until += this->block_size * this->read_ahead;
+  if (until > this->end)
+    until = this->end;
+  if (this->advised >= until)
+    return;
+  uint64_t begin = page_floor(this, this->advised);
+  CHECK(SYSCALL(madvise((void *)(this->map + begin), until - begin,
+                        MADV_WILLNEED)),
+        WITH_THIS("read ahead"), ;);
+  this->advised = until;
+}
+
+// The mapping isn't needed behind the producer, the consumers use the
+// buffer. The pages leave page cache only if the kernel needs the memory.
+static void drop_behind(struct data *this, uint64_t until) {
+  until = page_floor(this, until);
+  if (until <= this->dropped)
+    return;
+  CHECK(SYSCALL(madvise((void *)(this->map + this->dropped),
+                        until - this->dropped, MADV_DONTNEED)),
+        WITH_THIS("drop pages"), ;);
+  this->dropped = until;
+}
+
+// Copies from the mapping, or with to_map, touches the pages mapped into
+// buf. Returns false if the file was cut short under them.
+static bool copy(struct data *this, void *buf, uint64_t offset,
+                 size_t count, bool to_map) {
+  sigjmp_buf env;
+  if (sigsetjmp(env, 1)) {
+    guard = NULL;
+    fprintf(stderr, "%s was truncated while it was read\n", this->filename);
+    return false;
+  }
+  guard = &env;
+  if (to_map) {
+    for (size_t i = 0; i < count; i += this->page_size)
+      (void)((volatile const char *)buf)[i];
+  } else {
+    memcpy(buf, this->map + offset, count);
+  }
+  guard = NULL;
+  if (!to_map)
+    this->copied_bytes += count;
+  return true;
+}
+
+static ssize_t produce(void *data, void *buf, size_t count, bool *eof) {
+  GET(struct data, this, data);
+  *eof = (this->offset == this->end);
+  if (*eof)
+    return 0;
+  if (count > this->end - this->offset)
+    count = this->end - this->offset;
+  read_ahead(this, this->offset + count);
+
+  // The part up to a page boundary and the partial page at the end are
+  // copied, the whole pages in between mapped, if the buffer lines up with
+  // the file.
+  size_t head = count, mapped = 0;
+  if (this->private_ring &&
+      (uintptr_t)buf % this->page_size == this->offset % this->page_size) {
+    head = (this->page_size - this->offset % this->page_size) %
+        this->page_size;
+    head = (head < count) ? head : count;
+    mapped = (count - head) - (count - head) % this->page_size;
+  }
+  if (!copy(this, buf, this->offset, head, false))
+    return -1;
+  if (mapped) {
+    void *rv = mmap((char *)buf + head, mapped, PROT_READ | PROT_WRITE,
+                    MAP_PRIVATE | MAP_FIXED, this->fd, this->offset + head);
+    CHECK(rv == (char *)buf + head, WITH_THIS("map into buffer"),
+          return -1);
+    if (!copy(this, (char *)buf + head, this->offset + head, mapped, true))
+      return -1;
+    this->mapped_bytes += mapped;
+  }
+  if (!copy(this, (char *)buf + head + mapped, this->offset + head + mapped,
+            count - head - mapped, false))
+    return -1;
+  drop_behind(this, this->offset + count);
+
+  this->offset += count;
+  return count;
+}
+
+static ssize_t produce_signal(void *data, bool *eof) {
+  return 0;
+}
+
+static size_t get_counters(void *data, struct counter *counters) {
+  GET(struct data, this, data);
+  counters[0] = (struct counter) {"mapped_bytes", this->mapped_bytes};
+  counters[1] = (struct counter) {"copied_bytes", this->copied_bytes};
+  return 2;
+}
+
+static bool can_rewind(void *data) {
+  return true;
+}
+
+static bool rewind_input(void *data, uint64_t end) {
+  GET(struct data, this, data);
+  this->offset = this->advised = this->dropped = 0;
+  this->end = (end < this->size) ? end : this->size;
+  return true;
+}
+
+static void set_private_ring(void *data, bool private_ring) {
+  GET(struct data, this, data);
+  this->private_ring = private_ring;
+}
+
+static const struct producer_ops input_ops = {
+  .init             = init,
+  .setup            = setup_nothing,
+  .name             = name,
+  .destroy          = destroy,
+  .get_info         = get_info,
+
+  .get_epoll_event  = get_epoll_event,
+  .get_fd           = get_fd,
+  .get_lo_watermark = get_lo_watermark,
+  .get_block_size   = get_block_size,
+  .get_read_ahead   = get_read_ahead,
+  .produce          = produce,
+  .signal           = produce_signal,
+  .poll             = poll_nothing,
+
+  .get_node         = get_no_node,
+  .get_counters     = get_counters,
+  .put_reports      = put_no_reports,
+  .can_rewind       = can_rewind,
+  .rewind           = rewind_input,
+  .set_private_ring = set_private_ring,
+  .fetch            = fetch_nothing,
+  .take_fetched     = take_nothing_fetched,
+  .get_fetched_fd   = get_no_fetched_fd,
+};
+
+static bool parse_options(struct data *this, char *options) {
+  enum { BLOCK, LO };
+  char *const tokens[] = {
+    [BLOCK] = "block",
+    [LO] = "lo",
+    NULL
+  };
+
+  while (*options) {
+    char *value = NULL;
+    switch (getsubopt(&options, tokens, &value)) {
+    case BLOCK:
+      CHECK(value && parse_size(value, &this->block_size),
+            fprintf(stderr, "bad block option for %s\n", this->filename),
+            return false);
+      break;
+    case LO:
+      CHECK(value && parse_size(value, &this->lo_watermark),
+            fprintf(stderr, "bad lo option for %s\n", this->filename),
+            return false);
+      break;
+    default:
+      fprintf(stderr, "unknown option %s for %s\n", value, this->filename);
+      return false;
+    }
+  }
+  return true;
+}
+
+// The spec is a file name optionally followed by comma-separated options.
+static struct data *construct(const char *spec, size_t read_ahead) {
+  assert(spec);
+  struct data *data = malloc(sizeof(struct data) + strlen(spec) + 1);
+
+  if (data) {
+    data->fd = -1;
+    data->block_size = 0;
+    data->lo_watermark = 0;
+    data->read_ahead = read_ahead;
+    data->page_size = 0;
+    data->map = NULL;
+    data->size = 0;
+
+    data->offset = 0;
+    data->end = 0;
+    data->advised = 0;
+    data->dropped = 0;
+    data->private_ring = false;
+
+    data->mapped_bytes = 0;
+    data->copied_bytes = 0;
+    strcpy(data->filename, spec);
+
+    char *options = strchr(data->filename, ',');
+    if (options) {
+      *options++ = 0;
+      if (!parse_options(data, options))
+        goto cleanup;
+    }
+  }
+
+  return data;
+
+cleanup:
+  free(data);
+  return NULL;
+}
+
+struct producer get_mmap_reader(const char *filename, size_t read_ahead) {
+  return (struct producer) {&input_ops, construct(filename, read_ahead)};
+}
+
+#undef WITH_THIS
@@ -0,0 +1,8 @@
+#pragma once
+
+#include <stdlib.h>
+
+struct producer;
+
+extern struct producer get_mmap_reader(const char *filename,
+                                       size_t read_ahead);
@@ -0,0 +1,529 @@
+#include "defaults.h"
+#include "macro.h"
+#include "nbd.h"
+#include "struct.h"
+
+#include <endian.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/eventfd.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+// The fixed newstyle handshake, with the export named by NBD_OPT_EXPORT_NAME
+// or NBD_OPT_GO, whatever its name, and simple replies.
+#define NBD_MAGIC 0x4e42444d41474943ULL
+#define NBD_OPTS_MAGIC 0x49484156454f5054ULL
+#define NBD_REP_MAGIC 0x3e889045565a9ULL
+#define NBD_REQUEST_MAGIC 0x25609513
+#define NBD_REPLY_MAGIC 0x67446698
+
+#define NBD_FLAG_FIXED_NEWSTYLE 1
+#define NBD_FLAG_NO_ZEROES 2
+#define NBD_FLAG_HAS_FLAGS 1
+#define NBD_FLAG_READ_ONLY 2
+
+#define NBD_OPT_EXPORT_NAME 1
+#define NBD_OPT_ABORT 2
+#define NBD_OPT_INFO 6
+#define NBD_OPT_GO 7
+#define NBD_REP_ACK 1
+#define NBD_REP_INFO 3
+#define NBD_REP_ERR_UNSUP 0x80000001
+#define NBD_INFO_EXPORT 0
+
+#define NBD_CMD_READ 0
+#define NBD_CMD_WRITE 1
+#define NBD_CMD_DISC 2
+
+#define NBD_EPERM 1
+#define NBD_EIO 5
+#define NBD_EINVAL 22
+
+#define NBD_REQUEST_SIZE 28
+#define MAX_OPTION_SIZE 4096
+
+struct nbd_server {
+  int sock;
+  int client;
+  int fd;
+  // Wakes the server up to stop while it waits for a client.
+  int stop_fd;
+  uint64_t size;
+  pthread_t thread;
+  bool running;
+  char *buf;
+
+  pthread_mutex_t lock;
+  pthread_cond_t cond;
+  uint64_t arrived;
+  bool stopping;
+  bool aborted;
+  // What a read waits for, until it's taken, is signalled on wanted_fd.
+  // Ranges past arrived which were fetched are kept apart, sorted.
+  int wanted_fd;
+  bool want;
+  struct extent wanted;
+  size_t num_fetched;
+  struct extent fetched[NBD_MAX_FETCHED];
+
+  const char *filename;
+  char path[];
+};
+
+static bool receive_all(int sock, void *buf, size_t size) {
+  while (size) {
+    ssize_t rv = recv(sock, buf, size, MSG_WAITALL);
+    if (rv == -1 && errno == EINTR)
+      continue;
+    if (rv <= 0)
+      return false;
+    buf = (char *)buf + rv;
+    size -= rv;
+  }
+  return true;
+}
+
+static bool send_all(int sock, const void *buf, size_t size) {
+  while (size) {
+    ssize_t rv = send(sock, buf, size, MSG_NOSIGNAL);
+    if (rv == -1 && errno == EINTR)
+      continue;
+    if (rv == -1)
+      return false;
+    buf = (const char *)buf + rv;
+    size -= rv;
+  }
+  return true;
+}
+
+static void put16(char *buf, uint16_t value) {
+  value = htobe16(value);
+  memcpy(buf, &value, sizeof(value));
+}
+
+static void put32(char *buf, uint32_t value) {
+  value = htobe32(value);
+  memcpy(buf, &value, sizeof(value));
+}
+
+static void put64(char *buf, uint64_t value) {
+  value = htobe64(value);
+  memcpy(buf, &value, sizeof(value));
+}
+
+static uint16_t get16(const char *buf) {
+  uint16_t value;
+  memcpy(&value, buf, sizeof(value));
+  return be16toh(value);
+}
+
+static uint32_t get32(const char *buf) {
+  uint32_t value;
+  memcpy(&value, buf, sizeof(value));
+  return be32toh(value);
+}
+
+static uint64_t get64(const char *buf) {
+  uint64_t value;
+  memcpy(&value, buf, sizeof(value));
+  return be64toh(value);
+}
+
+static bool reply_option(struct nbd_server *this, uint32_t option,
+                         uint32_t type, const char *data, uint32_t size) {
+  char reply[20];
+  put64(reply, NBD_REP_MAGIC);
+  put32(reply + 8, option);
+  put32(reply + 12, type);
+  put32(reply + 16, size);
+  return send_all(this->client, reply, sizeof(reply)) &&
+      send_all(this->client, data, size);
+}
+
+// Returns true once the client is ready for the transmission phase.
+static bool negotiate(struct nbd_server *this) {
+  char hello[18];
+  put64(hello, NBD_MAGIC);
+  put64(hello + 8, NBD_OPTS_MAGIC);
+  put16(hello + 16, NBD_FLAG_FIXED_NEWSTYLE | NBD_FLAG_NO_ZEROES);
+  char flags[4];
+  if (!send_all(this->client, hello, sizeof(hello)) ||
+      !receive_all(this->client, flags, sizeof(flags)))
+    return false;
+  bool zeroes = !(get32(flags) & NBD_FLAG_NO_ZEROES);
+
+  const uint16_t transmission = NBD_FLAG_HAS_FLAGS | NBD_FLAG_READ_ONLY;
+  for (;;) {
+    char header[16];
+    char data[MAX_OPTION_SIZE];
+    if (!receive_all(this->client, header, sizeof(header)))
+      return false;
+    uint32_t option = get32(header + 8);
+    uint32_t size = get32(header + 12);
+    CHECK(get64(header) == NBD_OPTS_MAGIC && size <= sizeof(data),
+          fprintf(stderr, "bad NBD option for %s\n", this->filename),
+          return false);
+    if (!receive_all(this->client, data, size))
+      return false;
+
+    switch (option) {
+    case NBD_OPT_EXPORT_NAME: {
+      char export[10 + 124] = {0};
+      put64(export, this->size);
+      put16(export + 8, transmission);
+      return send_all(this->client, export, zeroes ? sizeof(export) : 10);
+    }
+    case NBD_OPT_ABORT:
+      reply_option(this, option, NBD_REP_ACK, NULL, 0);
+      return false;
+    case NBD_OPT_INFO:
+    case NBD_OPT_GO: {
+      char info[12];
+      put16(info, NBD_INFO_EXPORT);
+      put64(info + 2, this->size);
+      put16(info + 10, transmission);
+      if (!reply_option(this, option, NBD_REP_INFO, info, sizeof(info)) ||
+          !reply_option(this, option, NBD_REP_ACK, NULL, 0))
+        return false;
+      if (option == NBD_OPT_GO)
+        return true;
+      break;
+    }
+    default:
+      if (!reply_option(this, option, NBD_REP_ERR_UNSUP, NULL, 0))
+        return false;
+    }
+  }
+}
+
+static bool has_arrived(struct nbd_server *this, uint64_t offset,
+                        uint64_t end) {
+  if (offset < this->arrived)
+    offset = this->arrived;
+  if (offset >= end)
+    return true;
+  for (size_t i = 0; i != this->num_fetched; ++i) {
+    const struct extent *extent = &this->fetched[i];
+    if (extent->offset <= offset && end <= extent->offset + extent->length)
+      return true;
+  }
+  return false;
+}
+
+// The part which is missing is asked for in whole pieces of FETCH_SIZE.
+static void want(struct nbd_server *this, uint64_t offset, uint64_t end) {
+  if (offset < this->arrived)
+    offset = this->arrived;
+  offset -= offset % FETCH_SIZE;
+  end += FETCH_SIZE - 1;
+  end -= end % FETCH_SIZE;
+  if (end > this->size)
+    end = this->size;
+  this->wanted = (struct extent) { offset, end - offset };
+  this->want = true;
+  const uint64_t one = 1;
+  CHECK(write(this->wanted_fd, &one, sizeof(one)) == sizeof(one),
+        PERROR1("failed to ask for range for NBD client of", this->filename),
+        ;);
+}
+
+// If the range can't be fetched, it comes with the stream.
+static bool wait_arrived(struct nbd_server *this, uint64_t offset,
+                         uint64_t end) {
+  pthread_mutex_lock(&this->lock);
+  if (!has_arrived(this, offset, end) && !this->aborted)
+    want(this, offset, end);
+  while (!has_arrived(this, offset, end) && !this->aborted)
+    pthread_cond_wait(&this->cond, &this->lock);
+  bool rv = has_arrived(this, offset, end);
+  pthread_mutex_unlock(&this->lock);
+  return rv;
+}
+
+static uint32_t read_range(struct nbd_server *this, uint64_t offset,
+                           uint32_t length) {
+  if (offset > this->size || length > this->size - offset ||
+      length > NBD_MAX_REQUEST)
+    return NBD_EINVAL;
+  if (!wait_arrived(this, offset, offset + length))
+    return NBD_EIO;
+  for (uint32_t done = 0; done != length;) {
+    ssize_t rv = pread(this->fd, this->buf + done, length - done,
+                       offset + done);
+    CHECK(rv > 0, PERROR1("failed to read for NBD client of", this->filename),
+          return NBD_EIO);
+    done += rv;
+  }
+  return 0;
+}
+
+// Writes are refused, but their data has to be taken off the socket.
+static bool skip_data(struct nbd_server *this, uint32_t length) {
+  while (length) {
+    uint32_t size = (length < NBD_MAX_REQUEST) ? length : NBD_MAX_REQUEST;
+    if (!receive_all(this->client, this->buf, size))
+      return false;
+    length -= size;
+  }
+  return true;
+}
+
+// Requests are served one by one, in the order they come.
+static void serve(struct nbd_server *this) {
+  for (;;) {
+    char request[NBD_REQUEST_SIZE];
+    if (!receive_all(this->client, request, sizeof(request)))
+      return;
+    CHECK(get32(request) == NBD_REQUEST_MAGIC,
+          fprintf(stderr, "bad NBD request for %s\n", this->filename),
+          return);
+    uint16_t type = get16(request + 6);
+    uint64_t offset = get64(request + 16);
+    uint32_t length = get32(request + 24);
+
+    uint32_t error = NBD_EINVAL;
+    switch (type) {
+    case NBD_CMD_READ:
+      error = read_range(this, offset, length);
+      break;
+    case NBD_CMD_WRITE:
+      if (!skip_data(this, length))
+        return;
+      error = NBD_EPERM;
+      break;
+    case NBD_CMD_DISC:
+      return;
+    }
+
+    char reply[16];
+    put32(reply, NBD_REPLY_MAGIC);
+    put32(reply + 4, error);
+    memcpy(reply + 8, request + 8, 8);
+    if (!send_all(this->client, reply, sizeof(reply)) ||
+        (type == NBD_CMD_READ && !error &&
+         !send_all(this->client, this->buf, length)))
+      return;
+  }
+}
+
+static void *run(void *arg) {
+  struct nbd_server *this = arg;
+  for (;;) {
+    struct pollfd fds[2] = {
+      { .fd = this->sock, .events = POLLIN },
+      { .fd = this->stop_fd, .events = POLLIN },
+    };
+    if (poll(fds, arraysize(fds), -1) == -1) {
+      CHECK(errno == EINTR, PERROR1("failed to wait for NBD client of",
+                                    this->filename),
+            break);
+      continue;
+    }
+    if (fds[1].revents)
+      break;
+    int client = accept(this->sock, NULL, NULL);
+    if (client == -1)
+      continue;
+
+    pthread_mutex_lock(&this->lock);
+    bool aborted = this->aborted;
+    if (!aborted)
+      this->client = client;
+    pthread_mutex_unlock(&this->lock);
+    if (!aborted && negotiate(this))
+      serve(this);
+
+    pthread_mutex_lock(&this->lock);
+    this->client = -1;
+    bool stopping = this->stopping;
+    pthread_mutex_unlock(&this->lock);
+    CHECK(SYSCALL(close(client)),
+          PERROR1("failed to close NBD client of", this->filename), ;);
+    if (stopping)
+      break;
+  }
+  return NULL;
+}
+
+static bool listen_on(struct nbd_server *this) {
+  struct sockaddr_un address = { .sun_family = AF_UNIX };
+  CHECK(strlen(this->path) < sizeof(address.sun_path),
+        fprintf(stderr, "NBD socket path %s is too long\n", this->path),
+        return false);
+  strcpy(address.sun_path, this->path);
+  CHECK(SYSCALL(unlink(this->path)) || errno == ENOENT,
+        PERROR1("failed to remove old NBD socket", this->path), return false);
+
+  CHECK(SYSCALL(this->sock = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0)),
+        PERROR1("failed to create NBD socket", this->path), return false);
+  // The socket is removed on the way out only if it's this one.
+  CHECK(SYSCALL(bind(this->sock, (struct sockaddr *)&address,
+                     sizeof(address))),
+        PERROR1("failed to bind NBD socket", this->path),
+        close(this->sock); this->sock = -1; return false);
+  CHECK(SYSCALL(listen(this->sock, 1)),
+        PERROR1("failed to listen on NBD socket", this->path), return false);
+  return true;
+}
+
+struct nbd_server *start_nbd_server(const char *path, const char *filename,
+                                    uint64_t size) {
+  struct nbd_server *this = malloc(sizeof(struct nbd_server) +
+                                   strlen(path) + 1);
+  CHECK(this, ERROR("can't allocate memory for NBD server"), return NULL);
+  this->sock = -1;
+  this->client = -1;
+  this->fd = -1;
+  this->stop_fd = -1;
+  this->size = size;
+  this->running = false;
+  this->buf = NULL;
+  pthread_mutex_init(&this->lock, NULL);
+  pthread_cond_init(&this->cond, NULL);
+  this->arrived = 0;
+  this->stopping = false;
+  this->aborted = false;
+  this->wanted_fd = -1;
+  this->want = false;
+  this->num_fetched = 0;
+  this->filename = filename;
+  strcpy(this->path, path);
+
+  CHECK(this->buf = malloc(NBD_MAX_REQUEST),
+        ERROR("can't allocate memory for NBD requests"), goto fail);
+  CHECK(SYSCALL(this->fd = open(filename, O_RDONLY | O_LARGEFILE)),
+        PERROR1("failed to open for NBD clients", filename), goto fail);
+  CHECK(SYSCALL(this->stop_fd = eventfd(0, 0)),
+        PERROR1("failed to initialize eventfd for NBD server of", filename),
+        goto fail);
+  CHECK(SYSCALL(this->wanted_fd = eventfd(0, EFD_NONBLOCK)),
+        PERROR1("failed to initialize eventfd for NBD server of", filename),
+        goto fail);
+  if (!listen_on(this))
+    goto fail;
+
+  int rv = pthread_create(&this->thread, NULL, run, this);
+  errno = rv;
+  CHECK(rv == 0, PERROR1("failed to start NBD server of", filename),
+        goto fail);
+  this->running = true;
+  return this;
+
+fail:
+  stop_nbd_server(this, false);
+  return NULL;
+}
+
+void set_nbd_arrived(struct nbd_server *this, uint64_t offset) {
+  pthread_mutex_lock(&this->lock);
+  this->arrived = offset;
+  size_t kept = 0;
+  for (size_t i = 0; i != this->num_fetched; ++i) {
+    const struct extent *extent = &this->fetched[i];
+    if (extent->offset + extent->length > offset)
+      this->fetched[kept++] = *extent;
+  }
+  this->num_fetched = kept;
+  pthread_cond_broadcast(&this->cond);
+  pthread_mutex_unlock(&this->lock);
+}
+
+int get_nbd_wanted_fd(struct nbd_server *this) {
+  return this->wanted_fd;
+}
+
+bool take_nbd_wanted(struct nbd_server *this, struct extent *extent) {
+  uint64_t count;
+  if (read(this->wanted_fd, &count, sizeof(count)) == -1)
+    CHECK(errno == EAGAIN,
+          PERROR1("failed to take range for NBD client of", this->filename),
+          ;);
+  pthread_mutex_lock(&this->lock);
+  bool rv = this->want;
+  if (rv)
+    *extent = this->wanted;
+  this->want = false;
+  pthread_mutex_unlock(&this->lock);
+  return rv;
+}
+
+// Ranges which touch are merged. When there's no room for one, the one
+// nearest to arriving with the stream makes room for it.
+void set_nbd_fetched(struct nbd_server *this, uint64_t offset,
+                     uint64_t length) {
+  pthread_mutex_lock(&this->lock);
+  uint64_t end = offset + length;
+  if (end > this->arrived) {
+    size_t i = 0;
+    while (i != this->num_fetched &&
+           this->fetched[i].offset + this->fetched[i].length < offset)
+      ++i;
+    size_t j = i;
+    while (j != this->num_fetched && this->fetched[j].offset <= end) {
+      if (this->fetched[j].offset < offset)
+        offset = this->fetched[j].offset;
+      if (this->fetched[j].offset + this->fetched[j].length > end)
+        end = this->fetched[j].offset + this->fetched[j].length;
+      ++j;
+    }
+    if (i == j && this->num_fetched == NBD_MAX_FETCHED) {
+      memmove(&this->fetched[0], &this->fetched[1],
+              --this->num_fetched * sizeof(struct extent));
+      i -= (i != 0);
+      j = i;
+    }
+    memmove(&this->fetched[i+1], &this->fetched[j],
+            (this->num_fetched - j) * sizeof(struct extent));
+    this->num_fetched = this->num_fetched - (j - i) + 1;
+    this->fetched[i] = (struct extent) { offset, end - offset };
+  }
+  pthread_cond_broadcast(&this->cond);
+  pthread_mutex_unlock(&this->lock);
+}
+
+void stop_nbd_server(struct nbd_server *this, bool complete) {
+  pthread_mutex_lock(&this->lock);
+  this->stopping = true;
+  this->aborted = !complete;
+  // A client which is cut off still gets the replies to its reads.
+  if (this->aborted && this->client != -1)
+    shutdown(this->client, SHUT_RD);
+  bool serving = this->client != -1 && !this->aborted;
+  pthread_cond_broadcast(&this->cond);
+  pthread_mutex_unlock(&this->lock);
+
+  if (this->running) {
+    if (serving)
+      fprintf(stderr, "serving %s on %s until the NBD client disconnects\n",
+              this->filename, this->path);
+    const uint64_t one = 1;
+    CHECK(write(this->stop_fd, &one, sizeof(one)) == sizeof(one),
+          PERROR1("failed to stop NBD server of", this->filename), ;);
+    pthread_join(this->thread, NULL);
+  }
+
+  if (this->sock != -1)
+    CHECK(SYSCALL(unlink(this->path)),
+          PERROR1("failed to remove NBD socket", this->path), ;);
+  COND_CHECK(this->sock, -1, SYSCALL(close(this->sock)),
+             PERROR1("failed to close NBD socket", this->path));
+  COND_CHECK(this->stop_fd, -1, SYSCALL(close(this->stop_fd)),
+             PERROR1("failed to close eventfd for NBD server of",
+                     this->filename));
+  COND_CHECK(this->wanted_fd, -1, SYSCALL(close(this->wanted_fd)),
+             PERROR1("failed to close eventfd for NBD server of",
+                     this->filename));
+  COND_CHECK(this->fd, -1, SYSCALL(close(this->fd)),
+             PERROR1("failed to close for NBD clients", this->filename));
+  pthread_cond_destroy(&this->cond);
+  pthread_mutex_destroy(&this->lock);
+  free(this->buf);
+  free(this);
+}
@@ -0,0 +1,26 @@
+#pragma once
+
+#include <inttypes.h>
+#include <stdbool.h>
+
+// A read-only NBD server of an output while the stream is still being
+// written to it, for one client at a time on a unix socket. Reads of the
+// part which hasn't arrived yet wait for it, and ask for it to be fetched
+// from the source ahead of the rest of the stream.
+struct nbd_server;
+struct extent;
+
+extern struct nbd_server *start_nbd_server(const char *path,
+                                           const char *filename,
+                                           uint64_t size);
+// The output is written up to offset.
+extern void set_nbd_arrived(struct nbd_server *server, uint64_t offset);
+// The range a read waits for is taken once the fd is readable.
+extern int get_nbd_wanted_fd(struct nbd_server *server);
+extern bool take_nbd_wanted(struct nbd_server *server, struct extent *extent);
+// The range was written ahead of the stream.
+extern void set_nbd_fetched(struct nbd_server *server, uint64_t offset,
+                            uint64_t length);
+// Once the output is complete, the client is served until it disconnects,
+// otherwise it's cut off.
+extern void stop_nbd_server(struct nbd_server *server, bool complete);
@@ -5,15 +5,29 @@ import contextlib
 import dataclasses
 import enum
 import fcntl
+import hashlib
+import hmac
+import itertools
+import json
 import logging
+import math
 import os
 import signal
 import socket
+import stat
 import subprocess
 import sys
 from typing import Optional
 
 
+# Chains of at most this many destinations are ordered by trying all
+# orders, longer ones greedily.
+MAX_EXHAUSTIVE_ORDER = 8
+
+# A probe which doesn't finish in this many seconds failed.
+PROBE_TIMEOUT = 60
+
+
 @dataclasses.dataclass
 class Process:
     description: str
@@ -79,6 +93,25 @@ def add_common_options(parser):
                         help='write only blocks that are different in output')
     parser.add_argument('-v', '--verbose', action='store_true',
                         help='enable verbose logging')
+    parser.add_argument('--chain', metavar='FILE',
+                        help='keep the view of the whole chain with its '
+                             'bottleneck in FILE on source, - for stderr')
+    parser.add_argument('--extents', metavar='LIST',
+                        help='send only the extents of input listed in LIST '
+                             'on source, with an offset and a length in '
+                             'bytes per line, or the allocated ones with '
+                             '"fiemap", and leave the rest of output as is')
+    parser.add_argument('--cache', metavar='DIR',
+                        help='keep the blocks of output in a cache in DIR on '
+                             'destinations, and don\'t send them the blocks '
+                             'they have there')
+    parser.add_argument('--nbd', metavar='SOCKET',
+                        help='serve output on destinations read-only to an '
+                             'NBD client on the unix socket SOCKET while it '
+                             'arrives, and then until the client '
+                             'disconnects; unless the stream is encrypted, '
+                             'what the client reads is fetched from the '
+                             'source ahead of the rest')
 
 
 def add_master_options(parser):
@@ -96,6 +129,26 @@ def add_master_options(parser):
                         required=True)
     parser.add_argument('-X', metavar='SSH_ARG', action='append', default=[],
                         help='Additional option(s) to pass to ssh')
+    parser.add_argument('--stats', metavar='REPORT',
+                        help='collect stats from every node into REPORT')
+    parser.add_argument('--daemon', metavar='PORT',
+                        help='submit jobs to ndd daemons listening on PORT '
+                             'on the nodes instead of starting ndd with ssh')
+    parser.add_argument('--daemon-key', metavar='FILE',
+                        help='key file the daemons were started with')
+    parser.add_argument('--stripes', metavar='K', type=int, default=1,
+                        help='split the input into K stripes, each sent '
+                             'along the destinations in a different order '
+                             'on a port of its own, starting with PORT')
+    parser.add_argument('--topology', metavar='FILE',
+                        help='order the destinations by the hints in FILE, '
+                             'a JSON object with "switch" and "disk" (write '
+                             'rate in bytes/s) of the hosts')
+    parser.add_argument('--probe', metavar='SIZE', type=int,
+                        help='order the destinations by throughput and RTT '
+                             'of a transfer of SIZE bytes between every '
+                             'pair of nodes')
+    parser.set_defaults(stripe=None)
 
 
 def add_slave_options(parser):
@@ -108,6 +161,10 @@ def add_slave_options(parser):
                         help='address to listen on')
     parser.add_argument('-R', '--receive', metavar='ADDR',
                         help='address to data receive from')
+    parser.add_argument('--stats', metavar='FILE',
+                        help='file to dump ndd stats to')
+    parser.add_argument('--stripe', metavar='I/K',
+                        help='send or receive stripe I of K of the input')
 
 
 def get_master_parser():
@@ -126,10 +183,170 @@ def get_local_source_args(args):
     sargs = argparse.Namespace(**vars(args))
     sargs.output = None
     sargs.send = sargs.source
+    sargs.stats = get_node_stats_path(args, 'src')
     return sargs
 
 
-def get_slave_cmd(args, input_=None, output=None, receive=None, send=None):
+def load_topology(path):
+    """Hints on the hosts by name: the switch they are behind and the write
+    rate of their disk, either may be missing."""
+    with open(path) as hints:
+        topology = json.load(hints)
+    assert isinstance(topology, dict), f'{path} should be a JSON object'
+    return topology
+
+
+def run_on(args, host, command, local):
+    cmd = (['sh', '-c', command] if local
+           else ssh(host, args.X, tty=False) + [command])
+    return subprocess.Popen(cmd, stdout=subprocess.PIPE,
+                            stderr=subprocess.DEVNULL,
+                            start_new_session=True)
+
+
+def probe_link(args, sender, receiver, local):
+    """Sends SIZE bytes with ndd from sender to receiver, returns the rate
+    in bytes/s and the RTT in us the receiver saw, or None."""
+    address = f'{get_host(sender)}:{args.port}'
+    send = run_on(args, sender,
+                  f'head -c {args.probe} /dev/zero | '
+                  f'{args.ndd} -I /dev/stdin -s {address}', local)
+    receive = run_on(args, receiver,
+                     f'stats=$(mktemp) && trap \'rm -f "$stats"\' EXIT && '
+                     f'trap \'exit 1\' HUP INT TERM && '
+                     f'{{ {args.ndd} -r {address} -O /dev/stdout '
+                     f'-S "$stats" | cat > /dev/null; cat "$stats"; }}',
+                     False)
+    try:
+        output = receive.communicate(timeout=PROBE_TIMEOUT)[0]
+        send.wait(timeout=PROBE_TIMEOUT)
+    except subprocess.TimeoutExpired:
+        logging.warning('Probe %s -> %s timed out', sender, receiver)
+        # With the shell, the whole pipeline, which is given the time to
+        # clean up.
+        for process in (send, receive):
+            for sig in (signal.SIGTERM, signal.SIGKILL):
+                with contextlib.suppress(ProcessLookupError):
+                    os.killpg(process.pid, sig)
+                with contextlib.suppress(subprocess.TimeoutExpired):
+                    process.wait(timeout=1)
+                    break
+        return None
+    try:
+        result = json.loads(output)
+        seconds = (result['work_ns'] + result['sleep_ns'] +
+                   result['spin_ns']) / 1e9
+        rtt = result['endpoints'][get_host(sender)]['rtt_us']
+    except (ValueError, KeyError):
+        logging.warning('Failed to probe %s -> %s', sender, receiver)
+        return None
+    rate = args.probe / seconds if seconds else float('inf')
+    logging.info('Probed %s -> %s: %.1f MB/s, RTT %d us',
+                 sender, receiver, rate / 1e6, rtt)
+    return rate, rtt
+
+
+def probe_links(args):
+    """One pair at a time, so that the probes don't share the links."""
+    links = {}
+    for sender in [args.source] + args.destination:
+        for receiver in args.destination:
+            if receiver != sender:
+                links[sender, receiver] = probe_link(
+                    args, sender, receiver,
+                    local=args.local and sender == args.source)
+    return links
+
+
+def score_chain(chain, topology, links):
+    """Higher is better: the slowest link or disk of a node which forwards
+    the stream, then fewer links across switches, then lower total RTT.
+    The disk of the last node holds up no one else, and a link which failed
+    its probe carries nothing."""
+    def hint(node, name):
+        return topology.get(get_host(node), {}).get(name)
+
+    rate = float('inf')
+    crossings = 0
+    rtt = 0
+    for sender, receiver in zip(chain, chain[1:]):
+        if (sender, receiver) in links:
+            probed = links[sender, receiver]
+            rate = min(rate, probed[0] if probed else 0)
+            rtt += probed[1] if probed else 0
+        switches = hint(sender, 'switch'), hint(receiver, 'switch')
+        if None not in switches and switches[0] != switches[1]:
+            crossings += 1
+    for node in chain[1:-1]:
+        if hint(node, 'disk'):
+            rate = min(rate, hint(node, 'disk'))
+    return rate, -crossings, -rtt
+
+
+def order_destinations(args):
+    topology = load_topology(args.topology) if args.topology else {}
+    links = probe_links(args) if args.probe else {}
+
+    def score(destinations):
+        return score_chain([args.source] + list(destinations), topology,
+                           links)
+
+    if len(args.destination) <= MAX_EXHAUSTIVE_ORDER:
+        order = max(itertools.permutations(args.destination), key=score)
+    else:
+        # The slowest disk goes last, and each next node before it is the
+        # one which makes the chain so far best.
+        tail = min(args.destination, key=lambda node: topology.get(
+            get_host(node), {}).get('disk') or float('inf'))
+        order = []
+        rest = [node for node in args.destination if node != tail]
+        while rest:
+            best = max(rest, key=lambda node: score(order + [node, tail]))
+            order.append(best)
+            rest.remove(best)
+        order.append(tail)
+    logging.info('Ordered the chain: %s', ' -> '.join(order))
+    return list(order)
+
+
+def get_stripe_args(args):
+    """Arguments for the chain of every stripe.
+
+    The chain of stripe k visits the destinations with a stride s coprime
+    to their number n, starting at destination k, so the node after each
+    one differs from stripe to stripe while there are strides left. A link
+    between two destinations then carries ceil(K/phi(n)) of the K stripes
+    at most, just one if K <= phi(n), and the source sends each of them
+    ceil(K/n) at most.
+    """
+    if args.stripes == 1:
+        return [args]
+    n = len(args.destination)
+    strides = [s for s in range(1, n + 1) if math.gcd(s, n) == 1]
+    stripes = []
+    for k in range(args.stripes):
+        sargs = argparse.Namespace(**vars(args))
+        sargs.stripe = f'{k}/{args.stripes}'
+        sargs.port = str(int(args.port) + k)
+        stride = strides[k % len(strides)]
+        sargs.destination = [args.destination[(k + stride * j) % n]
+                             for j in range(n)]
+        if args.chain and args.chain != '-':
+            sargs.chain = f'{args.chain}.{k}'
+        stripes.append(sargs)
+    return stripes
+
+
+def get_stripe_suffix(args):
+    return f'_{args.stripe.partition("/")[0]}' if args.stripe else ''
+
+
+def get_node_stats_path(args, node):
+    return f'/tmp/ndd-stats-{args.port}-{node}.json' if args.stats else None
+
+
+def get_slave_cmd(args, input_=None, output=None, receive=None, send=None,
+                  stats=None):
     cmd = [sys.executable, os.path.abspath(__file__),
            '--slave', '--ndd', args.ndd, '--port', args.port]
     put_non_required_options(args, cmd)
@@ -153,6 +370,13 @@ def get_slave_cmd(args, input_=None, output=None, receive=None, send=None):
     add_opt(cmd, '--lock-input', args.lock_input)
     add_opt(cmd, '--lock-output', args.lock_output)
 
+    add_opt(cmd, '--stats', stats)
+    add_opt(cmd, '--chain', args.chain if input_ else None)
+    add_opt(cmd, '--stripe', args.stripe)
+    add_opt(cmd, '--extents', args.extents)
+    add_opt(cmd, '--cache', args.cache)
+    add_opt(cmd, '--nbd', args.nbd)
+
     return cmd
 
 
@@ -160,14 +384,16 @@ def get_host(source):
     return source[source.find('@')+1:]
 
 
-def ssh(host, args):
-    return ['ssh', '-tt', '-o', 'PasswordAuthentication=no'] + args + [host]
+def ssh(host, args, tty=True):
+    return (['ssh'] + (['-tt'] if tty else []) +
+            ['-o', 'PasswordAuthentication=no'] + args + [host])
 
 
 def get_remote_source_cmd(args):
     return (
         ssh(args.source, args.X) +
-        get_slave_cmd(args, input_=args.input, send=get_host(args.source))
+        get_slave_cmd(args, input_=args.input, send=get_host(args.source),
+                      stats=get_node_stats_path(args, 'src'))
     )
 
 
@@ -181,37 +407,62 @@ def get_remote_destination_cmd(args, i):
     )
     return (
         ssh(args.destination[i], args.X) +
-        get_slave_cmd(args, output=args.output, receive=receive, send=send)
+        get_slave_cmd(args, output=args.output, receive=receive, send=send,
+                      stats=get_node_stats_path(args, i))
     )
 
 
-def get_source_ndd_cmd(args, read_fd):
+def put_stats_option(args, cmd):
+    if args.stats:
+        cmd += ['-S', args.stats]
+
+
+def get_input_spec(args):
+    spec = args.input
+    if args.stripe:
+        spec += f',stripe={args.stripe}'
+    if args.extents == 'fiemap':
+        spec += ',fiemap'
+    elif args.extents:
+        spec += f',extents={args.extents}'
+    if args.cache:
+        spec += ',hash'
+    return spec
+
+
+def get_source_ndd_cmd(args, filtered):
     assert args.send, 'must have destination to send on source'
     cmd = [args.ndd]
-    cmd += (
-        ['-I', '/dev/stdin'] if read_fd is not None
-        else ['-i', args.input]
-    )
-    cmd += ['-s', '{}:{}'.format(args.send, args.port)]
     put_non_required_options(args, cmd)
+    cmd += ['-I', '/dev/stdin'] if filtered else ['-i', get_input_spec(args)]
+    cmd += ['-s', '{}:{}'.format(args.send, args.port)]
+    put_stats_option(args, cmd)
+    if args.chain:
+        cmd += ['-C', args.chain]
     return cmd
 
 
-def get_destination_ndd_cmd(args, write_fd):
+def get_destination_ndd_cmd(args, filtered):
     assert args.receive, 'must have source to receive on destination'
     cmd = [args.ndd]
-    cmd += (
-        ['-O', '/dev/stdout'] if write_fd is not None
-        else ['-o', args.output]
-    )
-    cmd += ['-r', '{}:{}'.format(args.receive, args.port)]
+    put_non_required_options(args, cmd)
     if args.send:
         cmd += ['-s', '{}:{}'.format(args.send, args.port)]
-    put_non_required_options(args, cmd)
+    cmd += (
+        ['-O', '/dev/stdout'] if filtered
+        else ['-o', args.output + (f',nbd={args.nbd}' if args.nbd else '')]
+    )
+    receive = '{}:{}'.format(args.receive, args.port)
+    # The stripes of an image are received at the same time, each into a
+    # cache of its own.
+    if args.cache:
+        receive += f',cache={args.cache}{get_stripe_suffix(args)}'
+    cmd += ['-r', receive]
+    put_stats_option(args, cmd)
     return cmd
 
 
-def prepare_local_source(pipeline, args):
+def prepare_local_source(pipeline, args, suffix=''):
     if args.recursive:
         pipeline.processes['src_tar'] = Process(
             'source tar', ['tar', '-C', args.input, '-f', '-', '-c', '.']
@@ -225,43 +476,46 @@ def prepare_local_source(pipeline, args):
             )
         )
 
-    pipeline.processes['src_socat'] = Process(
-        'source socat',
-        ['socat', '-u', 'STDIN',
-         f'TCP4-LISTEN:{args.port},bind={args.send},reuseaddr'],
-        stdin=(
-            None if args.recursive or args.compress
-            else args.input
-        )
+    pipeline.processes['src_ndd' + suffix] = Process(
+        'source ndd',
+        get_source_ndd_cmd(args, filtered=args.recursive or args.compress)
     )
 
     if args.recursive and args.compress:
         pipes = [
             Pipe('src_tar', PipeType.IN_OUT, 'src_pigz', PipeType.IN_OUT),
-            Pipe('src_pigz', PipeType.IN_OUT, 'src_socat', PipeType.IN_OUT),
+            Pipe('src_pigz', PipeType.IN_OUT, 'src_ndd', PipeType.IN_OUT),
         ]
     elif args.recursive:
         pipes = [
-            Pipe('src_tar', PipeType.IN_OUT, 'src_socat', PipeType.IN_OUT),
+            Pipe('src_tar', PipeType.IN_OUT, 'src_ndd', PipeType.IN_OUT),
         ]
     elif args.compress:
         pipes = [
-            Pipe('src_pigz', PipeType.IN_OUT, 'src_socat', PipeType.IN_OUT),
+            Pipe('src_pigz', PipeType.IN_OUT, 'src_ndd', PipeType.IN_OUT),
         ]
     else:
         pipes = []
     pipeline.pipes.extend(pipes)
 
 
+def truncate_output(output):
+    with contextlib.suppress(FileNotFoundError):
+        if stat.S_ISREG(os.stat(output).st_mode):
+            logging.info('Truncating %s', output)
+            os.truncate(output, 0)
+
+
 def prepare_local_destination(pipeline, args):
-    pipeline.processes['dst_rcv_socat'] = Process(
-        'destination receiving socat',
-        ['socat', '-u', f'TCP4:{args.receive}:{args.port},retry=5', 'STDOUT'],
-        stdout=(
-            None if (args.recursive or args.compress or args.patch or
-                     args.send)
-            else args.output
-        )
+    filtered = args.recursive or args.compress or args.patch
+    # The other stripes are written at the same time, and an incremental
+    # transfer only updates the output, ndd cuts it down to the image
+    # instead.
+    if not filtered and not args.stripe and not args.extents:
+        truncate_output(args.output)
+
+    pipeline.processes['dst_ndd'] = Process(
+        'destination ndd', get_destination_ndd_cmd(args, filtered)
     )
     if args.recursive:
         pipeline.processes['dst_tar'] = Process(
@@ -277,82 +531,116 @@ def prepare_local_destination(pipeline, args):
             ['pigz', '-d'],
             stdout=(None if (args.recursive or args.patch) else args.output)
         )
-    if args.send:
-        pipeline.processes['dst_tee'] = Process(
-            'destination tee',
-            (
-                ['tee'] if (args.recursive or args.compress or args.patch)
-                else ['tee', args.output]
-            )
-        )
-        pipeline.processes['dst_snd_socat'] = Process(
-            'destination sending socat',
-            (
-                ['socat', '-u', 'STDIN',
-                 f'TCP4-LISTEN:{args.port},bind={args.send},reuseaddr']
-            )
-        )
 
     pipes = []
-    if args.send:
-        pipes.extend([
-            Pipe('dst_rcv_socat', PipeType.IN_OUT, 'dst_tee', PipeType.IN_OUT),
-            Pipe('dst_tee', PipeType.IN_OUT, 'dst_snd_socat', PipeType.IN_OUT),
-        ])
-        if args.recursive and args.compress:
-            pipes.extend([
-                Pipe('dst_tee', PipeType.DEV_FD,
-                     'dst_pigz', PipeType.IN_OUT),
-                Pipe('dst_pigz', PipeType.IN_OUT, 'dst_tar', PipeType.IN_OUT),
-            ])
-        elif args.recursive:
-            pipes.append(
-                Pipe('dst_tee', PipeType.DEV_FD, 'dst_tar', PipeType.IN_OUT)
-            )
-        elif args.compress:
-            pipes.append(
-                Pipe('dst_tee', PipeType.DEV_FD, 'dst_pigz', PipeType.IN_OUT)
-            )
-            if args.patch:
-                pipes.append(
-                    Pipe('dst_pigz', PipeType.IN_OUT,
-                         'dst_bapply', PipeType.IN_OUT)
-                )
-        elif args.patch:
-            pipes.append(
-                Pipe('dst_tee', PipeType.IN_OUT, 'dst_bapply', PipeType.IN_OUT)
-            )
-    else:
-        if args.recursive and args.compress:
-            pipes.extend([
-                Pipe('dst_rcv_socat', PipeType.IN_OUT,
-                     'dst_pigz', PipeType.IN_OUT),
-                Pipe('dst_pigz', PipeType.IN_OUT, 'dst_tar', PipeType.IN_OUT),
-            ])
-        elif args.recursive:
-            pipes.append(
-                Pipe('dst_rcv_socat', PipeType.IN_OUT,
-                     'dst_tar', PipeType.IN_OUT)
-            )
-        elif args.compress:
+    if args.compress:
+        pipes.append(
+            Pipe('dst_ndd', PipeType.IN_OUT, 'dst_pigz', PipeType.IN_OUT)
+        )
+        if args.recursive:
             pipes.append(
-                Pipe('dst_rcv_socat', PipeType.IN_OUT,
-                     'dst_pigz', PipeType.IN_OUT)
+                Pipe('dst_pigz', PipeType.IN_OUT, 'dst_tar', PipeType.IN_OUT)
             )
-            if args.patch:
-                pipes.append(
-                    Pipe('dst_pigz', PipeType.IN_OUT,
-                         'dst_bapply', PipeType.IN_OUT)
-                )
         elif args.patch:
             pipes.append(
-                Pipe('dst_rcv_socat', PipeType.IN_OUT,
+                Pipe('dst_pigz', PipeType.IN_OUT,
                      'dst_bapply', PipeType.IN_OUT)
             )
+    elif args.recursive:
+        pipes.append(
+            Pipe('dst_ndd', PipeType.IN_OUT, 'dst_tar', PipeType.IN_OUT)
+        )
+    elif args.patch:
+        pipes.append(
+            Pipe('dst_ndd', PipeType.IN_OUT, 'dst_bapply', PipeType.IN_OUT)
+        )
 
     pipeline.pipes.extend(pipes)
 
 
+def get_daemon_jobs(args):
+    jobs = []
+    for stripe_args in get_stripe_args(args):
+        jobs.extend(get_stripe_daemon_jobs(stripe_args))
+    return jobs
+
+
+def get_stripe_daemon_jobs(args):
+    sargs = get_local_source_args(args)
+    sargs.send = get_host(args.source)
+    jobs = [('source', sargs.send, get_source_ndd_cmd(sargs, False))]
+    for i, dest in enumerate(args.destination):
+        dargs = argparse.Namespace(**vars(args))
+        dargs.receive = get_host(
+            args.source if i == 0 else args.destination[i - 1]
+        )
+        dargs.send = (
+            get_host(args.destination[i + 1])
+            if i != len(args.destination) - 1 else None
+        )
+        # The daemon can't be asked to truncate the output beforehand.
+        dargs.output = args.output + (
+            '' if args.stripe or args.extents else ',trunc'
+        )
+        dargs.stats = get_node_stats_path(args, i)
+        jobs.append((f'destination {get_host(dest)}', get_host(dest),
+                     get_destination_ndd_cmd(dargs, False)))
+    return jobs
+
+
+CHALLENGE_SIZE = 32
+
+
+def answer_challenge(conn, key):
+    challenge = b''
+    while len(challenge) != CHALLENGE_SIZE:
+        chunk = conn.recv(CHALLENGE_SIZE - len(challenge))
+        if not chunk:
+            raise OSError('daemon closed connection before challenge')
+        challenge += chunk
+    conn.sendall(hmac.new(key, challenge, hashlib.sha256).digest())
+
+
+def submit_jobs(args, jobs):
+    """Runs the jobs on the daemons, see daemon.h for the protocol."""
+    with open(args.daemon_key, 'rb') as f:
+        key = f.read()
+    conns = []
+    try:
+        for description, host, cmd in jobs:
+            logging.info('Submitting %s to %s:%s: %s',
+                         description, host, args.daemon, cmd[1:])
+            conn = socket.create_connection((host, int(args.daemon)))
+            conns.append((description, conn))
+            answer_challenge(conn, key)
+            conn.sendall(b''.join(arg.encode() + b'\0' for arg in cmd[1:]) +
+                         b'\0')
+
+        success = True
+        for description, conn in conns:
+            reply = b''
+            while chunk := conn.recv(65536):
+                reply += chunk
+            output, sep, status = reply.rpartition(b'\0')
+            if not sep:
+                output = reply
+            for line in output.decode(errors='replace').splitlines():
+                logging.error('%s: %s', description, line)
+            if not sep:
+                logging.error('%s was lost by the daemon', description)
+                success = False
+            elif int(status) != 0:
+                logging.error('%s exited with non-zero exit code %s',
+                              description, int(status))
+                success = False
+            else:
+                logging.info('%s exited normally', description)
+        return success
+    finally:
+        for _, conn in conns:
+            conn.close()
+
+
 @contextlib.contextmanager
 def locked(lockfile, write=False):
     fd = None
@@ -519,6 +807,61 @@ def execute(pipeline):
     return wait_processes(proc_map)
 
 
+def fetch_node_stats(args, host, path, local):
+    try:
+        if local:
+            with open(path) as stats:
+                result = json.load(stats)
+            os.unlink(path)
+            return result
+        output = subprocess.run(
+            ssh(host, args.X, tty=False) + [f'cat {path} && rm -f {path}'],
+            stdout=subprocess.PIPE, check=True
+        ).stdout
+        return json.loads(output)
+    except (OSError, subprocess.CalledProcessError, ValueError):
+        logging.exception('Failed to fetch stats from %s', host)
+        return None
+
+
+def collect_stats(args):
+    nodes = []
+    for stripe_args in get_stripe_args(args):
+        nodes.extend(collect_stripe_stats(stripe_args))
+
+    totals = {}
+    for node in nodes:
+        for name, value in (node['stats'] or {}).items():
+            if isinstance(value, int):
+                totals[name] = totals.get(name, 0) + value
+
+    with open(args.stats, 'w') as report:
+        json.dump({'chain': nodes, 'totals': totals}, report, indent=2)
+        report.write('\n')
+
+
+def collect_stripe_stats(args):
+    nodes = [{
+        'role': 'source',
+        'host': get_host(args.source),
+        'stats': fetch_node_stats(args, args.source,
+                                  get_node_stats_path(args, 'src'),
+                                  local=args.local),
+    }]
+    for i, dest in enumerate(args.destination):
+        nodes.append({
+            'role': 'destination',
+            'host': get_host(dest),
+            'stats': fetch_node_stats(args, dest,
+                                      get_node_stats_path(args, i),
+                                      local=False),
+        })
+    if args.stripe:
+        for node in nodes:
+            node['stripe'] = args.stripe
+    return nodes
+
+
 def setup_logging(args):
     logging.basicConfig(
         level=logging.INFO if args.verbose else logging.WARNING,
@@ -541,7 +884,40 @@ def main(raw_args):
             (locked_on_slave if slave else locked_on_master)(args)
         )
         pipeline = Pipeline()
-        if slave:
+        if not slave:
+            if args.topology or args.probe:
+                args.destination = order_destinations(args)
+            assert args.stripes >= 1, 'there should be at least one stripe'
+            assert args.stripes == 1 or not (
+                args.recursive or args.compress or args.patch
+            ), 'only plain transfers can be striped'
+            assert not args.extents or not (
+                args.recursive or args.compress or args.patch or
+                args.stripes != 1
+            ), 'only plain transfers can be incremental'
+            assert not args.cache or not (
+                args.recursive or args.compress or args.patch
+            ), 'only plain transfers can use a cache'
+            assert not args.nbd or not (
+                args.recursive or args.compress or args.patch or
+                args.stripes != 1 or args.extents
+            ), 'only plain transfers of whole images can be served with NBD'
+        if not slave and args.daemon:
+            assert not (args.recursive or args.compress or args.patch or
+                        args.lock_input or args.lock_output), (
+                'jobs submitted to daemons can only be plain transfers'
+            )
+            assert args.daemon_key, 'jobs are submitted with --daemon-key'
+            try:
+                if not submit_jobs(args, get_daemon_jobs(args)):
+                    return 1
+            except OSError:
+                logging.exception('Failed to submit jobs to daemons')
+                return 2
+            if args.stats:
+                collect_stats(args)
+            return 0
+        elif slave:
             assert (
                 args.input and not args.output or
                 args.output and not args.input
@@ -555,24 +931,37 @@ def main(raw_args):
             assert not (args.recursive and args.patch), (
                 '--recursive and --patch cannot be used at the same time'
             )
-            if args.local:
-                prepare_local_source(pipeline, get_local_source_args(args))
-            else:
-                pipeline.processes.append(
-                    Process('remote source', get_remote_source_cmd(args))
-                )
-
-            for i, dest in enumerate(args.destination):
-                pipeline.processes[f'dest_{get_host(dest)}'] = Process(
-                    f'remote destination for {get_host(dest)}',
-                    get_remote_destination_cmd(args, i)
-                )
+            for sargs in get_stripe_args(args):
+                suffix = get_stripe_suffix(sargs)
+                stripe = f' of stripe {sargs.stripe}' if sargs.stripe else ''
+                if args.local:
+                    prepare_local_source(
+                        pipeline, get_local_source_args(sargs), suffix
+                    )
+                else:
+                    pipeline.processes['src' + suffix] = Process(
+                        'remote source' + stripe,
+                        get_remote_source_cmd(sargs)
+                    )
+
+                for i, dest in enumerate(sargs.destination):
+                    pipeline.processes[
+                        f'dest_{get_host(dest)}{suffix}'
+                    ] = Process(
+                        f'remote destination for {get_host(dest)}{stripe}',
+                        get_remote_destination_cmd(sargs, i)
+                    )
         try:
-            return 0 if execute(pipeline) else 1
+            if not execute(pipeline):
+                return 1
         except Exception:
             logging.exception('Failed to wait for child processes')
             return 2
 
+        if not slave and args.stats:
+            collect_stats(args)
+        return 0
+
 
 if __name__ == '__main__':
     sys.exit(main(sys.argv[1:]))
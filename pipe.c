@@ -1,21 +1,42 @@
+#include "defaults.h"
 #include "pipe.h"
 #include "macro.h"
 #include "struct.h"
 #include "util.h"
 
 #include <assert.h>
+#include <errno.h>
 #include <fcntl.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <sys/epoll.h>
+#include <sys/ioctl.h>
 #include <sys/stat.h>
+#include <sys/timerfd.h>
 #include <sys/types.h>
+#include <sys/uio.h>
 #include <unistd.h>
 
 struct data {
   int fd;
+  size_t block_size;
+  size_t lo_watermark;
   enum { R, W } mode;
+
+  // A writer with splice set splices the ring into the pipe instead of
+  // copying it, unless the kernel can't. The pages are shared with the pipe
+  // until the reader takes them out, so the part of the stream which is in
+  // the pipe is held. They are reused once the pipe is empty, so the reader
+  // has to read() them rather than splice() or tee() them elsewhere. The
+  // engine waits on wait_fd for the pipe to have room, or for timer_fd to
+  // look at it again when it's draining.
+  bool splice;
+  uint64_t spliced;
+  size_t in_pipe;
+  int wait_fd;
+  int timer_fd;
+
   char filename[];
 };
 
@@ -23,6 +44,11 @@ struct data {
 
 static bool init(void *data, size_t block_size) {
   GET(struct data, this, data);
+  if (!this->block_size)
+    this->block_size = block_size;
+  if (this->lo_watermark > this->block_size)
+    this->lo_watermark = this->block_size;
+
   int mode = (this->mode == R) ? O_RDONLY : O_WRONLY | O_CREAT;
   mode |= (O_NONBLOCK | O_LARGEFILE);
   CHECK(SYSCALL(this->fd = open(this->filename, mode, S_IWUSR|S_IRUSR)),
@@ -34,6 +60,18 @@ static bool init(void *data, size_t block_size) {
   CHECK(S_ISFIFO(stat.st_mode),
         fprintf(stderr, "%s is not a fifo\n", this->filename), return false);
 
+  if (this->mode == W && this->splice) {
+    CHECK(SYSCALL(this->wait_fd = epoll_create1(0)) &&
+          SYSCALL(this->timer_fd = timerfd_create(CLOCK_MONOTONIC,
+                                                  TFD_NONBLOCK)),
+          WITH_THIS("create splice wait fds"), return false);
+    struct epoll_event timer = { .events = EPOLLIN, .data.fd = this->timer_fd };
+    struct epoll_event pipe = { .events = EPOLLONESHOT, .data.fd = this->fd };
+    CHECK(SYSCALL(epoll_ctl(this->wait_fd, EPOLL_CTL_ADD, this->timer_fd,
+                            &timer)) &&
+          SYSCALL(epoll_ctl(this->wait_fd, EPOLL_CTL_ADD, this->fd, &pipe)),
+          WITH_THIS("watch pipe"), return false);
+  }
   return true;
 }
 
@@ -44,18 +82,49 @@ static const char *name(void *data) {
 
 static void destroy(void *data) {
   GET(struct data, this, data);
+  COND_CHECK(this->timer_fd, -1, SYSCALL(close(this->timer_fd)),
+             WITH_THIS("close timer"));
+  COND_CHECK(this->wait_fd, -1, SYSCALL(close(this->wait_fd)),
+             WITH_THIS("close epoll fd"));
   COND_CHECK(this->fd, -1, SYSCALL(close(this->fd)), WITH_THIS("call close"));
   free(data);
 }
 
+static bool get_info(void *data, struct stream_info *info) {
+  GET(struct data, this, data);
+  set_local_source(info, this->filename);
+  return true;
+}
+
+// A pipe can't put back together a stripe or a stream which starts in the
+// middle.
+static bool start(void *data, const struct stream_info *info) {
+  GET(struct data, this, data);
+  CHECK(is_whole_stream(info),
+        fprintf(stderr, "%s can only take a whole stream from its start\n",
+                this->filename),
+        return false);
+  return true;
+}
+
 static uint32_t get_epoll_event(void *data) {
   GET(struct data, this, data);
-  return (this->mode == R) ? EPOLLIN : EPOLLOUT;
+  return (this->mode == R || this->splice) ? EPOLLIN : EPOLLOUT;
 }
 
 static int get_fd(void *data) {
   GET(struct data, this, data);
-  return this->fd;
+  return this->splice ? this->wait_fd : this->fd;
+}
+
+static size_t get_lo_watermark(void *data) {
+  GET(struct data, this, data);
+  return this->lo_watermark;
+}
+
+static size_t get_block_size(void *data) {
+  GET(struct data, this, data);
+  return this->block_size;
 }
 
 static ssize_t produce(void *data, void *buf, size_t count, bool *eof) {
@@ -77,8 +146,7 @@ static ssize_t produce_signal(void *data, bool *eof) {
   return 0;
 }
 
-static ssize_t consume(void *data, void *buf, size_t count) {
-  GET(struct data, this, data);
+static ssize_t write_ring(struct data *this, const char *buf, size_t count) {
   ssize_t rv = write(this->fd, buf, count);
   if (would_block(rv))
     return 0;
@@ -87,43 +155,203 @@ static ssize_t consume(void *data, void *buf, size_t count) {
   return rv;
 }
 
+// Readers take data out of a pipe which isn't full without waking the
+// writer, so while it's draining it is looked at again after a while.
+static bool wait_for_pipe(struct data *this, bool full) {
+  if (full) {
+    struct epoll_event pipe = {
+      .events = EPOLLOUT | EPOLLONESHOT, .data.fd = this->fd
+    };
+    CHECK(SYSCALL(epoll_ctl(this->wait_fd, EPOLL_CTL_MOD, this->fd, &pipe)),
+          WITH_THIS("watch pipe"), return false);
+  } else {
+    struct itimerspec spec = {
+      .it_value = { 0, PIPE_DRAIN_POLL_US * 1000 }
+    };
+    CHECK(SYSCALL(timerfd_settime(this->timer_fd, 0, &spec, NULL)),
+          WITH_THIS("arm timer"), return false);
+  }
+  return true;
+}
+
+// What is offered starts where the reader is, the part of it beyond what's
+// in the pipe is new. Returns how much the reader took out of the pipe.
+static ssize_t splice_ring(struct data *this, char *buf, size_t count) {
+  bool full = false;
+  if (count > this->in_pipe) {
+    struct iovec iov = { buf + this->in_pipe, count - this->in_pipe };
+    ssize_t rv = vmsplice(this->fd, &iov, 1, SPLICE_F_NONBLOCK);
+    if (rv == -1 && !this->spliced &&
+        (errno == EINVAL || errno == ENOSYS || errno == EPERM)) {
+      this->splice = false;
+      return write_ring(this, buf, count);
+    }
+    if (would_block(rv))
+      rv = 0;
+    CHECK(SYSCALL(rv), WITH_THIS("vmsplice"), return -1);
+    full = ((size_t)rv != iov.iov_len);
+    this->spliced += rv;
+    this->in_pipe += rv;
+  }
+
+  int queued;
+  CHECK(SYSCALL(ioctl(this->fd, FIONREAD, &queued)),
+        WITH_THIS("get size of pipe"), return -1);
+  assert((size_t)queued <= this->in_pipe);
+  ssize_t taken = this->in_pipe - queued;
+  this->in_pipe = queued;
+  if (!taken && !wait_for_pipe(this, full))
+    return -1;
+  return taken;
+}
+
+static ssize_t consume(void *data, void *buf, size_t count) {
+  GET(struct data, this, data);
+  return this->splice ?
+      splice_ring(this, buf, count) : write_ring(this, buf, count);
+}
+
+static ssize_t consume_signal(void *data) {
+  GET(struct data, this, data);
+  if (!this->splice)
+    return 0;
+
+  struct epoll_event events[2];
+  uint64_t expirations;
+  CHECK(SYSCALL(epoll_wait(this->wait_fd, events, arraysize(events), 0)),
+        WITH_THIS("wait for pipe"), return -1);
+  ssize_t rv = read(this->timer_fd, &expirations, sizeof(expirations));
+  CHECK(rv != -1 || would_block(rv), WITH_THIS("read timer"), return -1);
+  return 0;
+}
+
 static const struct producer_ops input_ops = {
   .init             = init,
+  .setup            = setup_nothing,
   .name             = name,
   .destroy          = destroy,
+  .get_info         = get_info,
 
   .get_epoll_event  = get_epoll_event,
   .get_fd           = get_fd,
+  .get_lo_watermark = get_lo_watermark,
+  .get_block_size   = get_block_size,
+  .get_read_ahead   = get_single_read_ahead,
   .produce          = produce,
   .signal           = produce_signal,
+  .poll             = poll_nothing,
+
+  .get_node         = get_no_node,
+  .get_counters     = get_no_counters,
+  .put_reports      = put_no_reports,
+  .can_rewind       = cannot_rewind,
+  .rewind           = rewind_nothing,
+  .set_private_ring = ignore_private_ring,
+  .fetch            = fetch_nothing,
+  .take_fetched     = take_nothing_fetched,
+  .get_fetched_fd   = get_no_fetched_fd,
 };
 
 static const struct consumer_ops output_ops = {
   .init             = init,
+  .setup            = setup_nothing,
   .name             = name,
   .destroy          = destroy,
+  .start            = start,
 
   .get_epoll_event  = get_epoll_event,
   .get_fd           = get_fd,
-  .get_lo_watermark = get_zero_lo_watermark,
+  .get_lo_watermark = get_lo_watermark,
+  .get_block_size   = get_block_size,
+  .get_priority     = get_no_priority,
   .consume          = consume,
-  .signal           = zero_consume_signal,
+  .signal           = consume_signal,
+  .poll             = poll_nothing,
+  .finish           = finish_nothing,
+  .get_spill        = get_no_spill,
+  .map_ring         = map_no_ring,
+
+  .get_node         = get_no_node,
+  .get_counters     = get_no_counters,
+  .get_reports      = get_no_reports,
+
+  .get_listen_fd    = get_no_listen_fd,
+  .accept_joiner    = accept_no_joiner,
+  .get_missed       = get_no_missed,
+  .get_wanted_fd    = get_no_wanted_fd,
+  .get_wanted       = get_nothing_wanted,
+  .put_fetched      = ignore_fetched,
 };
 
-static struct data *construct(const char *filename, int mode) {
-  assert(filename);
-  struct data *data = malloc(sizeof(struct data) + strlen(filename) + 1);
+static bool parse_options(struct data *this, char *options) {
+  enum { BLOCK, LO, SPLICE };
+  char *const tokens[] = {
+    [BLOCK] = "block",
+    [LO] = "lo",
+    [SPLICE] = "splice",
+    NULL
+  };
+
+  while (*options) {
+    char *value = NULL;
+    switch (getsubopt(&options, tokens, &value)) {
+    case BLOCK:
+      CHECK(value && parse_size(value, &this->block_size),
+            fprintf(stderr, "bad block option for %s\n", this->filename),
+            return false);
+      break;
+    case LO:
+      CHECK(value && parse_size(value, &this->lo_watermark),
+            fprintf(stderr, "bad lo option for %s\n", this->filename),
+            return false);
+      break;
+    case SPLICE:
+      CHECK(this->mode == W && !value,
+            fprintf(stderr, "bad splice option for %s\n", this->filename),
+            return false);
+      this->splice = true;
+      break;
+    default:
+      fprintf(stderr, "unknown option %s for %s\n", value, this->filename);
+      return false;
+    }
+  }
+  return true;
+}
+
+// The spec is a fifo name optionally followed by comma-separated options.
+static struct data *construct(const char *spec, int mode) {
+  assert(spec);
+  struct data *data = malloc(sizeof(struct data) + strlen(spec) + 1);
 
   if (data) {
     data->fd = -1;
+    data->block_size = 0;
+    data->lo_watermark = 0;
     data->mode = mode;
-    strcpy(data->filename, filename);
+    data->splice = false;
+    data->spliced = 0;
+    data->in_pipe = 0;
+    data->wait_fd = -1;
+    data->timer_fd = -1;
+    strcpy(data->filename, spec);
+
+    char *options = strchr(data->filename, ',');
+    if (options) {
+      *options++ = 0;
+      if (!parse_options(data, options))
+        goto cleanup;
+    }
   }
 
   return data;
+
+cleanup:
+  free(data);
+  return NULL;
 }
 
-struct producer get_pipe_reader(const char *filename) {
+struct producer get_pipe_reader(const char *filename, size_t read_ahead) {
   return (struct producer) {&input_ops, construct(filename, R)};
 }
 
@@ -5,6 +5,7 @@
 struct producer;
 struct consumer;
 
-extern struct producer get_pipe_reader(const char *filename);
+extern struct producer get_pipe_reader(const char *filename,
+                                       size_t read_ahead);
 extern struct consumer get_pipe_writer(const char *filename,
                                        size_t lo_watermark);
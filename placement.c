@@ -0,0 +1,164 @@
+#include "macro.h"
+#include "placement.h"
+
+#include <arpa/inet.h>
+#include <dirent.h>
+#include <errno.h>
+#include <ifaddrs.h>
+#include <limits.h>
+#include <linux/mempolicy.h>
+#include <netinet/in.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+// Both the command line and sysfs use lists like "0-3,8,10-11".
+bool parse_cpu_list(const char *list, cpu_set_t *cpus) {
+  CPU_ZERO(cpus);
+  const char *p = list;
+  do {
+    char *end = NULL;
+    errno = 0;
+    long first = strtol(p, &end, 10);
+    if (end == p || errno || first < 0 || first >= CPU_SETSIZE)
+      return false;
+    long last = first;
+    if (*end == '-') {
+      p = end + 1;
+      last = strtol(p, &end, 10);
+      if (end == p || errno || last < first || last >= CPU_SETSIZE)
+        return false;
+    }
+    for (long cpu = first; cpu <= last; ++cpu)
+      CPU_SET(cpu, cpus);
+    p = end;
+  } while (*p == ',' && *++p);
+
+  return (*p == 0 || *p == '\n') && CPU_COUNT(cpus) != 0;
+}
+
+bool parse_node(const char *str, int *node) {
+  if (strcmp(str, "auto") == 0) {
+    *node = NODE_AUTO;
+    return true;
+  }
+
+  char *end = NULL;
+  errno = 0;
+  long value = strtol(str, &end, 10);
+  if (*str == 0 || *end != 0 || errno || value < 0 || value >= MAX_NODES)
+    return false;
+  *node = value;
+  return true;
+}
+
+bool get_node_cpus(int node, cpu_set_t *cpus) {
+  char path[PATH_MAX];
+  snprintf(path, sizeof(path), "/sys/devices/system/node/node%d/cpulist",
+           node);
+
+  char list[4096] = "";
+  FILE *file = fopen(path, "r");
+  CHECK(file, PERROR1("can't find cpus of node, failed to open", path),
+        return false);
+  bool read = fgets(list, sizeof(list), file) != NULL;
+  fclose(file);
+
+  CHECK(read && parse_cpu_list(list, cpus),
+        fprintf(stderr, "can't parse cpus of node %d\n", node), return false);
+  return true;
+}
+
+static bool same_address(const struct sockaddr *a,
+                         const struct sockaddr_storage *b) {
+  if (!a || a->sa_family != b->ss_family)
+    return false;
+
+  switch (a->sa_family) {
+    case AF_INET:
+      return memcmp(&((const struct sockaddr_in *)a)->sin_addr,
+                    &((const struct sockaddr_in *)b)->sin_addr,
+                    sizeof(struct in_addr)) == 0;
+    case AF_INET6:
+      return memcmp(&((const struct sockaddr_in6 *)a)->sin6_addr,
+                    &((const struct sockaddr_in6 *)b)->sin6_addr,
+                    sizeof(struct in6_addr)) == 0;
+    default:
+      return false;
+  }
+}
+
+static int get_interface_node(const char *interface) {
+  char path[PATH_MAX];
+  snprintf(path, sizeof(path), "/sys/class/net/%s/device/numa_node",
+           interface);
+
+  // Virtual interfaces have no device, and single node systems report -1.
+  int node = NODE_UNKNOWN;
+  FILE *file = fopen(path, "r");
+  if (file) {
+    if (fscanf(file, "%d", &node) != 1)
+      node = NODE_UNKNOWN;
+    fclose(file);
+  }
+  return node < 0 ? NODE_UNKNOWN : node;
+}
+
+// The node of the NIC which the socket's local address belongs to.
+int get_socket_node(int sock) {
+  struct sockaddr_storage local;
+  socklen_t len = sizeof(local);
+  CHECK(SYSCALL(getsockname(sock, (struct sockaddr *)&local, &len)),
+        perror("getsockname() failed"), return NODE_UNKNOWN);
+
+  struct ifaddrs *interfaces = NULL;
+  CHECK(SYSCALL(getifaddrs(&interfaces)), perror("getifaddrs() failed"),
+        return NODE_UNKNOWN);
+
+  int node = NODE_UNKNOWN;
+  for (struct ifaddrs *i = interfaces; i; i = i->ifa_next) {
+    if (same_address(i->ifa_addr, &local)) {
+      node = get_interface_node(i->ifa_name);
+      break;
+    }
+  }
+
+  freeifaddrs(interfaces);
+  return node;
+}
+
+// Threads started by the endpoints inherit nothing from a later call to
+// sched_setaffinity(), so every thread of the process is pinned.
+bool pin_threads(const cpu_set_t *cpus) {
+  DIR *tasks = opendir("/proc/self/task");
+  CHECK(tasks, perror("failed to list threads"), return false);
+
+  bool rv = true;
+  for (struct dirent *task; (task = readdir(tasks));) {
+    pid_t tid = atoi(task->d_name);
+    if (tid <= 0)
+      continue;
+    CHECK(SYSCALL(sched_setaffinity(tid, sizeof(cpu_set_t), cpus)),
+          perror("failed to pin thread"), rv = false);
+  }
+
+  closedir(tasks);
+  return rv;
+}
+
+bool bind_to_node(void *addr, size_t size, int node) {
+  unsigned long mask[MAX_NODES / (8 * sizeof(unsigned long))] = {0};
+  const size_t bits = 8 * sizeof(unsigned long);
+  mask[node / bits] |= 1UL << (node % bits);
+
+  // Pages which are already there are moved as well.
+  CHECK(SYSCALL(syscall(SYS_mbind, addr, size, MPOL_BIND, mask,
+                        8 * sizeof(mask) + 1, MPOL_MF_MOVE)),
+        fprintf(stderr, "failed to place memory on node %d: %s\n",
+                node, strerror(errno)),
+        return false);
+  return true;
+}
@@ -0,0 +1,19 @@
+#pragma once
+
+#include <sched.h>
+#include <stdbool.h>
+#include <stddef.h>
+
+// Placement of the process on NUMA nodes and CPUs.
+#define NODE_UNKNOWN -1
+#define NODE_AUTO -2
+#define MAX_NODES 1024
+
+extern bool parse_cpu_list(const char *list, cpu_set_t *cpus);
+extern bool parse_node(const char *str, int *node);
+
+extern bool get_node_cpus(int node, cpu_set_t *cpus);
+extern int get_socket_node(int sock);
+
+extern bool pin_threads(const cpu_set_t *cpus);
+extern bool bind_to_node(void *addr, size_t size, int node);
@@ -0,0 +1,274 @@
+#include "macro.h"
+#include "report.h"
+#include "struct.h"
+#include "util.h"
+
+#include <assert.h>
+#include <endian.h>
+#include <limits.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+static const char *const VERDICTS[] = {
+  [BALANCED] = "balanced",
+  [STARVED] = "starved",
+  [HELD_LOCAL] = "held_local",
+  [HELD_FORWARD] = "held_forward",
+  [CPU_BOUND] = "cpu_bound",
+};
+
+static char *put32(char *buf, uint32_t value) {
+  value = htobe32(value);
+  memcpy(buf, &value, 4);
+  return buf + 4;
+}
+
+static char *put64(char *buf, uint64_t value) {
+  value = htobe64(value);
+  memcpy(buf, &value, 8);
+  return buf + 8;
+}
+
+static const char *get32(const char *buf, uint32_t *value) {
+  memcpy(value, buf, 4);
+  *value = be32toh(*value);
+  return buf + 4;
+}
+
+static const char *get64(const char *buf, uint64_t *value) {
+  memcpy(value, buf, 8);
+  *value = be64toh(*value);
+  return buf + 8;
+}
+
+void encode_report(const struct report *report, char *buf) {
+  buf = put32(buf, report->hops);
+  buf = put32(buf, report->verdict);
+  buf = put64(buf, report->rate);
+  buf = put32(buf, report->fill);
+  buf = put32(buf, report->full);
+  buf = put32(buf, report->empty);
+  buf = put32(buf, report->busy);
+  memcpy(buf, report->host, REPORT_NAME_CHARS + 1);
+  memcpy(buf + REPORT_NAME_CHARS + 1, report->endpoint, REPORT_NAME_CHARS + 1);
+}
+
+void decode_report(const char *buf, struct report *report) {
+  buf = get32(buf, &report->hops);
+  buf = get32(buf, &report->verdict);
+  buf = get64(buf, &report->rate);
+  buf = get32(buf, &report->fill);
+  buf = get32(buf, &report->full);
+  buf = get32(buf, &report->empty);
+  buf = get32(buf, &report->busy);
+  memcpy(report->host, buf, REPORT_NAME_CHARS + 1);
+  memcpy(report->endpoint, buf + REPORT_NAME_CHARS + 1, REPORT_NAME_CHARS + 1);
+  report->host[REPORT_NAME_CHARS] = 0;
+  report->endpoint[REPORT_NAME_CHARS] = 0;
+  if (report->verdict >= arraysize(VERDICTS))
+    report->verdict = BALANCED;
+}
+
+static uint64_t get_cpu_time_ns(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_THREAD_CPUTIME_ID, &ts);
+  return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+void start_meter(struct meter *meter, uint64_t offset) {
+  memset(meter, 0, sizeof(*meter));
+  meter->begin_ns = get_time_ns();
+  meter->cpu_begin_ns = get_cpu_time_ns();
+  meter->offset = offset;
+}
+
+void meter_wait(struct meter *meter, uint64_t wait_ns, bool empty) {
+  if (meter->full) {
+    for (size_t i = 0; i != MAX_CONSUMERS; ++i)
+      if (meter->holding[i])
+        meter->holding_ns[i] += wait_ns;
+  } else if (empty) {
+    meter->empty_ns += wait_ns;
+  }
+}
+
+// How long the engine can wait before the next report is due, in ms.
+int get_report_timeout(const struct meter *meter) {
+  uint64_t due = meter->begin_ns + REPORT_INTERVAL_MS * 1000000ULL;
+  uint64_t now = get_time_ns();
+  return (now >= due) ? 0 : (due - now) / 1000000 + 1;
+}
+
+static uint32_t permille(uint64_t part, uint64_t whole) {
+  return (!whole || part >= whole) ? (whole ? 1000 : 0) : part * 1000 / whole;
+}
+
+// A consumer holds the node up while the buffer is full because of it, and
+// while the engine is in its calls. The producer does so while the buffer is
+// empty, and while the engine is in its calls.
+static void judge(struct state *state, const struct meter *meter,
+                  uint64_t interval, const bool *forwards,
+                  struct report *report) {
+  size_t holder = 0;
+  uint64_t held_ns = 0;
+  for (size_t i = 0; i != state->num_consumers; ++i) {
+    uint64_t ns = meter->holding_ns[i] + meter->consumer_ns[i];
+    if (ns > held_ns) {
+      holder = i;
+      held_ns = ns;
+    }
+  }
+  report->full = permille(held_ns, interval);
+  report->empty = permille(meter->empty_ns + meter->producer_ns, interval);
+
+  const char *endpoint = "";
+  report->verdict = BALANCED;
+  if (report->busy >= 900) {
+    report->verdict = CPU_BOUND;
+  } else if (report->full >= report->empty && report->full >= 250) {
+    report->verdict = forwards[holder] ? HELD_FORWARD : HELD_LOCAL;
+    endpoint = CALL0(state->consumers[holder], name);
+  } else if (report->empty >= 250) {
+    report->verdict = STARVED;
+    endpoint = CALL0(state->producer, name);
+  }
+  snprintf(report->endpoint, sizeof(report->endpoint), "%s", endpoint);
+}
+
+// The first node from the source which isn't just passing on the pressure
+// from downstream holds the chain up.
+static const struct report *find_bottleneck(const struct report *reports,
+                                            size_t count,
+                                            const char **resource) {
+  for (size_t k = 0; k != count; ++k) {
+    switch (reports[k].verdict) {
+    case CPU_BOUND:
+      *resource = "cpu";
+      return &reports[k];
+    case HELD_LOCAL:
+      *resource = "disk";
+      return &reports[k];
+    case HELD_FORWARD:
+      if (k + 1 == count || reports[k+1].verdict == STARVED) {
+        *resource = "network";
+        return &reports[k];
+      }
+      break;
+    case STARVED:
+      *resource = (k == 0) ? "disk" : "network";
+      return &reports[k];
+    default:
+      break;
+    }
+  }
+  return NULL;
+}
+
+static bool dump_chain(const char *filename, struct report *reports,
+                       size_t count) {
+  // Reports come in the order they were relayed, every hop's in a bunch.
+  for (size_t i = 1; i < count; ++i)
+    for (size_t j = i; j != 0 && reports[j-1].hops > reports[j].hops; --j) {
+      struct report tmp = reports[j];
+      reports[j] = reports[j-1];
+      reports[j-1] = tmp;
+    }
+
+  const char *resource = NULL;
+  const struct report *bottleneck = find_bottleneck(reports, count, &resource);
+
+  if (strcmp(filename, "-") == 0) {
+    if (bottleneck)
+      fprintf(stderr, "chain of %zu: %s bottleneck at hop %"PRIu32
+              " on %s, waiting for %s\n", count, resource, bottleneck->hops,
+              bottleneck->host, bottleneck->endpoint);
+    else
+      fprintf(stderr, "chain of %zu: no bottleneck\n", count);
+    return true;
+  }
+
+  // Readers never see a half-written view.
+  char tmp_filename[PATH_MAX];
+  CHECK(snprintf(tmp_filename, sizeof(tmp_filename), "%s.tmp", filename) <
+            (int)sizeof(tmp_filename),
+        ERROR("too long chain view file name"), return false);
+
+  bool rv = true;
+  FILE *output = NULL;
+  CHECK(output = fopen(tmp_filename, "w"),
+        PERROR1("fopen() failed for", tmp_filename),
+        GOTO_WITH(cleanup, rv, false));
+
+#define PRINT(...) \
+  CHECK(fprintf(output, __VA_ARGS__) > 0, \
+        PERROR1("failed to dump chain view to", tmp_filename), \
+        GOTO_WITH(cleanup, rv, false))
+
+  PRINT("{\"bottleneck\": ");
+  if (bottleneck)
+    PRINT("{\"hop\": %"PRIu32", \"host\": \"%s\", \"resource\": \"%s\", "
+          "\"endpoint\": \"%s\"}", bottleneck->hops, bottleneck->host,
+          resource, bottleneck->endpoint);
+  else
+    PRINT("null");
+
+  PRINT(", \"nodes\": [");
+  for (size_t i = 0; i != count; ++i)
+    PRINT("%s{\"hops\": %"PRIu32", \"host\": \"%s\", \"verdict\": \"%s\", "
+          "\"endpoint\": \"%s\", \"rate\": %"PRIu64", \"fill\": %"PRIu32", "
+          "\"full\": %"PRIu32", \"empty\": %"PRIu32", \"busy\": %"PRIu32"}",
+          i ? ", " : "", reports[i].hops, reports[i].host,
+          VERDICTS[reports[i].verdict], reports[i].endpoint, reports[i].rate,
+          reports[i].fill, reports[i].full, reports[i].empty,
+          reports[i].busy);
+  PRINT("]}\n");
+
+#undef PRINT
+
+cleanup:
+  if (output)
+    CHECK(fclose(output) == 0, PERROR1("fclose() failed for", tmp_filename),
+          rv = false);
+  if (rv)
+    CHECK(SYSCALL(rename(tmp_filename, filename)),
+          PERROR1("failed to replace", filename), rv = false);
+  return rv;
+}
+
+bool send_reports(struct state *state, struct meter *meter,
+                  uint64_t offset, uint64_t fill, size_t buffer_size) {
+  struct report reports[MAX_REPORTS];
+  bool forwards[MAX_CONSUMERS];
+  size_t count = 1;
+
+  for (size_t i = 0; i != state->num_consumers; ++i) {
+    size_t received = MAX_REPORTS - count;
+    forwards[i] = CALL(state->consumers[i], get_reports, reports + count,
+                       &received);
+    for (size_t j = 0; j != received; ++j)
+      ++reports[count + j].hops;
+    count += received;
+  }
+
+  uint64_t interval = get_time_ns() - meter->begin_ns;
+  struct report *own = &reports[0];
+  memset(own, 0, sizeof(*own));
+  gethostname(own->host, REPORT_NAME_CHARS);
+  uint64_t interval_ms = interval / 1000000;
+  own->rate = (offset - meter->offset) * 1000 / (interval_ms ? interval_ms : 1);
+  own->fill = permille(fill, buffer_size);
+  uint64_t cpu_ns = get_cpu_time_ns() - meter->cpu_begin_ns;
+  own->busy = permille(cpu_ns > meter->spin_ns ? cpu_ns - meter->spin_ns : 0,
+                       interval);
+  judge(state, meter, interval, forwards, own);
+
+  start_meter(meter, offset);
+
+  // Only the source of the stream has nowhere to relay them to.
+  if (!CALL(state->producer, put_reports, reports, count) &&
+      state->chain_filename)
+    return dump_chain(state->chain_filename, reports, count);
+  return true;
+}
@@ -0,0 +1,71 @@
+#pragma once
+
+#include "defaults.h"
+
+#include <inttypes.h>
+#include <stdbool.h>
+#include <stddef.h>
+
+#define REPORT_NAME_CHARS 63
+#define REPORT_SIZE (4 + 4 + 8 + 4 * 4 + 2 * (REPORT_NAME_CHARS + 1))
+
+// What held the node up during the interval.
+enum verdict {
+  BALANCED,
+  // The producer didn't keep up with the consumers.
+  STARVED,
+  // A consumer writing locally didn't make room for the producer in time.
+  HELD_LOCAL,
+  // Same for a consumer forwarding the stream to the next node.
+  HELD_FORWARD,
+  // The engine was hardly ever waiting for the endpoints.
+  CPU_BOUND,
+};
+
+// One node's view of the last interval. Every node relays its report and
+// the ones from downstream to the previous node, and the source of the
+// stream puts them together into a view of the whole chain.
+struct report {
+  // Distance from the node the report was received by.
+  uint32_t hops;
+  uint32_t verdict;
+  uint64_t rate;
+  // Permille of the buffer in use, and of the interval spent held up by the
+  // slowest consumer, held up by the producer, and on CPU.
+  uint32_t fill;
+  uint32_t full;
+  uint32_t empty;
+  uint32_t busy;
+  char host[REPORT_NAME_CHARS+1];
+  // The endpoint the node was waiting for.
+  char endpoint[REPORT_NAME_CHARS+1];
+};
+
+// Where the time of the engine went to: waiting with the buffer full or
+// empty, and in calls to the endpoints which may block despite all.
+struct meter {
+  uint64_t begin_ns;
+  uint64_t cpu_begin_ns;
+  uint64_t offset;
+  uint64_t empty_ns;
+  uint64_t holding_ns[MAX_CONSUMERS];
+  uint64_t producer_ns;
+  uint64_t consumer_ns[MAX_CONSUMERS];
+  // Spinning burns the CPU without the node being CPU bound.
+  uint64_t spin_ns;
+
+  // What the engine is waiting for at the moment.
+  bool full;
+  bool holding[MAX_CONSUMERS];
+};
+
+void encode_report(const struct report *report, char *buf);
+void decode_report(const char *buf, struct report *report);
+
+void start_meter(struct meter *meter, uint64_t offset);
+void meter_wait(struct meter *meter, uint64_t wait_ns, bool empty);
+int get_report_timeout(const struct meter *meter);
+
+struct state;
+bool send_reports(struct state *state, struct meter *meter,
+                  uint64_t offset, uint64_t fill, size_t buffer_size);
@@ -0,0 +1,720 @@
+#include "defaults.h"
+#include "macro.h"
+#include "secure.h"
+#include "util.h"
+
+#include <assert.h>
+#include <endian.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <inttypes.h>
+#include <openssl/evp.h>
+#include <openssl/hmac.h>
+#include <poll.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/random.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+#define KEY_SIZE 32
+#define IV_SIZE 12
+#define TAG_SIZE 16
+#define MAX_KEY_FILE_SIZE 4096
+#define MIN_KEY_FILE_SIZE 16
+
+// Each record is its plaintext length, the ciphertext and the GCM tag. The
+// nonce is the record's sequence number, which both sides count, and the
+// key is derived anew for every connection from the pre-shared key and a
+// random salt, so nonces are never reused. An empty record terminates the
+// stream, so truncation is detected even if the size isn't known.
+#define RECORD_OVERHEAD (4 + TAG_SIZE)
+
+// The header, which comes before the records and in the clear, is
+// authenticated by an HMAC of its digest with a key of its own, derived
+// like the session key.
+#define HEADER_LABEL "ndd header"
+
+struct job {
+  bool encrypt;
+  const unsigned char *in;
+  unsigned char *out;
+  size_t len;
+  unsigned char *tag;
+  uint64_t seq;
+  bool ok;
+};
+
+struct pool {
+  pthread_mutex_t lock;
+  pthread_cond_t cond;
+  pthread_t threads[MAX_CRYPTO_WORKERS];
+  size_t num_threads;
+
+  struct job *jobs;
+  size_t num_jobs;
+  size_t next;
+  size_t remaining;
+  bool stop;
+
+  int efd;
+  const unsigned char *key;
+};
+
+struct slot {
+  unsigned char *data;
+  size_t size;
+  size_t sent;
+};
+
+struct channel {
+  bool sender;
+  unsigned char master[KEY_SIZE];
+  unsigned char key[KEY_SIZE];
+  unsigned char header_key[KEY_SIZE];
+  unsigned char salt[SALT_SIZE];
+  EVP_MD_CTX *header;
+
+  int sock;
+  int epoll_fd;
+  uint32_t interest;
+
+  struct pool pool;
+  struct job *jobs;
+  size_t max_jobs;
+  bool in_flight;
+  uint64_t seq;
+  size_t block_size;
+
+  // Sender: ciphertext is double-buffered, so that one block is sent while
+  // the next one is being encrypted. A queued header goes before it.
+  struct slot preamble;
+  struct slot slots[2];
+  size_t head;
+  size_t num_full;
+  size_t in_flight_bytes;
+
+  // Receiver: records are decrypted straight into the ring, except for the
+  // ones which don't fit into the space the engine gave, which go to pbuf.
+  unsigned char *rbuf;
+  size_t rcap;
+  size_t rlen;
+  size_t rpos;
+  unsigned char *pbuf;
+  size_t pstart;
+  size_t plen;
+  bool into_pbuf;
+  size_t produced;
+  bool terminated;
+  bool eof;
+  bool done;
+};
+
+static bool run_job(EVP_CIPHER_CTX *ctx, const unsigned char *key,
+                    struct job *job) {
+  unsigned char iv[IV_SIZE] = {0};
+  uint64_t seq = htobe64(job->seq);
+  memcpy(iv + IV_SIZE - sizeof(seq), &seq, sizeof(seq));
+
+  unsigned char unused[TAG_SIZE];
+  int len;
+  if (job->encrypt)
+    return EVP_EncryptInit_ex(ctx, EVP_aes_256_gcm(), NULL, key, iv) == 1 &&
+        (job->len == 0 ||
+         EVP_EncryptUpdate(ctx, job->out, &len, job->in, job->len) == 1) &&
+        EVP_EncryptFinal_ex(ctx, unused, &len) == 1 &&
+        EVP_CIPHER_CTX_ctrl(ctx, EVP_CTRL_GCM_GET_TAG,
+                            TAG_SIZE, job->tag) == 1;
+  else
+    return EVP_DecryptInit_ex(ctx, EVP_aes_256_gcm(), NULL, key, iv) == 1 &&
+        (job->len == 0 ||
+         EVP_DecryptUpdate(ctx, job->out, &len, job->in, job->len) == 1) &&
+        EVP_CIPHER_CTX_ctrl(ctx, EVP_CTRL_GCM_SET_TAG,
+                            TAG_SIZE, job->tag) == 1 &&
+        EVP_DecryptFinal_ex(ctx, unused, &len) == 1;
+}
+
+static void *work(void *arg) {
+  struct pool *pool = arg;
+  EVP_CIPHER_CTX *ctx = EVP_CIPHER_CTX_new();
+
+  pthread_mutex_lock(&pool->lock);
+  for (;;) {
+    while (!pool->stop && pool->next == pool->num_jobs)
+      pthread_cond_wait(&pool->cond, &pool->lock);
+    if (pool->stop)
+      break;
+
+    struct job *job = &pool->jobs[pool->next++];
+    pthread_mutex_unlock(&pool->lock);
+    job->ok = ctx && run_job(ctx, pool->key, job);
+    pthread_mutex_lock(&pool->lock);
+
+    if (--pool->remaining == 0) {
+      const uint64_t one = 1;
+      CHECK(write(pool->efd, &one, sizeof(one)) == sizeof(one),
+            perror("failed to notify about finished records"), ;);
+    }
+  }
+  pthread_mutex_unlock(&pool->lock);
+
+  EVP_CIPHER_CTX_free(ctx);
+  return NULL;
+}
+
+static bool start_pool(struct pool *pool, const unsigned char *key,
+                       size_t workers) {
+  pool->key = key;
+  CHECK(SYSCALL(pool->efd = eventfd(0, EFD_NONBLOCK)),
+        perror("failed to initialize eventfd for crypto workers"),
+        return false);
+  for (; pool->num_threads != workers; ++pool->num_threads) {
+    int rv = pthread_create(&pool->threads[pool->num_threads], NULL,
+                            work, pool);
+    errno = rv;
+    CHECK(rv == 0, perror("failed to start crypto worker"), return false);
+  }
+  return true;
+}
+
+static void stop_pool(struct pool *pool) {
+  pthread_mutex_lock(&pool->lock);
+  pool->stop = true;
+  pthread_cond_broadcast(&pool->cond);
+  pthread_mutex_unlock(&pool->lock);
+
+  for (size_t i = 0; i != pool->num_threads; ++i)
+    pthread_join(pool->threads[i], NULL);
+  pool->num_threads = 0;
+
+  COND_CHECK(pool->efd, -1, SYSCALL(close(pool->efd)),
+             perror("failed to close eventfd for crypto workers"));
+}
+
+static void submit_jobs(struct pool *pool, struct job *jobs, size_t num) {
+  pthread_mutex_lock(&pool->lock);
+  assert(pool->remaining == 0);
+  pool->jobs = jobs;
+  pool->num_jobs = num;
+  pool->next = 0;
+  pool->remaining = num;
+  pthread_cond_broadcast(&pool->cond);
+  pthread_mutex_unlock(&pool->lock);
+}
+
+// Returns 1 when all submitted jobs are done and succeeded, 0 when they are
+// still running and -1 on failure.
+static int collect_jobs(struct pool *pool) {
+  uint64_t unused;
+  ssize_t rv = read(pool->efd, &unused, sizeof(unused));
+  if (would_block(rv))
+    return 0;
+  CHECK(rv == sizeof(unused),
+        perror("failed to read eventfd for crypto workers"), return -1);
+
+  pthread_mutex_lock(&pool->lock);
+  bool ok = true;
+  for (size_t i = 0; i != pool->num_jobs; ++i)
+    ok = ok && pool->jobs[i].ok;
+  pthread_mutex_unlock(&pool->lock);
+
+  CHECK(ok, ERROR("failed to encrypt or authenticate a record"), return -1);
+  return 1;
+}
+
+static bool digest(const unsigned char *data, size_t size, unsigned char *md) {
+  unsigned int md_size;
+  CHECK(EVP_Digest(data, size, md, &md_size, EVP_sha256(), NULL) == 1 &&
+        md_size == KEY_SIZE,
+        ERROR("failed to derive key"), return false);
+  return true;
+}
+
+static bool read_key(struct channel *this, const char *key_file) {
+  unsigned char contents[MAX_KEY_FILE_SIZE];
+  ssize_t size = -1;
+  int fd = -1;
+  CHECK(SYSCALL(fd = open(key_file, O_RDONLY)),
+        PERROR1("failed to open key file", key_file), return false);
+  size = read(fd, contents, sizeof(contents));
+  close(fd);
+
+  CHECK(SYSCALL(size), PERROR1("failed to read key file", key_file),
+        return false);
+  CHECK(size >= MIN_KEY_FILE_SIZE,
+        fprintf(stderr, "key file %s should be at least %d bytes long\n",
+                key_file, MIN_KEY_FILE_SIZE),
+        return false);
+  bool rv = digest(contents, size, this->master);
+  memset(contents, 0, sizeof(contents));
+  return rv;
+}
+
+static bool derive_session_key(struct channel *this) {
+  unsigned char material[KEY_SIZE + SALT_SIZE + sizeof(HEADER_LABEL) - 1];
+  memcpy(material, this->master, KEY_SIZE);
+  memcpy(material + KEY_SIZE, this->salt, SALT_SIZE);
+  memcpy(material + KEY_SIZE + SALT_SIZE, HEADER_LABEL,
+         sizeof(HEADER_LABEL) - 1);
+  bool rv = digest(material, KEY_SIZE + SALT_SIZE, this->key) &&
+      digest(material, sizeof(material), this->header_key);
+  memset(material, 0, sizeof(material));
+  return rv;
+}
+
+static size_t records_per_block(size_t block_size) {
+  return (block_size + CRYPTO_RECORD_SIZE - 1) / CRYPTO_RECORD_SIZE;
+}
+
+struct channel *create_channel(const char *key_file, size_t workers,
+                               size_t block_size, bool sender) {
+  struct channel *this = calloc(1, sizeof(struct channel));
+  CHECK(this, ERROR("can't allocate memory for channel"), return NULL);
+
+  this->sender = sender;
+  this->sock = -1;
+  this->epoll_fd = -1;
+  this->pool.efd = -1;
+  this->block_size = block_size;
+  pthread_mutex_init(&this->pool.lock, NULL);
+  pthread_cond_init(&this->pool.cond, NULL);
+
+#define FAIL_IF_NOT(cond, alert) \
+  CHECK(cond, alert, goto cleanup)
+
+  FAIL_IF_NOT(read_key(this, key_file), ;);
+  FAIL_IF_NOT((this->header = EVP_MD_CTX_new()) &&
+              EVP_DigestInit_ex(this->header, EVP_sha256(), NULL) == 1,
+              ERROR("failed to start digest of header"));
+
+  this->max_jobs = records_per_block(block_size) + 1;
+  FAIL_IF_NOT(this->jobs = calloc(this->max_jobs, sizeof(struct job)),
+              ERROR("can't allocate memory for crypto jobs"));
+
+  if (sender) {
+    size_t slot_size = block_size +
+        records_per_block(block_size) * RECORD_OVERHEAD;
+    for (size_t i = 0; i != arraysize(this->slots); ++i)
+      FAIL_IF_NOT(this->slots[i].data = malloc(slot_size),
+                  ERROR("can't allocate memory for ciphertext"));
+
+    FAIL_IF_NOT(getrandom(this->salt, SALT_SIZE, 0) == SALT_SIZE,
+                perror("failed to generate salt"));
+    FAIL_IF_NOT(derive_session_key(this), ;);
+  } else {
+    this->rcap = block_size + CRYPTO_RECORD_SIZE + RECORD_OVERHEAD;
+    FAIL_IF_NOT(this->rbuf = malloc(this->rcap),
+                ERROR("can't allocate memory for ciphertext"));
+    FAIL_IF_NOT(this->pbuf = malloc(CRYPTO_RECORD_SIZE),
+                ERROR("can't allocate memory for plaintext"));
+  }
+
+  FAIL_IF_NOT(SYSCALL(this->epoll_fd = epoll_create(1)),
+              perror("failed to create epoll fd for channel"));
+  FAIL_IF_NOT(start_pool(&this->pool, this->key, workers), ;);
+
+  struct epoll_event ev = { .events = EPOLLIN, .data.ptr = NULL };
+  FAIL_IF_NOT(SYSCALL(epoll_ctl(this->epoll_fd, EPOLL_CTL_ADD,
+                                this->pool.efd, &ev)),
+              perror("epoll_ctl() failed for crypto workers"));
+
+#undef FAIL_IF_NOT
+
+  return this;
+
+cleanup:
+  destroy_channel(this);
+  return NULL;
+}
+
+void destroy_channel(struct channel *this) {
+  if (!this)
+    return;
+
+  stop_pool(&this->pool);
+  pthread_cond_destroy(&this->pool.cond);
+  pthread_mutex_destroy(&this->pool.lock);
+
+  COND_CHECK(this->epoll_fd, -1, SYSCALL(close(this->epoll_fd)),
+             perror("failed to close epoll fd for channel"));
+
+  free(this->preamble.data);
+  for (size_t i = 0; i != arraysize(this->slots); ++i)
+    free(this->slots[i].data);
+  free(this->rbuf);
+  free(this->pbuf);
+  free(this->jobs);
+  EVP_MD_CTX_free(this->header);
+
+  memset(this->master, 0, sizeof(this->master));
+  memset(this->key, 0, sizeof(this->key));
+  memset(this->header_key, 0, sizeof(this->header_key));
+  free(this);
+}
+
+const unsigned char *get_channel_salt(struct channel *this) {
+  assert(this->sender);
+  return this->salt;
+}
+
+bool set_channel_salt(struct channel *this, const unsigned char *salt) {
+  assert(!this->sender);
+  memcpy(this->salt, salt, SALT_SIZE);
+  return derive_session_key(this);
+}
+
+bool add_channel_header(struct channel *this, const void *buf,
+                        size_t size) {
+  CHECK(EVP_DigestUpdate(this->header, buf, size) == 1,
+        ERROR("failed to digest header"), return false);
+  return true;
+}
+
+static bool sign_header(struct channel *this, unsigned char *mac) {
+  unsigned char md[EVP_MAX_MD_SIZE];
+  unsigned int md_size;
+  unsigned int mac_size;
+  CHECK(EVP_DigestFinal_ex(this->header, md, &md_size) == 1 &&
+        HMAC(EVP_sha256(), this->header_key, KEY_SIZE, md, md_size,
+             mac, &mac_size) && mac_size == HEADER_MAC_SIZE,
+        ERROR("failed to authenticate header"), return false);
+  return true;
+}
+
+bool get_channel_header_mac(struct channel *this, unsigned char *mac) {
+  assert(this->sender);
+  return sign_header(this, mac);
+}
+
+bool check_channel_header_mac(struct channel *this, const unsigned char *mac) {
+  assert(!this->sender);
+  unsigned char expected[HEADER_MAC_SIZE];
+  if (!sign_header(this, expected))
+    return false;
+  CHECK(CRYPTO_memcmp(expected, mac, HEADER_MAC_SIZE) == 0,
+        ERROR("failed to authenticate header, wrong key or tampered with"),
+        return false);
+  return true;
+}
+
+bool queue_channel_header(struct channel *this, const void *buf,
+                          size_t size) {
+  assert(this->sender);
+  struct slot *slot = &this->preamble;
+  unsigned char *data = realloc(slot->data, slot->size + size);
+  CHECK(data, ERROR("can't allocate memory for header"), return false);
+  memcpy(data + slot->size, buf, size);
+  slot->data = data;
+  slot->size += size;
+  return true;
+}
+
+bool attach_channel(struct channel *this, int sock) {
+  this->sock = sock;
+  return true;
+}
+
+int get_channel_fd(struct channel *this) {
+  return this->epoll_fd;
+}
+
+// The socket is only watched while there is something to do with it,
+// so that the engine is not woken up for nothing while workers run.
+static bool update_interest(struct channel *this) {
+  uint32_t want;
+  if (this->sender)
+    want = (this->num_full || this->preamble.sent != this->preamble.size) ?
+        EPOLLOUT : 0;
+  else if (this->in_flight)
+    want = (!this->eof && this->rlen != this->rcap) ? EPOLLIN : 0;
+  else
+    want = (this->eof || this->rlen != this->rcap) ? EPOLLIN : 0;
+
+  if (want == this->interest)
+    return true;
+
+  int op = !this->interest ? EPOLL_CTL_ADD :
+           !want ? EPOLL_CTL_DEL : EPOLL_CTL_MOD;
+  struct epoll_event ev = { .events = want, .data.ptr = this };
+  CHECK(SYSCALL(epoll_ctl(this->epoll_fd, op, this->sock, &ev)),
+        perror("epoll_ctl() failed for channel"), return false);
+  this->interest = want;
+  return true;
+}
+
+static bool flush(struct channel *this) {
+  struct slot *preamble = &this->preamble;
+  while (preamble->sent != preamble->size) {
+    ssize_t rv = send(this->sock, preamble->data + preamble->sent,
+                      preamble->size - preamble->sent, MSG_DONTWAIT);
+    if (would_block(rv))
+      return true;
+    CHECK(SYSCALL(rv), perror("send() failed for channel"), return false);
+    preamble->sent += rv;
+  }
+
+  while (this->num_full) {
+    struct slot *slot = &this->slots[this->head];
+    ssize_t rv = send(this->sock, slot->data + slot->sent,
+                      slot->size - slot->sent, MSG_DONTWAIT);
+    if (would_block(rv))
+      break;
+    CHECK(SYSCALL(rv), perror("send() failed for channel"), return false);
+
+    slot->sent += rv;
+    if (slot->sent == slot->size) {
+      this->head = (this->head + 1) % arraysize(this->slots);
+      --this->num_full;
+    }
+  }
+  return true;
+}
+
+static ssize_t collect_encrypted(struct channel *this) {
+  int rv = collect_jobs(&this->pool);
+  if (rv != 1)
+    return rv;
+
+  this->in_flight = false;
+  ++this->num_full;
+  if (!flush(this) || !update_interest(this))
+    return -1;
+  return this->in_flight_bytes;
+}
+
+// While a block is being encrypted, the engine keeps offering the same
+// part of the ring, which is reported as consumed once it's encrypted.
+ssize_t channel_send(struct channel *this, const void *buf, size_t count) {
+  assert(this->sender);
+  if (this->in_flight)
+    return collect_encrypted(this);
+
+  if (!flush(this))
+    return -1;
+  if (this->num_full == arraysize(this->slots))
+    return update_interest(this) ? 0 : -1;
+
+  if (count > this->block_size)
+    count = this->block_size;
+
+  struct slot *slot =
+      &this->slots[(this->head + this->num_full) % arraysize(this->slots)];
+  size_t pos = 0, num_jobs = 0;
+  for (size_t offset = 0; offset != count;) {
+    size_t len = count - offset;
+    if (len > CRYPTO_RECORD_SIZE)
+      len = CRYPTO_RECORD_SIZE;
+
+    uint32_t header = htobe32(len);
+    memcpy(slot->data + pos, &header, sizeof(header));
+    this->jobs[num_jobs++] = (struct job) {
+      .encrypt = true,
+      .in = (const unsigned char *)buf + offset,
+      .out = slot->data + pos + sizeof(header),
+      .len = len,
+      .tag = slot->data + pos + sizeof(header) + len,
+      .seq = this->seq++,
+      .ok = false
+    };
+    pos += len + RECORD_OVERHEAD;
+    offset += len;
+  }
+  slot->size = pos;
+  slot->sent = 0;
+
+  this->in_flight = true;
+  this->in_flight_bytes = count;
+  submit_jobs(&this->pool, this->jobs, num_jobs);
+  return update_interest(this) ? 0 : -1;
+}
+
+ssize_t channel_send_signal(struct channel *this) {
+  assert(this->sender);
+  if (this->in_flight)
+    return collect_encrypted(this);
+  return flush(this) && update_interest(this) ? 0 : -1;
+}
+
+static bool flush_all(struct channel *this) {
+  for (;;) {
+    if (!flush(this))
+      return false;
+    if (!this->num_full && this->preamble.sent == this->preamble.size)
+      return true;
+    struct pollfd pfd = { .fd = this->sock, .events = POLLOUT };
+    CHECK(SYSCALL(poll(&pfd, 1, -1)) || errno == EINTR,
+          perror("poll() failed for channel"), return false);
+  }
+}
+
+bool channel_flush(struct channel *this) {
+  assert(this->sender && !this->in_flight);
+  if (!flush_all(this))
+    return false;
+
+  struct slot *slot = &this->slots[this->head];
+  uint32_t header = 0;
+  memcpy(slot->data, &header, sizeof(header));
+  struct job terminator = {
+    .encrypt = true,
+    .in = NULL,
+    .out = NULL,
+    .len = 0,
+    .tag = slot->data + sizeof(header),
+    .seq = this->seq++,
+    .ok = false
+  };
+
+  EVP_CIPHER_CTX *ctx = EVP_CIPHER_CTX_new();
+  terminator.ok = ctx && run_job(ctx, this->key, &terminator);
+  EVP_CIPHER_CTX_free(ctx);
+  CHECK(terminator.ok, ERROR("failed to encrypt end of stream"),
+        return false);
+
+  slot->size = RECORD_OVERHEAD;
+  slot->sent = 0;
+  ++this->num_full;
+  return flush_all(this);
+}
+
+static bool receive_more(struct channel *this) {
+  while (!this->eof && this->rlen != this->rcap) {
+    ssize_t rv = recv(this->sock, this->rbuf + this->rlen,
+                      this->rcap - this->rlen, MSG_DONTWAIT);
+    if (would_block(rv))
+      break;
+    CHECK(SYSCALL(rv), perror("recv() failed for channel"), return false);
+    if (rv == 0)
+      this->eof = true;
+    this->rlen += rv;
+  }
+  return true;
+}
+
+static bool check_terminator(struct channel *this, unsigned char *tag) {
+  struct job job = {
+    .encrypt = false,
+    .in = NULL,
+    .out = NULL,
+    .len = 0,
+    .tag = tag,
+    .seq = this->seq++,
+    .ok = false
+  };
+  EVP_CIPHER_CTX *ctx = EVP_CIPHER_CTX_new();
+  job.ok = ctx && run_job(ctx, this->key, &job);
+  EVP_CIPHER_CTX_free(ctx);
+  CHECK(job.ok, ERROR("failed to authenticate end of stream"), return false);
+  this->terminated = true;
+  return true;
+}
+
+static ssize_t deliver(struct channel *this, void *buf, size_t count) {
+  size_t size = (this->plen < count) ? this->plen : count;
+  memcpy(buf, this->pbuf + this->pstart, size);
+  this->pstart += size;
+  this->plen -= size;
+  return size;
+}
+
+ssize_t channel_recv(struct channel *this, void *buf, size_t count,
+                     bool *eof) {
+  assert(!this->sender);
+  *eof = false;
+
+  if (this->in_flight) {
+    int rv = collect_jobs(&this->pool);
+    if (rv == -1)
+      return -1;
+    if (rv == 0)
+      return receive_more(this) && update_interest(this) ? 0 : -1;
+
+    this->in_flight = false;
+    if (!this->into_pbuf) {
+      size_t produced = this->produced;
+      this->produced = 0;
+      return produced;
+    }
+    this->into_pbuf = false;
+  }
+
+  if (this->plen)
+    return deliver(this, buf, count);
+
+  memmove(this->rbuf, this->rbuf + this->rpos, this->rlen - this->rpos);
+  this->rlen -= this->rpos;
+  this->rpos = 0;
+  if (!receive_more(this))
+    return -1;
+
+  size_t num_jobs = 0;
+  size_t placed = 0;
+  while (this->rlen - this->rpos >= RECORD_OVERHEAD &&
+         num_jobs != this->max_jobs) {
+    unsigned char *record = this->rbuf + this->rpos;
+    uint32_t len;
+    memcpy(&len, record, sizeof(len));
+    len = be32toh(len);
+    CHECK(len <= CRYPTO_RECORD_SIZE,
+          ERROR("received record is too long"), return -1);
+    if (this->rlen - this->rpos < len + RECORD_OVERHEAD)
+      break;
+    CHECK(!this->terminated,
+          ERROR("received data after end of stream"), return -1);
+
+    struct job job = {
+      .encrypt = false,
+      .in = record + sizeof(len),
+      .out = NULL,
+      .len = len,
+      .tag = record + sizeof(len) + len,
+      .seq = 0,
+      .ok = false
+    };
+    if (len == 0) {
+      if (!check_terminator(this, job.tag))
+        return -1;
+    } else if (placed + len <= count) {
+      job.out = (unsigned char *)buf + placed;
+      job.seq = this->seq++;
+      this->jobs[num_jobs++] = job;
+      placed += len;
+    } else if (num_jobs == 0) {
+      job.out = this->pbuf;
+      job.seq = this->seq++;
+      this->jobs[num_jobs++] = job;
+      this->into_pbuf = true;
+      this->pstart = 0;
+      this->plen = len;
+    } else {
+      break;
+    }
+
+    this->rpos += len + RECORD_OVERHEAD;
+    if (this->into_pbuf)
+      break;
+  }
+
+  if (num_jobs) {
+    this->in_flight = true;
+    this->produced = placed;
+    submit_jobs(&this->pool, this->jobs, num_jobs);
+  } else if (this->eof) {
+    CHECK(this->rpos == this->rlen,
+          ERROR("connection closed in the middle of a record"), return -1);
+    CHECK(this->terminated,
+          ERROR("connection closed before end of stream"), return -1);
+    *eof = this->done = true;
+  }
+
+  return update_interest(this) ? 0 : -1;
+}
+
+ssize_t channel_recv_signal(struct channel *this, bool *eof) {
+  assert(!this->sender);
+  *eof = this->done;
+  return 0;
+}
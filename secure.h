@@ -0,0 +1,44 @@
+#pragma once
+
+#include <stdbool.h>
+#include <stdlib.h>
+#include <sys/types.h>
+
+#define SALT_SIZE 16
+#define HEADER_MAC_SIZE 32
+
+// Authenticated encryption of the stream on a connected socket. Data is sent
+// as a sequence of AES-GCM records which are encrypted and decrypted on a
+// pool of worker threads.
+struct channel;
+
+extern struct channel *create_channel(const char *key_file, size_t workers,
+                                      size_t block_size, bool sender);
+extern void destroy_channel(struct channel *channel);
+
+extern const unsigned char *get_channel_salt(struct channel *channel);
+extern bool set_channel_salt(struct channel *channel,
+                             const unsigned char *salt);
+// Whatever comes before the records is fed to both sides' channels as it's
+// sent or received. The sender then sends its MAC, which the receiver checks.
+extern bool add_channel_header(struct channel *channel, const void *buf,
+                               size_t size);
+extern bool get_channel_header_mac(struct channel *channel,
+                                   unsigned char *mac);
+extern bool check_channel_header_mac(struct channel *channel,
+                                     const unsigned char *mac);
+// A sender's header may also be queued, to be sent before the records
+// as the socket takes it. It's not fed to the channel.
+extern bool queue_channel_header(struct channel *channel, const void *buf,
+                                 size_t size);
+extern bool attach_channel(struct channel *channel, int sock);
+extern int get_channel_fd(struct channel *channel);
+
+extern ssize_t channel_send(struct channel *channel,
+                            const void *buf, size_t count);
+extern ssize_t channel_send_signal(struct channel *channel);
+extern bool channel_flush(struct channel *channel);
+
+extern ssize_t channel_recv(struct channel *channel,
+                            void *buf, size_t count, bool *eof);
+extern ssize_t channel_recv_signal(struct channel *channel, bool *eof);
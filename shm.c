@@ -0,0 +1,456 @@
+#include "macro.h"
+#include "shm.h"
+#include "stats.h"
+#include "struct.h"
+#include "util.h"
+
+#include <assert.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <linux/futex.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/epoll.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <sys/types.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+static_assert(sizeof(struct shm_header) <= SHM_HEADER_SIZE,
+              "shm header doesn't fit");
+
+#define LOAD(ptr) __atomic_load_n(ptr, __ATOMIC_SEQ_CST)
+#define STORE(ptr, value) __atomic_store_n(ptr, value, __ATOMIC_SEQ_CST)
+
+// What the epoll fd of the writer reports for the bell, the other events
+// are of readers' pidfds, by their slots.
+#define BELL SHM_MAX_READERS
+
+struct data {
+  // Readers ring the bell when the writer waits for them. The bell and a
+  // pidfd of every active reader are watched with epoll_fd, so that readers
+  // which die are let go of.
+  int bell;
+  int epoll_fd;
+  int pidfds[SHM_MAX_READERS];
+  struct shm_header *header;
+  char *ring;
+  size_t ring_size;
+
+  // The stream is published up to head, and the readers are done with it up
+  // to tail, which is also the offset of the consumer in the engine.
+  uint64_t head;
+  uint64_t tail;
+  // The stream is held until this many readers have joined, none by
+  // default.
+  size_t readers;
+  size_t joined;
+  uint64_t copied_bytes;
+  uint64_t lost_readers;
+
+  struct stream_info info;
+  size_t block_size;
+  size_t lo_watermark;
+  char name[];
+};
+
+#define WITH_THIS(act) PERROR1("failed to " act " for", this->name)
+
+static bool init(void *data, size_t block_size) {
+  GET(struct data, this, data);
+  if (!this->block_size)
+    this->block_size = block_size;
+  if (this->lo_watermark > this->block_size)
+    this->lo_watermark = this->block_size;
+
+  CHECK(*this->name && !strchr(this->name, '/') &&
+        strlen(this->name) + 5 < SHM_BELL_CHARS,
+        fprintf(stderr, "bad shared memory name %s\n", this->name),
+        return false);
+
+  CHECK(SYSCALL(this->bell = socket(AF_UNIX, SOCK_DGRAM | SOCK_NONBLOCK, 0)),
+        WITH_THIS("create bell"), return false);
+  struct sockaddr_un addr = {AF_UNIX, ""};
+  int len = snprintf(addr.sun_path + 1, sizeof(addr.sun_path) - 1, "ndd/%s",
+                     this->name);
+  CHECK(SYSCALL(bind(this->bell, (struct sockaddr *)&addr,
+                     offsetof(struct sockaddr_un, sun_path) + 1 + len)),
+        WITH_THIS("bind bell"), return false);
+
+  CHECK(SYSCALL(this->epoll_fd = epoll_create(1)),
+        WITH_THIS("create epoll fd"), return false);
+  struct epoll_event ev = { .events = EPOLLIN, .data.u32 = BELL };
+  CHECK(SYSCALL(epoll_ctl(this->epoll_fd, EPOLL_CTL_ADD, this->bell, &ev)),
+        WITH_THIS("watch bell"), return false);
+  return true;
+}
+
+static const char *name(void *data) {
+  GET(struct data, this, data);
+  return this->name;
+}
+
+static void destroy(void *data) {
+  GET(struct data, this, data);
+  if (this->header) {
+    char path[NAME_MAX];
+    snprintf(path, sizeof(path), "/%s", this->name);
+    CHECK(SYSCALL(shm_unlink(path)), WITH_THIS("unlink shared memory"), ;);
+    CHECK(SYSCALL(munmap(this->header, SHM_HEADER_SIZE + this->ring_size)),
+          WITH_THIS("unmap shared memory"), ;);
+  }
+  for (size_t i = 0; i != SHM_MAX_READERS; ++i)
+    COND_CHECK(this->pidfds[i], -1, SYSCALL(close(this->pidfds[i])),
+               WITH_THIS("close pidfd of reader"));
+  COND_CHECK(this->epoll_fd, -1, SYSCALL(close(this->epoll_fd)),
+             WITH_THIS("close epoll fd"));
+  COND_CHECK(this->bell, -1, SYSCALL(close(this->bell)),
+             WITH_THIS("close bell"));
+  free(data);
+}
+
+static bool start(void *data, const struct stream_info *info) {
+  GET(struct data, this, data);
+  CHECK(is_whole_stream(info),
+        fprintf(stderr, "%s can only take a whole stream from its start\n",
+                this->name),
+        return false);
+  this->info = *info;
+  return true;
+}
+
+static void wake_readers(struct data *this) {
+  __atomic_add_fetch(&this->header->seq, 1, __ATOMIC_SEQ_CST);
+  if (LOAD(&this->header->sleepers))
+    syscall(SYS_futex, &this->header->seq, FUTEX_WAKE, INT_MAX, NULL, NULL, 0);
+}
+
+// The segment is created once the engine knows the size of its buffer.
+static bool map_ring(void *data, size_t size, char **ring) {
+  GET(struct data, this, data);
+  char path[NAME_MAX];
+  snprintf(path, sizeof(path), "/%s", this->name);
+
+  int fd = shm_open(path, O_RDWR | O_CREAT | O_EXCL, S_IRUSR | S_IWUSR);
+  CHECK(SYSCALL(fd), WITH_THIS("create shared memory"), return false);
+
+  void *addr = MAP_FAILED;
+  bool rv = true;
+  CHECK(SYSCALL(ftruncate(fd, SHM_HEADER_SIZE + size)) &&
+        (addr = mmap(NULL, SHM_HEADER_SIZE + size, PROT_READ | PROT_WRITE,
+                     MAP_SHARED, fd, 0)) != MAP_FAILED,
+        WITH_THIS("map shared memory"), rv = false);
+  CHECK(SYSCALL(close(fd)), WITH_THIS("close shared memory"), rv = false);
+  if (addr == MAP_FAILED) {
+    shm_unlink(path);
+    return false;
+  }
+
+  this->header = addr;
+  this->ring = (char *)addr + SHM_HEADER_SIZE;
+  this->ring_size = size;
+
+  struct shm_header *header = this->header;
+  header->version = SHM_VERSION;
+  header->ring_size = size;
+  header->stream_size = this->info.size;
+  header->flags = this->info.size_known ? SHM_SIZE_KNOWN : 0;
+  snprintf(header->bell, sizeof(header->bell), "ndd/%s", this->name);
+  STORE(&header->magic, SHM_MAGIC);
+  wake_readers(this);
+
+  *ring = this->ring;
+  return rv;
+}
+
+static uint32_t get_epoll_event(void *data) {
+  return EPOLLIN;
+}
+
+static int get_fd(void *data) {
+  GET(struct data, this, data);
+  return this->epoll_fd;
+}
+
+static size_t get_lo_watermark(void *data) {
+  GET(struct data, this, data);
+  return this->lo_watermark;
+}
+
+static size_t get_block_size(void *data) {
+  GET(struct data, this, data);
+  return this->block_size;
+}
+
+static void forget_reader(struct data *this, size_t slot) {
+  COND_CHECK(this->pidfds[slot], -1, SYSCALL(close(this->pidfds[slot])),
+             WITH_THIS("close pidfd of reader"));
+}
+
+// The slot of a reader which died is freed for others.
+static void lose_reader(struct data *this, size_t slot) {
+  struct shm_reader *reader = &this->header->readers[slot];
+  forget_reader(this, slot);
+  fprintf(stderr, "warning: reader %"PRIu32" of %s is gone\n",
+          LOAD(&reader->pid), this->name);
+  STORE(&reader->pid, 0);
+  STORE(&reader->state, SHM_FREE);
+  ++this->lost_readers;
+}
+
+// A joining reader is watched from when it's made active. One which hasn't
+// stored its pid yet is left joining, it rings the bell once it has.
+static bool watch_reader(struct data *this, size_t slot) {
+  struct shm_reader *reader = &this->header->readers[slot];
+  pid_t pid = LOAD(&reader->pid);
+  if (!pid)
+    return false;
+  forget_reader(this, slot);
+  int pidfd = syscall(SYS_pidfd_open, pid, 0);
+  if (pidfd == -1) {
+    CHECK(errno == ESRCH, WITH_THIS("open pidfd of reader"), ;);
+    lose_reader(this, slot);
+    return false;
+  }
+  this->pidfds[slot] = pidfd;
+  struct epoll_event ev = { .events = EPOLLIN, .data.u32 = slot };
+  CHECK(SYSCALL(epoll_ctl(this->epoll_fd, EPOLL_CTL_ADD, pidfd, &ev)),
+        WITH_THIS("watch reader"), lose_reader(this, slot); return false);
+  return true;
+}
+
+// Where the slowest active reader is. Joining readers start at the tail,
+// and nothing is released until enough readers have joined.
+static uint64_t find_tail(struct data *this) {
+  uint64_t tail = this->head;
+  bool joined = false;
+  for (size_t i = 0; i != SHM_MAX_READERS; ++i) {
+    struct shm_reader *reader = &this->header->readers[i];
+    uint32_t state = LOAD(&reader->state);
+    if (state == SHM_FREE && this->pidfds[i] != -1)
+      forget_reader(this, i);
+    if (state == SHM_JOINING && watch_reader(this, i)) {
+      STORE(&reader->offset, this->tail);
+      uint32_t expected = SHM_JOINING;
+      if (__atomic_compare_exchange_n(&reader->state, &expected, SHM_ACTIVE,
+                                      false, __ATOMIC_SEQ_CST,
+                                      __ATOMIC_SEQ_CST)) {
+        state = SHM_ACTIVE;
+        ++this->joined;
+        joined = true;
+      } else {
+        forget_reader(this, i);
+      }
+    }
+    if (state == SHM_ACTIVE) {
+      uint64_t offset = LOAD(&reader->offset);
+      if (offset < this->tail)
+        offset = this->tail;
+      if (offset < tail)
+        tail = offset;
+    }
+  }
+
+  if (joined)
+    wake_readers(this);
+  return this->joined < this->readers ? this->tail : tail;
+}
+
+// Releases what the readers are done with, or, if there's nothing, sets
+// waiting for them to ring the bell once there is.
+static ssize_t collect(struct data *this) {
+  uint64_t tail = find_tail(this);
+  if (tail == this->tail) {
+    STORE(&this->header->waiting, 1);
+    tail = find_tail(this);
+    if (tail == this->tail)
+      return 0;
+    STORE(&this->header->waiting, 0);
+  }
+
+  ssize_t moved = tail - this->tail;
+  this->tail = tail;
+  STORE(&this->header->tail, tail);
+  return moved;
+}
+
+// The stream is offered from the tail, the part of it beyond the head is
+// new. It's already in the ring if the engine uses the ring as its buffer,
+// otherwise it's copied to the same place in the ring.
+static ssize_t consume(void *data, void *buf, size_t count) {
+  GET(struct data, this, data);
+  uint64_t end = this->tail + count;
+  if (end > this->head) {
+    char *to = this->ring + this->head % this->ring_size;
+    const char *from = (const char *)buf + (this->head - this->tail);
+    if (to != from) {
+      memcpy(to, from, end - this->head);
+      this->copied_bytes += end - this->head;
+    }
+    this->head = end;
+    STORE(&this->header->head, end);
+    wake_readers(this);
+  }
+  return collect(this);
+}
+
+static ssize_t consume_signal(void *data) {
+  GET(struct data, this, data);
+  struct epoll_event events[SHM_MAX_READERS + 1];
+  int num;
+  CHECK(SYSCALL(num = epoll_wait(this->epoll_fd, events, arraysize(events),
+                                 0)),
+        WITH_THIS("wait for bell"), return -1);
+  for (int i = 0; i != num; ++i) {
+    size_t slot = events[i].data.u32;
+    if (slot != BELL) {
+      if (LOAD(&this->header->readers[slot].state) == SHM_ACTIVE)
+        lose_reader(this, slot);
+      else
+        forget_reader(this, slot);
+    }
+  }
+
+  char unused;
+  ssize_t rv;
+  while ((rv = recv(this->bell, &unused, sizeof(unused), 0)) != -1)
+    ;
+  CHECK(would_block(rv), WITH_THIS("empty bell"), return -1);
+
+  STORE(&this->header->waiting, 0);
+  return collect(this);
+}
+
+static bool finish(void *data) {
+  GET(struct data, this, data);
+  __atomic_or_fetch(&this->header->flags, SHM_EOF, __ATOMIC_SEQ_CST);
+  wake_readers(this);
+  return true;
+}
+
+static size_t get_counters(void *data, struct counter *counters) {
+  GET(struct data, this, data);
+  counters[0] = (struct counter) {"copied_bytes", this->copied_bytes};
+  counters[1] = (struct counter) {"lost_readers", this->lost_readers};
+  return 2;
+}
+
+static const struct consumer_ops output_ops = {
+  .init             = init,
+  .setup            = setup_nothing,
+  .name             = name,
+  .destroy          = destroy,
+  .start            = start,
+
+  .get_epoll_event  = get_epoll_event,
+  .get_fd           = get_fd,
+  .get_lo_watermark = get_lo_watermark,
+  .get_block_size   = get_block_size,
+  .get_priority     = get_no_priority,
+  .consume          = consume,
+  .signal           = consume_signal,
+  .poll             = poll_nothing,
+  .finish           = finish,
+  .get_spill        = get_no_spill,
+  .map_ring         = map_ring,
+
+  .get_node         = get_no_node,
+  .get_counters     = get_counters,
+  .get_reports      = get_no_reports,
+
+  .get_listen_fd    = get_no_listen_fd,
+  .accept_joiner    = accept_no_joiner,
+  .get_missed       = get_no_missed,
+  .get_wanted_fd    = get_no_wanted_fd,
+  .get_wanted       = get_nothing_wanted,
+  .put_fetched      = ignore_fetched,
+};
+
+static bool parse_options(struct data *this, char *options) {
+  enum { BLOCK, LO, READERS };
+  char *const tokens[] = {
+    [BLOCK] = "block",
+    [LO] = "lo",
+    [READERS] = "readers",
+    NULL
+  };
+
+  while (*options) {
+    char *value = NULL;
+    switch (getsubopt(&options, tokens, &value)) {
+    case BLOCK:
+      CHECK(value && parse_size(value, &this->block_size),
+            fprintf(stderr, "bad block option for %s\n", this->name),
+            return false);
+      break;
+    case LO:
+      CHECK(value && parse_size(value, &this->lo_watermark),
+            fprintf(stderr, "bad lo option for %s\n", this->name),
+            return false);
+      break;
+    case READERS:
+      CHECK(value && parse_size(value, &this->readers) &&
+            this->readers <= SHM_MAX_READERS,
+            fprintf(stderr, "bad readers option for %s\n", this->name),
+            return false);
+      break;
+    default:
+      fprintf(stderr, "unknown option %s for %s\n", value, this->name);
+      return false;
+    }
+  }
+  return true;
+}
+
+// The spec is a shared memory name optionally followed by comma-separated
+// options.
+static struct data *construct(const char *spec) {
+  assert(spec);
+  struct data *data = malloc(sizeof(struct data) + strlen(spec) + 1);
+
+  if (data) {
+    data->bell = -1;
+    data->epoll_fd = -1;
+    for (size_t i = 0; i != SHM_MAX_READERS; ++i)
+      data->pidfds[i] = -1;
+    data->header = NULL;
+    data->ring = NULL;
+    data->ring_size = 0;
+    data->head = 0;
+    data->tail = 0;
+    data->readers = 0;
+    data->joined = 0;
+    data->copied_bytes = 0;
+    data->lost_readers = 0;
+    memset(&data->info, 0, sizeof(data->info));
+    data->block_size = 0;
+    data->lo_watermark = 0;
+    strcpy(data->name, spec);
+
+    char *options = strchr(data->name, ',');
+    if (options) {
+      *options++ = 0;
+      if (!parse_options(data, options))
+        goto cleanup;
+    }
+  }
+
+  return data;
+
+cleanup:
+  free(data);
+  return NULL;
+}
+
+struct consumer get_shm_writer(const char *name, size_t lo_watermark) {
+  return (struct consumer) {&output_ops, construct(name)};
+}
+
+#undef STORE
+#undef LOAD
+#undef WITH_THIS
@@ -0,0 +1,57 @@
+#pragma once
+
+#include <inttypes.h>
+#include <stdlib.h>
+
+struct consumer;
+
+extern struct consumer get_shm_writer(const char *name, size_t lo_watermark);
+
+// Layout of the shared memory segment /dev/shm/NAME: this header, padded to
+// SHM_HEADER_SIZE, followed by a ring of ring_size bytes where the stream's
+// byte at offset x is at x % ring_size.
+//
+// All fields are accessed with atomics. The writer publishes the stream up
+// to head, and bumps seq (a futex word) whenever head, flags or the states
+// of readers change, waking the readers which count themselves in sleepers
+// while they wait. A reader takes a free slot by moving its state from
+// SHM_FREE to SHM_JOINING, stores its pid and rings the bell; the writer
+// then places it at tail and makes it SHM_ACTIVE. An active reader may use
+// the ring between its offset and head, and stores its offset as it is done
+// with the data. The writer doesn't overwrite what active readers haven't
+// got to; when it waits for them it sets waiting, and the reader which
+// clears it rings the bell: a datagram to the abstract unix socket named
+// bell. A reader leaves by setting its pid to 0 and its state back to
+// SHM_FREE, and the writer does that for it if it dies. shmcat is such a
+// reader.
+#define SHM_MAGIC 0x6e646473
+#define SHM_VERSION 2
+#define SHM_HEADER_SIZE 4096
+#define SHM_MAX_READERS 32
+#define SHM_BELL_CHARS 64
+
+#define SHM_SIZE_KNOWN 1
+#define SHM_EOF 2
+
+enum { SHM_FREE, SHM_JOINING, SHM_ACTIVE };
+
+struct shm_reader {
+  uint32_t state;
+  uint32_t pid;
+  uint64_t offset;
+};
+
+struct shm_header {
+  uint32_t magic;
+  uint32_t version;
+  uint64_t ring_size;
+  uint64_t stream_size;
+  uint32_t flags;
+  uint32_t seq;
+  uint64_t head;
+  uint64_t tail;
+  uint32_t waiting;
+  uint32_t sleepers;
+  char bell[SHM_BELL_CHARS];
+  struct shm_reader readers[SHM_MAX_READERS];
+};
@@ -0,0 +1,188 @@
+#include "macro.h"
+#include "shm.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <inttypes.h>
+#include <limits.h>
+#include <linux/futex.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <sys/un.h>
+#include <time.h>
+#include <unistd.h>
+
+// Copies the stream of an ndd shared memory writer (-M NAME) to stdout,
+// following the protocol in shm.h. The writer is waited for if it hasn't
+// created the segment yet.
+#define OPEN_RETRY_MS 10
+
+#define LOAD(ptr) __atomic_load_n(ptr, __ATOMIC_SEQ_CST)
+#define STORE(ptr, value) __atomic_store_n(ptr, value, __ATOMIC_SEQ_CST)
+
+struct reader {
+  const char *name;
+  struct shm_header *header;
+  char *ring;
+  size_t size;
+  struct shm_reader *slot;
+  int bell;
+};
+
+static struct shm_header *map_segment(const char *name, size_t *size) {
+  char path[NAME_MAX];
+  snprintf(path, sizeof(path), "/%s", name);
+  const struct timespec retry = {0, OPEN_RETRY_MS * 1000000L};
+
+  for (;;) {
+    int fd = shm_open(path, O_RDWR, 0);
+    CHECK(SYSCALL(fd) || errno == ENOENT,
+          PERROR1("failed to open shared memory", name), return NULL);
+    if (fd == -1) {
+      nanosleep(&retry, NULL);
+      continue;
+    }
+
+    struct stat stat;
+    void *addr = MAP_FAILED;
+    if (SYSCALL(fstat(fd, &stat)) && stat.st_size > SHM_HEADER_SIZE)
+      addr = mmap(NULL, stat.st_size, PROT_READ | PROT_WRITE, MAP_SHARED,
+                  fd, 0);
+    close(fd);
+    // The writer sets magic last.
+    if (addr != MAP_FAILED &&
+        LOAD(&((struct shm_header *)addr)->magic) == SHM_MAGIC) {
+      *size = stat.st_size;
+      return addr;
+    }
+    if (addr != MAP_FAILED)
+      munmap(addr, stat.st_size);
+    nanosleep(&retry, NULL);
+  }
+}
+
+static void ring_bell(struct reader *this) {
+  struct sockaddr_un addr = {AF_UNIX, ""};
+  size_t len = strnlen(this->header->bell, SHM_BELL_CHARS);
+  memcpy(addr.sun_path + 1, this->header->bell, len);
+  char bell = 0;
+  sendto(this->bell, &bell, sizeof(bell), MSG_DONTWAIT,
+         (struct sockaddr *)&addr,
+         offsetof(struct sockaddr_un, sun_path) + 1 + len);
+}
+
+// Waits for the writer to bump seq from what it was.
+static void wait_writer(struct reader *this, uint32_t seq) {
+  __atomic_add_fetch(&this->header->sleepers, 1, __ATOMIC_SEQ_CST);
+  if (LOAD(&this->header->seq) == seq)
+    syscall(SYS_futex, &this->header->seq, FUTEX_WAIT, seq, NULL, NULL, 0);
+  __atomic_sub_fetch(&this->header->sleepers, 1, __ATOMIC_SEQ_CST);
+}
+
+static bool join(struct reader *this) {
+  for (size_t i = 0; i != SHM_MAX_READERS && !this->slot; ++i) {
+    uint32_t expected = SHM_FREE;
+    if (__atomic_compare_exchange_n(&this->header->readers[i].state,
+                                    &expected, SHM_JOINING, false,
+                                    __ATOMIC_SEQ_CST, __ATOMIC_SEQ_CST))
+      this->slot = &this->header->readers[i];
+  }
+  CHECK(this->slot, fprintf(stderr, "%s has no room for readers\n",
+                            this->name),
+        return false);
+  STORE(&this->slot->pid, getpid());
+  ring_bell(this);
+
+  for (;;) {
+    uint32_t seq = LOAD(&this->header->seq);
+    if (LOAD(&this->slot->state) == SHM_ACTIVE)
+      return true;
+    wait_writer(this, seq);
+  }
+}
+
+static void leave(struct reader *this) {
+  STORE(&this->slot->pid, 0);
+  STORE(&this->slot->state, SHM_FREE);
+  ring_bell(this);
+}
+
+static bool write_all(const char *buf, size_t size) {
+  while (size) {
+    ssize_t rv = write(STDOUT_FILENO, buf, size);
+    if (rv == -1 && errno == EINTR)
+      continue;
+    CHECK(SYSCALL(rv), perror("failed to write stream"), return false);
+    buf += rv;
+    size -= rv;
+  }
+  return true;
+}
+
+static bool copy(struct reader *this) {
+  uint64_t offset = LOAD(&this->slot->offset);
+  for (;;) {
+    // The end is set after the last of head.
+    uint32_t seq = LOAD(&this->header->seq);
+    uint32_t flags = LOAD(&this->header->flags);
+    uint64_t head = LOAD(&this->header->head);
+
+    if (offset != head) {
+      size_t pos = offset % this->size;
+      size_t count = head - offset;
+      if (count > this->size - pos)
+        count = this->size - pos;
+      if (!write_all(this->ring + pos, count))
+        return false;
+      offset += count;
+      STORE(&this->slot->offset, offset);
+      if (__atomic_exchange_n(&this->header->waiting, 0, __ATOMIC_SEQ_CST))
+        ring_bell(this);
+      continue;
+    }
+
+    if (flags & SHM_EOF) {
+      CHECK(!(flags & SHM_SIZE_KNOWN) || offset == this->header->stream_size,
+            fprintf(stderr, "%s ended at %"PRIu64" of %"PRIu64" bytes\n",
+                    this->name, offset, this->header->stream_size),
+            return false);
+      return true;
+    }
+    wait_writer(this, seq);
+  }
+}
+
+int main(int argc, char *argv[]) {
+  if (argc != 2) {
+    fprintf(stderr, "Usage: %s <name>\n", argv[0]);
+    return 1;
+  }
+
+  struct reader reader = {.name = argv[1], .bell = -1};
+  struct reader *this = &reader;
+  size_t size;
+  CHECK(this->header = map_segment(this->name, &size), ;, return 1);
+  CHECK(LOAD(&this->header->version) == SHM_VERSION &&
+        this->header->ring_size == size - SHM_HEADER_SIZE,
+        fprintf(stderr, "unsupported shared memory %s\n", this->name),
+        return 1);
+  this->ring = (char *)this->header + SHM_HEADER_SIZE;
+  this->size = this->header->ring_size;
+  CHECK(SYSCALL(this->bell = socket(AF_UNIX, SOCK_DGRAM, 0)),
+        perror("failed to create socket for bell"), return 1);
+
+  if (!join(this))
+    return 1;
+  bool rv = copy(this);
+  leave(this);
+  return rv ? 0 : 1;
+}
+
+#undef STORE
+#undef LOAD
@@ -0,0 +1,895 @@
+#include "defaults.h"
+#include "engine.h"
+#include "macro.h"
+#include "socket.h"
+#include "stats.h"
+#include "struct.h"
+#include "trace.h"
+#include "util.h"
+
+#include <assert.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <getopt.h>
+#include <netdb.h>
+#include <poll.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/epoll.h>
+#include <sys/socket.h>
+#include <sys/timerfd.h>
+#include <unistd.h>
+
+// A chain of a source and receivers run as threads of one process, each
+// with the engine and socket endpoints of ndd. The receivers connect
+// through relays which emulate the links between the machines, and the
+// disks are emulated too, so that the behaviour of the chain can be
+// measured without a cluster:
+//
+//   source -> link 1 -> receiver 1 -> link 2 -> ... -> receiver N
+//
+// The source makes up a stream which the receivers check as they write it.
+
+#define MAX_NODES MAX_CONSUMERS
+#define DEFAULT_RECEIVERS 2
+#define DEFAULT_STREAM_SIZE (1024ULL*1024*1024)
+#define DEFAULT_SIM_PORT 4700
+#define LINK_BUFFER_SIZE (4*1024*1024)
+#define LINK_CHUNK_SIZE (256*1024)
+#define LINK_MAX_MARKS 4096
+#define LINK_QUANTUM (64*1024)
+
+// An emulated device takes requests one at a time, each taking latency and
+// the time to move it at rate, if rate isn't 0. Every so many bytes it
+// stalls for a while, like a disk flushing its cache.
+struct device {
+  uint64_t rate;
+  uint64_t latency_ns;
+  uint64_t stall_ns;
+  uint64_t stall_every;
+};
+
+// The simulated disk of a node: the source reads the stream from it, the
+// receivers write it there.
+struct data {
+  struct device device;
+  enum { R, W } mode;
+  uint64_t size;
+  size_t block_size;
+  int timer_fd;
+
+  uint64_t position;
+  uint64_t free_at;
+  uint64_t next_stall;
+  size_t pending;
+  uint64_t stalls;
+  char name[16];
+};
+
+#define WITH_THIS(act) PERROR1("failed to " act " for", this->name)
+
+// Byte x of the stream is byte x % 8 of the 64-bit word x - x % 8.
+static size_t pattern(unsigned char *buf, uint64_t offset, size_t count,
+                      bool fill) {
+  for (size_t i = 0; i != count;) {
+    uint64_t at = offset + i;
+    uint64_t word = at - at % 8;
+    size_t length = (at % 8 == 0 && count - i >= 8) ? 8 : 1;
+    const unsigned char *bytes = (const unsigned char *)&word + at % 8;
+    if (fill)
+      memcpy(buf + i, bytes, length);
+    else if (memcmp(buf + i, bytes, length) != 0)
+      return i;
+    i += length;
+  }
+  return count;
+}
+
+static bool disk_init(void *data, size_t block_size) {
+  GET(struct data, this, data);
+  this->block_size = block_size;
+  CHECK(SYSCALL(this->timer_fd = timerfd_create(CLOCK_MONOTONIC,
+                                                TFD_NONBLOCK)),
+        WITH_THIS("create timer"), return false);
+  this->next_stall = this->device.stall_every;
+  return true;
+}
+
+static const char *disk_name(void *data) {
+  GET(struct data, this, data);
+  return this->name;
+}
+
+static void disk_destroy(void *data) {
+  GET(struct data, this, data);
+  COND_CHECK(this->timer_fd, -1, SYSCALL(close(this->timer_fd)),
+             WITH_THIS("close timer"));
+  free(data);
+}
+
+static bool disk_get_info(void *data, struct stream_info *info) {
+  GET(struct data, this, data);
+  info->size_known = true;
+  info->size = this->size;
+  info->image_size = this->size;
+  set_local_source(info, this->name);
+  return true;
+}
+
+static bool disk_start(void *data, const struct stream_info *info) {
+  GET(struct data, this, data);
+  CHECK(is_whole_stream(info),
+        fprintf(stderr, "%s can only take a whole stream from its start\n",
+                this->name),
+        return false);
+  this->size = info->size;
+  return true;
+}
+
+static uint32_t disk_get_epoll_event(void *data) {
+  return EPOLLIN;
+}
+
+static int disk_get_fd(void *data) {
+  GET(struct data, this, data);
+  return this->timer_fd;
+}
+
+static size_t disk_get_lo_watermark(void *data) {
+  GET(struct data, this, data);
+  return this->block_size;
+}
+
+static size_t disk_get_block_size(void *data) {
+  GET(struct data, this, data);
+  return this->block_size;
+}
+
+// Takes count bytes right away if the device is free and infinitely fast,
+// otherwise they are done once the timer fires.
+static ssize_t submit(struct data *this, size_t count) {
+  const struct device *device = &this->device;
+  uint64_t now = get_time_ns();
+  uint64_t done_at = (this->free_at > now ? this->free_at : now) +
+      device->latency_ns +
+      (device->rate ? count * 1000000000ULL / device->rate : 0);
+  if (device->stall_every && this->position + count >= this->next_stall) {
+    done_at += device->stall_ns;
+    this->next_stall += device->stall_every;
+    ++this->stalls;
+  }
+  this->free_at = done_at;
+  this->position += count;
+
+  if (done_at <= now)
+    return count;
+
+  struct itimerspec spec = {
+    .it_value = { done_at / 1000000000, done_at % 1000000000 }
+  };
+  CHECK(SYSCALL(timerfd_settime(this->timer_fd, TFD_TIMER_ABSTIME, &spec,
+                                NULL)),
+        WITH_THIS("arm timer"), return -1);
+  this->pending = count;
+  return 0;
+}
+
+static ssize_t complete(struct data *this) {
+  uint64_t expirations;
+  ssize_t rv = read(this->timer_fd, &expirations, sizeof(expirations));
+  CHECK(rv != -1 || would_block(rv), WITH_THIS("read timer"), return -1);
+  if (rv == -1)
+    return 0;
+
+  size_t done = this->pending;
+  this->pending = 0;
+  return done;
+}
+
+static ssize_t produce(void *data, void *buf, size_t count, bool *eof) {
+  GET(struct data, this, data);
+  if (this->position + count > this->size)
+    count = this->size - this->position;
+  *eof = (count == 0);
+  if (*eof)
+    return 0;
+
+  pattern(buf, this->position, count, true);
+  return submit(this, count);
+}
+
+static ssize_t produce_signal(void *data, bool *eof) {
+  GET(struct data, this, data);
+  *eof = false;
+  return complete(this);
+}
+
+static ssize_t consume(void *data, void *buf, size_t count) {
+  GET(struct data, this, data);
+  size_t good = pattern(buf, this->position, count, false);
+  CHECK(good == count,
+        fprintf(stderr, "%s got bad data at %"PRIu64"\n", this->name,
+                this->position + good),
+        return -1);
+  return submit(this, count);
+}
+
+static ssize_t consume_signal(void *data) {
+  GET(struct data, this, data);
+  return complete(this);
+}
+
+static bool disk_finish(void *data) {
+  GET(struct data, this, data);
+  CHECK(this->position == this->size,
+        fprintf(stderr, "%s got %"PRIu64" bytes of %"PRIu64"\n", this->name,
+                this->position, this->size),
+        return false);
+  return true;
+}
+
+static size_t disk_get_counters(void *data, struct counter *counters) {
+  GET(struct data, this, data);
+  counters[0] = (struct counter) {"stalls", this->stalls};
+  return 1;
+}
+
+static const struct producer_ops source_ops = {
+  .init             = disk_init,
+  .setup            = setup_nothing,
+  .name             = disk_name,
+  .destroy          = disk_destroy,
+  .get_info         = disk_get_info,
+
+  .get_epoll_event  = disk_get_epoll_event,
+  .get_fd           = disk_get_fd,
+  .get_lo_watermark = disk_get_lo_watermark,
+  .get_block_size   = disk_get_block_size,
+  .get_read_ahead   = get_single_read_ahead,
+  .produce          = produce,
+  .signal           = produce_signal,
+  .poll             = poll_nothing,
+
+  .get_node         = get_no_node,
+  .get_counters     = disk_get_counters,
+  .put_reports      = put_no_reports,
+  .can_rewind       = cannot_rewind,
+  .rewind           = rewind_nothing,
+  .set_private_ring = ignore_private_ring,
+  .fetch            = fetch_nothing,
+  .take_fetched     = take_nothing_fetched,
+  .get_fetched_fd   = get_no_fetched_fd,
+};
+
+static const struct consumer_ops sink_ops = {
+  .init             = disk_init,
+  .setup            = setup_nothing,
+  .name             = disk_name,
+  .destroy          = disk_destroy,
+  .start            = disk_start,
+
+  .get_epoll_event  = disk_get_epoll_event,
+  .get_fd           = disk_get_fd,
+  .get_lo_watermark = disk_get_lo_watermark,
+  .get_block_size   = disk_get_block_size,
+  .get_priority     = get_no_priority,
+  .consume          = consume,
+  .signal           = consume_signal,
+  .poll             = poll_nothing,
+  .finish           = disk_finish,
+  .get_spill        = get_no_spill,
+  .map_ring         = map_no_ring,
+
+  .get_node         = get_no_node,
+  .get_counters     = disk_get_counters,
+  .get_reports      = get_no_reports,
+
+  .get_listen_fd    = get_no_listen_fd,
+  .accept_joiner    = accept_no_joiner,
+  .get_missed       = get_no_missed,
+  .get_wanted_fd    = get_no_wanted_fd,
+  .get_wanted       = get_nothing_wanted,
+  .put_fetched      = ignore_fetched,
+};
+
+static struct data *construct_disk(const struct device *device, int mode,
+                                   uint64_t size, size_t index) {
+  struct data *data = malloc(sizeof(struct data));
+  CHECK(data, ERROR("can't allocate memory for disk"), return NULL);
+  *data = (struct data) {
+    .device = *device, .mode = mode, .size = size, .timer_fd = -1
+  };
+  snprintf(data->name, sizeof(data->name), "disk%zu", index);
+  return data;
+}
+
+#undef WITH_THIS
+
+// A relay stands for the link into a receiver: the receiver connects to it
+// and it connects to the previous node. The stream goes through it at rate
+// and arrives latency later, the reports going back pass unhindered.
+struct link {
+  struct device device;
+  const struct addrinfo *address;
+  int listen_fd;
+  int port;
+  bool ok;
+  uint64_t relayed;
+  pthread_t thread;
+};
+
+struct mark {
+  uint64_t end;
+  uint64_t due_ns;
+};
+
+static bool set_port(const struct addrinfo *address, int port,
+                     struct sockaddr_storage *addr) {
+  memcpy(addr, address->ai_addr, address->ai_addrlen);
+  switch (addr->ss_family) {
+  case AF_INET:
+    ((struct sockaddr_in *)addr)->sin_port = htons(port);
+    return true;
+  case AF_INET6:
+    ((struct sockaddr_in6 *)addr)->sin6_port = htons(port);
+    return true;
+  }
+  ERROR("unknown address family");
+  return false;
+}
+
+static int listen_on(const struct addrinfo *address, int port) {
+  struct sockaddr_storage addr;
+  int reuse = 1;
+  int sock = -1;
+  CHECK(set_port(address, port, &addr), ;, return -1);
+  CHECK(SYSCALL(sock = socket(address->ai_family, address->ai_socktype,
+                              address->ai_protocol)) &&
+        SYSCALL(setsockopt(sock, SOL_SOCKET, SO_REUSEADDR, &reuse,
+                           sizeof(reuse))) &&
+        SYSCALL(bind(sock, (struct sockaddr *)&addr, address->ai_addrlen)) &&
+        SYSCALL(listen(sock, 1)),
+        perror("failed to listen for link"),
+        COND_CHECK(sock, -1, SYSCALL(close(sock)), perror("close() failed")));
+  return sock;
+}
+
+// The previous node may not be listening yet.
+static int connect_to(const struct addrinfo *address, int port) {
+  struct sockaddr_storage addr;
+  CHECK(set_port(address, port, &addr), ;, return -1);
+  uint64_t deadline = get_time_ns() + CONNECT_TIMEOUT_MS * 1000000ULL;
+  for (;;) {
+    int sock = socket(address->ai_family, address->ai_socktype,
+                      address->ai_protocol);
+    CHECK(SYSCALL(sock), perror("failed to create socket for link"),
+          return -1);
+    if (SYSCALL(connect(sock, (struct sockaddr *)&addr, address->ai_addrlen)))
+      return sock;
+    int error = errno;
+    CHECK(SYSCALL(close(sock)), perror("close() failed"), ;);
+    CHECK(error == ECONNREFUSED && get_time_ns() < deadline,
+          errno = error; perror("failed to connect link"), return -1);
+    usleep(CONNECT_RETRY_MIN_MS * 1000);
+  }
+}
+
+static bool make_nonblocking(int fd) {
+  int flags = fcntl(fd, F_GETFL);
+  return SYSCALL(flags) && SYSCALL(fcntl(fd, F_SETFL, flags | O_NONBLOCK));
+}
+
+static void *relay(void *arg) {
+  struct link *link = arg;
+  const struct device *device = &link->device;
+  char *buffer = malloc(LINK_BUFFER_SIZE);
+  char reports[LINK_CHUNK_SIZE];
+  struct mark marks[LINK_MAX_MARKS];
+  int up = -1, down = -1;
+
+  // What came from upstream, what is due downstream and what was sent,
+  // as offsets in the stream, and the marks of when the parts are due.
+  uint64_t received = 0, due = 0, sent = 0;
+  size_t first_mark = 0, num_marks = 0;
+  size_t reports_begin = 0, reports_end = 0;
+  bool up_eof = false, down_eof = false, down_shut = false;
+  uint64_t burst = device->rate / 100 > LINK_QUANTUM ?
+      device->rate / 100 : LINK_QUANTUM;
+  uint64_t tokens = burst, refilled_at = get_time_ns();
+
+#define FAIL_IF_NOT(cond, alert) \
+  CHECK(cond, alert, GOTO_WITH(cleanup, link->ok, false))
+
+  FAIL_IF_NOT(buffer, ERROR("can't allocate memory for link"));
+  FAIL_IF_NOT(SYSCALL(down = accept(link->listen_fd, NULL, NULL)),
+              perror("failed to accept on link"));
+  COND_CHECK(link->listen_fd, -1, SYSCALL(close(link->listen_fd)),
+             perror("close() failed"));
+  FAIL_IF_NOT(SYSCALL(up = connect_to(link->address, link->port)), ;);
+  FAIL_IF_NOT(make_nonblocking(up) && make_nonblocking(down),
+              perror("failed to set up link sockets"));
+
+  while (!(up_eof && down_eof && reports_begin == reports_end)) {
+    uint64_t now = get_time_ns();
+    for (; num_marks && marks[first_mark].due_ns <= now; --num_marks) {
+      due = marks[first_mark].end;
+      first_mark = (first_mark + 1) % LINK_MAX_MARKS;
+    }
+    // Time which didn't earn a byte yet is kept for later.
+    uint64_t earned = device->rate ?
+        (now - refilled_at) * device->rate / 1000000000 : 0;
+    if (earned || tokens == burst) {
+      tokens = (tokens + earned < burst) ? tokens + earned : burst;
+      refilled_at = now;
+    }
+    if (up_eof && sent == received && !down_shut) {
+      FAIL_IF_NOT(SYSCALL(shutdown(down, SHUT_WR)),
+                  perror("failed to shut down link"));
+      down_shut = true;
+    }
+
+    size_t room = LINK_BUFFER_SIZE - (received - sent);
+    bool throttled = device->rate && tokens < LINK_QUANTUM;
+    bool can_read = !up_eof && room && num_marks != LINK_MAX_MARKS;
+    struct pollfd fds[2] = {
+      { .fd = up, .events = (can_read && !throttled ? POLLIN : 0) |
+                            (reports_begin != reports_end ? POLLOUT : 0) },
+      { .fd = down, .events = (!down_eof && reports_begin == reports_end ?
+                               POLLIN : 0) |
+                              (due != sent ? POLLOUT : 0) },
+    };
+    // Hangups aren't looked at while there's nothing to do with the socket.
+    for (size_t i = 0; i != arraysize(fds); ++i)
+      if (!fds[i].events)
+        fds[i].fd = -1;
+
+    // Wake up for the next part which is due, or more tokens.
+    uint64_t wait_ns = UINT64_MAX;
+    if (num_marks)
+      wait_ns = marks[first_mark].due_ns - now;
+    if (can_read && throttled) {
+      uint64_t refill_ns =
+          (LINK_QUANTUM - tokens) * 1000000000ULL / device->rate + 1;
+      if (refill_ns < wait_ns)
+        wait_ns = refill_ns;
+    }
+    struct timespec timeout = { wait_ns / 1000000000, wait_ns % 1000000000 };
+    int num_events = ppoll(fds, arraysize(fds),
+                           wait_ns == UINT64_MAX ? NULL : &timeout, NULL);
+    if (num_events == -1 && errno == EINTR)
+      continue;
+    FAIL_IF_NOT(SYSCALL(num_events), perror("poll() failed on link"));
+
+    if (fds[0].revents & (POLLIN | POLLHUP | POLLERR) &&
+        fds[0].events & POLLIN) {
+      size_t count = LINK_BUFFER_SIZE - received % LINK_BUFFER_SIZE;
+      if (count > room)
+        count = room;
+      if (count > LINK_CHUNK_SIZE)
+        count = LINK_CHUNK_SIZE;
+      if (device->rate && count > tokens)
+        count = tokens;
+      ssize_t rv = recv(up, buffer + received % LINK_BUFFER_SIZE, count, 0);
+      FAIL_IF_NOT(SYSCALL(rv) || would_block(rv),
+                  perror("failed to receive on link"));
+      if (rv == 0) {
+        up_eof = true;
+      } else if (rv > 0) {
+        received += rv;
+        tokens -= device->rate ? rv : 0;
+        size_t last = (first_mark + num_marks++) % LINK_MAX_MARKS;
+        marks[last] = (struct mark) {received, get_time_ns() +
+                                     device->latency_ns};
+      }
+    }
+
+    if (fds[1].revents & POLLOUT) {
+      size_t count = LINK_BUFFER_SIZE - sent % LINK_BUFFER_SIZE;
+      if (count > due - sent)
+        count = due - sent;
+      ssize_t rv = send(down, buffer + sent % LINK_BUFFER_SIZE, count,
+                        MSG_NOSIGNAL);
+      FAIL_IF_NOT(SYSCALL(rv) || would_block(rv),
+                  perror("failed to send on link"));
+      if (rv > 0)
+        sent += rv;
+    }
+
+    if (fds[1].revents & (POLLIN | POLLHUP | POLLERR) &&
+        fds[1].events & POLLIN) {
+      ssize_t rv = recv(down, reports, sizeof(reports), 0);
+      FAIL_IF_NOT(SYSCALL(rv) || would_block(rv),
+                  perror("failed to receive reports on link"));
+      if (rv == 0) {
+        down_eof = true;
+        FAIL_IF_NOT(SYSCALL(shutdown(up, SHUT_WR)),
+                    perror("failed to shut down link"));
+      } else if (rv > 0) {
+        reports_begin = 0;
+        reports_end = rv;
+      }
+    }
+
+    if (fds[0].revents & POLLOUT) {
+      ssize_t rv = send(up, reports + reports_begin,
+                        reports_end - reports_begin, MSG_NOSIGNAL);
+      FAIL_IF_NOT(SYSCALL(rv) || would_block(rv),
+                  perror("failed to send reports on link"));
+      if (rv > 0)
+        reports_begin += rv;
+    }
+  }
+
+#undef FAIL_IF_NOT
+
+  link->relayed = sent;
+
+cleanup:
+  COND_CHECK(link->listen_fd, -1, SYSCALL(close(link->listen_fd)),
+             perror("close() failed"));
+  COND_CHECK(up, -1, SYSCALL(close(up)), perror("close() failed"));
+  COND_CHECK(down, -1, SYSCALL(close(down)), perror("close() failed"));
+  free(buffer);
+  return NULL;
+}
+
+// A node of the chain runs a transfer like ndd, with its disk.
+struct node {
+  struct device disk;
+  char reader_spec[NI_MAXHOST + 16];
+  char writer_spec[NI_MAXHOST + 16];
+  size_t buffer_size;
+  size_t block_size;
+  uint64_t size;
+  size_t index;
+  bool trace;
+
+  struct state state;
+  struct stats stats;
+  bool ok;
+  uint64_t begin_ns;
+  uint64_t end_ns;
+  pthread_t thread;
+};
+
+static void destroy_node(struct node *node) {
+  struct state *state = &node->state;
+  if (!is_empty_producer(&state->producer))
+    CALL0(state->producer, destroy);
+  for (size_t i = state->num_consumers; i--;)
+    if (!is_empty_consumer(&state->consumers[i]))
+      CALL0(state->consumers[i], destroy);
+  state->producer = (struct producer) {0};
+  state->num_consumers = 0;
+}
+
+static void *run_node(void *arg) {
+  struct node *node = arg;
+  struct state *state = &node->state;
+
+#define FAIL_IF_NOT(cond, alert) \
+  CHECK(cond, alert, GOTO_WITH(cleanup, node->ok, false))
+
+  node->ok = true;
+  if (node->index == 0) {
+    state->producer = (struct producer) {
+      &source_ops, construct_disk(&node->disk, R, node->size, node->index)
+    };
+  } else {
+    state->producer = get_socket_reader(node->reader_spec,
+                                        DEFAULT_READ_AHEAD);
+    state->consumers[state->num_consumers++] = (struct consumer) {
+      &sink_ops, construct_disk(&node->disk, W, 0, node->index)
+    };
+  }
+  if (*node->writer_spec)
+    state->consumers[state->num_consumers++] =
+        get_socket_writer(node->writer_spec, DEFAULT_LO_WATERMARK);
+
+  FAIL_IF_NOT(!is_empty_producer(&state->producer),
+              ERROR("failed to construct producer"));
+  for (size_t i = 0; i != state->num_consumers; ++i)
+    FAIL_IF_NOT(!is_empty_consumer(&state->consumers[i]),
+                ERROR("failed to construct consumer"));
+
+  for (size_t i = 0; i != state->num_consumers; ++i)
+    FAIL_IF_NOT(CALL(state->consumers[i], init, node->block_size),
+                ERROR("failed to initialize consumer"));
+  FAIL_IF_NOT(CALL(state->producer, init, node->block_size),
+              ERROR("failed to initialize producer"));
+  FAIL_IF_NOT(connect_endpoints(state),
+              ERROR("failed to set up endpoints"));
+
+  state->info.block_size = node->block_size;
+  FAIL_IF_NOT(CALL(state->producer, get_info, &state->info),
+              ERROR("failed to get stream info from producer"));
+  for (size_t i = 0; i != state->num_consumers; ++i)
+    FAIL_IF_NOT(CALL(state->consumers[i], start, &state->info),
+                ERROR("failed to start consumer"));
+
+  if (node->trace)
+    FAIL_IF_NOT(start_tracing(DEFAULT_TRACE_EVENTS), ;);
+  node->begin_ns = get_time_ns();
+  FAIL_IF_NOT(transfer(node->buffer_size, state),
+              fprintf(stderr, "transfer of node %zu failed\n", node->index));
+  node->end_ns = get_time_ns();
+
+#undef FAIL_IF_NOT
+
+cleanup:
+  // The connections of a node which failed are closed right away, so that
+  // its neighbours fail too rather than wait for it.
+  if (!node->ok)
+    destroy_node(node);
+  return NULL;
+}
+
+static bool parse_device(char *spec, struct device *device) {
+  enum { RATE, LATENCY, STALL, EVERY };
+  char *const tokens[] = {
+    [RATE] = "rate",
+    [LATENCY] = "latency",
+    [STALL] = "stall",
+    [EVERY] = "every",
+    NULL
+  };
+
+  while (*spec) {
+    char *value = NULL;
+    size_t number;
+    int token = getsubopt(&spec, tokens, &value);
+    CHECK(token != -1, fprintf(stderr, "unknown option %s\n", value),
+          return false);
+    CHECK(value && parse_size(value, &number),
+          fprintf(stderr, "bad %s option\n", tokens[token]), return false);
+    switch (token) {
+    case RATE:
+      device->rate = number;
+      break;
+    case LATENCY:
+      device->latency_ns = number * 1000ULL;
+      break;
+    case STALL:
+      device->stall_ns = number * 1000ULL;
+      break;
+    case EVERY:
+      device->stall_every = number;
+      break;
+    }
+  }
+  return true;
+}
+
+// The spec of a device is for all of them, or for the one at the index
+// before a colon.
+static bool parse_devices(const char *arg, struct device *devices,
+                          size_t first, size_t last) {
+  char spec[256];
+  CHECK(strlen(arg) < sizeof(spec), ERROR("device spec too long"),
+        return false);
+  strcpy(spec, arg);
+
+  char *options = spec;
+  char *colon = strchr(spec, ':');
+  if (colon) {
+    *colon = 0;
+    options = colon + 1;
+    char *end = NULL;
+    unsigned long index = strtoul(spec, &end, 10);
+    CHECK(*end == 0 && end != spec && index >= first && index <= last,
+          fprintf(stderr, "bad device index %s\n", spec), return false);
+    first = last = index;
+  }
+
+  struct device device = devices[first];
+  CHECK(parse_device(options, &device), ;, return false);
+  for (size_t i = first; i <= last; ++i)
+    devices[i] = device;
+  return true;
+}
+
+static void usage(const char *name) {
+  fprintf(stderr,
+          "usage: %s [-n RECEIVERS] [-z SIZE] [-B BUFFER] [-b BLOCK] "
+          "[-p BUSY_POLL_US]\n"
+          "       [-H HOST] [-P PORT] [-l [I:]LINK] [-d [I:]DISK] "
+          "[-S PREFIX] [-T FILE]\n"
+          "LINK and DISK are comma-separated rate=BYTES_PER_S, latency=US,\n"
+          "and for a DISK stall=US every=BYTES as well. Link I goes into\n"
+          "receiver I, disk 0 is the source's.\n", name);
+}
+
+int main(int argc, char *argv[]) {
+  int rv = 0;
+
+  size_t num_receivers = DEFAULT_RECEIVERS;
+  size_t stream_size = DEFAULT_STREAM_SIZE;
+  size_t buffer_size = DEFAULT_BUFFER_SIZE;
+  size_t block_size = DEFAULT_BLOCK_SIZE;
+  size_t busy_poll_us = 0;
+  size_t port = DEFAULT_SIM_PORT;
+  char host[NI_MAXHOST] = "";
+  const char *stats_prefix = NULL;
+  const char *trace_filename = NULL;
+  const char *link_specs[2*MAX_NODES];
+  const char *disk_specs[2*MAX_NODES];
+  size_t num_link_specs = 0, num_disk_specs = 0;
+
+  struct device disks[1+MAX_NODES] = {{0}};
+  struct device link_devices[1+MAX_NODES] = {{0}};
+  struct link links[1+MAX_NODES] = {{{0}}};
+  struct node nodes[1+MAX_NODES];
+  size_t num_nodes = 0, num_links = 0;
+  // Endpoints don't use loopback addresses, which aren't on other nodes.
+  struct addrinfo hints = {
+    .ai_family = AF_UNSPEC, .ai_socktype = SOCK_STREAM
+  };
+  struct addrinfo *address = NULL;
+  int err = 0;
+  uint64_t begin_ns = 0;
+
+  gethostname(host, sizeof(host) - 1);
+
+#define FAIL_IF_NOT(cond, alert) CHECK(cond, alert, GOTO_WITH(cleanup, rv, 1))
+
+  for (int opt; (opt = getopt(argc, argv, "B:b:d:H:l:n:P:p:S:T:z:")) != -1;) {
+    switch (opt) {
+    case 'B':
+    case 'b':
+    case 'n':
+    case 'P':
+    case 'p':
+    case 'z': {
+      size_t value;
+      FAIL_IF_NOT(parse_size(optarg, &value),
+                  fprintf(stderr, "bad value of -%c\n", opt));
+      *(opt == 'B' ? &buffer_size : opt == 'b' ? &block_size :
+        opt == 'n' ? &num_receivers : opt == 'P' ? &port :
+        opt == 'p' ? &busy_poll_us : &stream_size) = value;
+      break;
+    }
+    case 'H':
+      FAIL_IF_NOT(strlen(optarg) < sizeof(host), ERROR("host too long"));
+      strcpy(host, optarg);
+      break;
+    case 'l':
+    case 'd':
+      FAIL_IF_NOT((opt == 'l' ? num_link_specs : num_disk_specs) !=
+                  arraysize(link_specs), ERROR("too many devices"));
+      if (opt == 'l')
+        link_specs[num_link_specs++] = optarg;
+      else
+        disk_specs[num_disk_specs++] = optarg;
+      break;
+    case 'S':
+      stats_prefix = optarg;
+      break;
+    case 'T':
+      trace_filename = optarg;
+      break;
+    default:
+      usage(argv[0]);
+      FAIL_IF_NOT(false, ;);
+    }
+  }
+
+  FAIL_IF_NOT(optind == argc, usage(argv[0]));
+  FAIL_IF_NOT(num_receivers >= 1 && num_receivers <= MAX_NODES,
+              fprintf(stderr, "at most %d receivers\n", MAX_NODES));
+  FAIL_IF_NOT(buffer_size > block_size && buffer_size % block_size == 0,
+              ERROR("buffer size should be a multiple of block size"));
+  FAIL_IF_NOT(port + 2 * num_receivers <= 65535, ERROR("bad port"));
+  for (size_t i = 0; i != num_link_specs; ++i)
+    FAIL_IF_NOT(parse_devices(link_specs[i], link_devices, 1,
+                              num_receivers), ;);
+  for (size_t i = 0; i != num_disk_specs; ++i)
+    FAIL_IF_NOT(parse_devices(disk_specs[i], disks, 0, num_receivers), ;);
+
+  err = getaddrinfo(host, NULL, &hints, &address);
+  FAIL_IF_NOT(err == 0, GAI_PERROR1("failed to resolve", host, err));
+  FAIL_IF_NOT(
+      (address->ai_family == AF_INET &&
+       ntohl(((struct sockaddr_in *)address->ai_addr)->sin_addr.s_addr) >>
+           24 != 127) ||
+      (address->ai_family == AF_INET6 &&
+       !IN6_IS_ADDR_LOOPBACK(
+           &((struct sockaddr_in6 *)address->ai_addr)->sin6_addr)),
+      fprintf(stderr, "%s is a loopback address, please give another "
+              "with -H\n", host));
+
+  // Node i listens on port + 2i for link i+1, which listens on port + 2i+1.
+  for (size_t i = 0; i <= num_receivers; ++i) {
+    struct node *node = &nodes[i];
+    *node = (struct node) {
+      .disk = disks[i], .buffer_size = buffer_size, .block_size = block_size,
+      .size = stream_size, .index = i, .trace = (trace_filename != NULL),
+      .state = EMPTY_STATE, .stats = EMPTY_STATS
+    };
+    node->state.stats = &node->stats;
+    node->state.busy_poll_ns = busy_poll_us * 1000;
+    if (i)
+      snprintf(node->reader_spec, sizeof(node->reader_spec), "%s:%zu", host,
+               port + 2*i - 1);
+    if (i != num_receivers)
+      snprintf(node->writer_spec, sizeof(node->writer_spec), "%s:%zu", host,
+               port + 2*i);
+  }
+
+  for (size_t i = 1; i <= num_receivers; ++i, ++num_links) {
+    struct link *link = &links[i];
+    link->device = link_devices[i];
+    link->address = address;
+    link->port = port + 2*i - 2;
+    link->ok = true;
+    FAIL_IF_NOT(SYSCALL(link->listen_fd = listen_on(address,
+                                                    port + 2*i - 1)), ;);
+    FAIL_IF_NOT(pthread_create(&link->thread, NULL, relay, link) == 0,
+                ERROR("failed to start link"));
+  }
+
+  begin_ns = get_time_ns();
+  for (; num_nodes <= num_receivers; ++num_nodes)
+    FAIL_IF_NOT(pthread_create(&nodes[num_nodes].thread, NULL, run_node,
+                               &nodes[num_nodes]) == 0,
+                ERROR("failed to start node"));
+
+#undef FAIL_IF_NOT
+
+cleanup:
+  for (size_t i = 0; i != num_nodes; ++i) {
+    pthread_join(nodes[i].thread, NULL);
+    rv = nodes[i].ok ? rv : 1;
+  }
+  for (size_t i = 1; i <= num_links; ++i) {
+    // A link whose receiver failed before connecting waits in accept().
+    if (rv)
+      shutdown(links[i].listen_fd, SHUT_RDWR);
+    pthread_join(links[i].thread, NULL);
+    rv = links[i].ok ? rv : 1;
+  }
+
+  if (!rv && num_nodes) {
+    uint64_t end_ns = nodes[num_nodes-1].end_ns;
+    printf("%-9s %10s %10s %10s %10s %10s %12s\n", "node", "seconds",
+           "MB/s", "waited%", "underruns", "overruns", "slowdowns");
+    for (size_t i = 0; i != num_nodes; ++i) {
+      struct node *node = &nodes[i];
+      const struct stats *stats = &node->stats;
+      double seconds = (node->end_ns - node->begin_ns) / 1e9;
+      end_ns = node->end_ns > end_ns ? node->end_ns : end_ns;
+      printf("%-9zu %10.3f %10.1f %10.1f %10"PRIu64" %10"PRIu64, i, seconds,
+             stream_size / seconds / 1e6,
+             stats->total_cycles ?
+                 100.0 * stats->waited_cycles / stats->total_cycles : 0.0,
+             stats->buffer_underruns, stats->buffer_overruns);
+      for (size_t j = 0; j != node->state.num_consumers; ++j)
+        printf(" %s=%"PRIu64, CALL0(node->state.consumers[j], name),
+               stats->consumer_slowdowns[j]);
+      printf("\n");
+
+      if (stats_prefix) {
+        char filename[4096];
+        snprintf(filename, sizeof(filename), "%s.%zu", stats_prefix, i);
+        CHECK(dump_stats(&node->state, filename),
+              ERROR("failed to dump stats"), rv = 1);
+      }
+    }
+    printf("end to end: %.3f s, %.1f MB/s over %zu hops\n",
+           (end_ns - begin_ns) / 1e9,
+           stream_size / ((end_ns - begin_ns) / 1e9) / 1e6, num_links);
+  }
+
+  if (trace_filename) {
+    CHECK(dump_trace(trace_filename), ERROR("failed to dump trace"), rv = 1);
+    stop_tracing();
+  }
+
+  for (size_t i = 0; i != num_nodes; ++i)
+    destroy_node(&nodes[i]);
+  if (address)
+    freeaddrinfo(address);
+  return rv;
+}
@@ -1,58 +1,501 @@
+#include "cache.h"
 #include "defaults.h"
+#include "extent.h"
 #include "macro.h"
+#include "placement.h"
+#include "report.h"
+#include "secure.h"
 #include "socket.h"
+#include "stats.h"
 #include "struct.h"
 #include "util.h"
 
 #include <assert.h>
+#include <endian.h>
 #include <errno.h>
+#include <fcntl.h>
 #include <limits.h>
 #include <netdb.h>
+#include <netinet/tcp.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <sys/epoll.h>
 #include <sys/socket.h>
+#include <sys/time.h>
+#include <sys/timerfd.h>
 #include <sys/types.h>
 #include <unistd.h>
 
 #define PORT_MAX_CHARS 5
 
+// Every hop starts with a fixed-size header: magic, version, flags, total
+// size and block size of the stream, the source's identity, the offset in
+// the source the stream starts at, the offset and size of the image the
+// stream is a stripe of, the number of extents of an incremental stream and
+// the number of block hashes, all integers in network byte order. The
+// offsets and lengths of the extents follow the header, then the hashes.
+// The image of a sparse stream has holes between its extents.
+// The receiver answers the hashes with a bitmap of the blocks it has.
+//
+// A plain stream then comes in frames of up to FETCH_SIZE: an offset and a
+// length, 8 and 4 bytes, and that much data. The stream itself is in the
+// frames at FRAME_STREAM, the others are ranges of it fetched ahead of
+// their turn. Against the stream go messages of a type byte followed by a
+// report, or by the offset and length of a range the next node wants.
+#define HEADER_MAGIC "ndd"
+#define HEADER_VERSION 8
+#define HEADER_SIZE_KNOWN 1
+#define HEADER_ENCRYPTED 2
+#define HEADER_SPARSE 4
+#define HEADER_FRAMED 8
+#define HEADER_SIZE (4 + 4 + 8 + 8 + SOURCE_MAX_CHARS + 1 + 8 + 8 + 8 + 8 + 8)
+#define EXTENTS_BATCH 256
+#define FRAME_HEADER_SIZE (8 + 4)
+#define FRAME_STREAM UINT64_MAX
+#define MESSAGE_REPORT 1
+#define MESSAGE_FETCH 2
+#define REPORT_MESSAGE_SIZE (1 + REPORT_SIZE)
+#define FETCH_MESSAGE_SIZE (1 + 8 + 8)
+
 #define CHECK_OR_WARN(value, msg, act) \
   CHECK(SYSCALL(value), \
         PERROR1("warning: " msg " failed for one of addresses for", \
                 this->host), \
         act)
 
+// A low watermark given without a value is tied to the block size.
+#define LOWAT_BLOCK ((size_t)-1)
+
+// Refused attempts are retried, the ones which failed otherwise are not.
+struct attempt {
+  const struct addrinfo *ai;
+  int sock;
+  bool refused;
+};
+
+// A fetched range queued by a writer, with the header of its frame.
+struct frame {
+  struct frame *next;
+  size_t size;
+  size_t sent;
+  char data[];
+};
+
+// What TCP_INFO showed the last time it was looked at, and the worst RTT.
+struct tcp_sample {
+  uint64_t sampled_at;
+  uint32_t rtt_us;
+  uint32_t rttvar_us;
+  uint32_t max_rtt_us;
+  uint32_t cwnd;
+  uint32_t retransmits;
+};
+
 struct data {
   int sock;
   int client_sock;
 
+  // A reader connects to all addresses of the host at once, the attempts
+  // and the retry timer are watched through setup_fd.
+  struct addrinfo *addresses;
+  struct attempt attempts[MAX_CONNECT_ADDRESSES];
+  size_t num_attempts;
+  int setup_fd;
+  int timer_fd;
+  uint64_t deadline;
+  uint64_t retry_at;
+  uint64_t retry_delay;
+  unsigned int seed;
+
+  struct stream_info info;
+  uint64_t received;
+  // Extents of an incremental stream a reader received.
+  struct extent *extents;
+  // Hashes of the blocks a reader received, and the bitmap of the blocks
+  // which the receiver has in its cache. The writer passes over those, and
+  // the reader fills them from the cache, where it keeps the others.
+  unsigned char *hashes;
+  unsigned char *cached;
+  const char *cache_dir;
+  struct cache *cache;
+  char *block;
+  uint64_t sent;
+  uint64_t cache_hits;
+  uint64_t cache_misses;
+  uint64_t cached_bytes;
+  uint64_t deduped_bytes;
+
+  size_t block_size;
+  size_t lo_watermark;
+  // Microseconds the kernel spins on the device queue for a receive.
+  size_t busy_poll;
+
+  // Tuning of the transport for long fat networks: the congestion control,
+  // both socket buffers sized to the bandwidth-delay product before the
+  // window scale is agreed on, and how much unsent data a writer and
+  // received data a reader wait for. Unset ones are left to the kernel.
+  const char *congestion;
+  size_t bdp;
+  size_t notsent_lowat;
+  size_t rcvlowat;
+  struct tcp_sample tcp;
+
+  // Set when the stream is encrypted with a pre-shared key.
+  struct channel *channel;
+  const char *key_file;
+  size_t workers;
+
+  // Reports travel against the stream: a reader sends them to the previous
+  // node until the stream ends, and a writer receives them. So do the
+  // ranges which are wanted ahead of the stream, which a writer takes out
+  // of the messages as they come and watches for on wanted_fd.
+  bool reporting;
+  bool finished;
+  size_t reports_size;
+  char reports[MAX_REPORTS * REPORT_MESSAGE_SIZE];
+  int wanted_fd;
+  bool reverse_ended;
+  size_t num_wanted;
+  struct extent wanted[MAX_FETCHES];
+
+  // Where a plain stream is in its frames: what's left of the current
+  // frame of the stream, and how much of a frame's header went. A writer
+  // sends the fetched ranges it queued between the frames of the stream, a
+  // reader keeps the one it received until it's taken.
+  bool framed;
+  uint64_t frame_left;
+  size_t header_done;
+  char frame_header[FRAME_HEADER_SIZE];
+  struct frame *frames;
+  struct frame **last_frame;
+  uint64_t fetch_offset;
+  size_t fetch_size;
+  size_t fetch_left;
+  bool fetch_ready;
+  char *fetch_buf;
+
+  // A writer with late set keeps listening while the stream runs. Each
+  // receiver which joins gets a writer of its own, which sends the stream
+  // from where it joined and, once it's over, the missed beginning. Its
+  // header is queued and goes out before the stream, so that the others
+  // don't wait for it.
+  bool late;
+  bool joined;
+  char *pending;
+  size_t pending_size;
+  size_t pending_sent;
+  uint64_t missed;
+  uint64_t replayed;
+  bool replaying;
+
   enum { R, S } mode;
   char port[PORT_MAX_CHARS+1];
   char host[];
 };
 
-static bool refused(int rv) {
-  return rv == -1 && errno == ECONNREFUSED;
+static const struct consumer_ops send_ops;
+
+static void encode_header(const struct stream_info *info, uint32_t flags,
+                          char *header) {
+  memcpy(header, HEADER_MAGIC, 3);
+  header[3] = HEADER_VERSION;
+  flags |= info->size_known ? HEADER_SIZE_KNOWN : 0;
+  flags |= info->sparse ? HEADER_SPARSE : 0;
+  flags = htobe32(flags);
+  memcpy(header + 4, &flags, 4);
+  uint64_t size = htobe64(info->size);
+  memcpy(header + 8, &size, 8);
+  uint64_t block_size = htobe64(info->block_size);
+  memcpy(header + 16, &block_size, 8);
+  memcpy(header + 24, info->source, SOURCE_MAX_CHARS + 1);
+  uint64_t origin = htobe64(info->origin);
+  memcpy(header + 25 + SOURCE_MAX_CHARS, &origin, 8);
+  uint64_t base = htobe64(info->base);
+  memcpy(header + 33 + SOURCE_MAX_CHARS, &base, 8);
+  uint64_t image_size = htobe64(info->image_size);
+  memcpy(header + 41 + SOURCE_MAX_CHARS, &image_size, 8);
+  uint64_t num_extents = htobe64(info->num_extents);
+  memcpy(header + 49 + SOURCE_MAX_CHARS, &num_extents, 8);
+  uint64_t num_hashes = htobe64(info->num_hashes);
+  memcpy(header + 57 + SOURCE_MAX_CHARS, &num_hashes, 8);
 }
 
-static int try_connect(struct data *this, struct addrinfo *ai) {
-  int rv = -1;
-  for (size_t i = 0; i != arraysize(CONNECT_BACKOFF); ++i) {
-    // ignore signals
-    sleep(CONNECT_BACKOFF[i]);
+static bool decode_header(const char *header, struct stream_info *info,
+                          uint32_t *flags) {
+  CHECK(memcmp(header, HEADER_MAGIC, 3) == 0,
+        ERROR("received stream doesn't start with ndd header"), return false);
+  CHECK(header[3] == HEADER_VERSION,
+        fprintf(stderr, "unsupported stream version %d, expected %d\n",
+                header[3], HEADER_VERSION),
+        return false);
+  memcpy(flags, header + 4, 4);
+  *flags = be32toh(*flags);
+  info->size_known = *flags & HEADER_SIZE_KNOWN;
+  info->sparse = *flags & HEADER_SPARSE;
+  memcpy(&info->size, header + 8, 8);
+  info->size = be64toh(info->size);
+  memcpy(&info->block_size, header + 16, 8);
+  info->block_size = be64toh(info->block_size);
+  memcpy(info->source, header + 24, SOURCE_MAX_CHARS + 1);
+  info->source[SOURCE_MAX_CHARS] = 0;
+  memcpy(&info->origin, header + 25 + SOURCE_MAX_CHARS, 8);
+  info->origin = be64toh(info->origin);
+  memcpy(&info->base, header + 33 + SOURCE_MAX_CHARS, 8);
+  info->base = be64toh(info->base);
+  memcpy(&info->image_size, header + 41 + SOURCE_MAX_CHARS, 8);
+  info->image_size = be64toh(info->image_size);
+  uint64_t num_extents;
+  memcpy(&num_extents, header + 49 + SOURCE_MAX_CHARS, 8);
+  num_extents = be64toh(num_extents);
+  CHECK(num_extents <= MAX_EXTENTS,
+        fprintf(stderr, "stream has %"PRIu64" extents, at most %d expected\n",
+                num_extents, MAX_EXTENTS),
+        return false);
+  info->extents = NULL;
+  info->num_extents = num_extents;
+  uint64_t num_hashes;
+  memcpy(&num_hashes, header + 57 + SOURCE_MAX_CHARS, 8);
+  num_hashes = be64toh(num_hashes);
+  CHECK(num_hashes <= MAX_HASHES,
+        fprintf(stderr, "stream has %"PRIu64" hashes, at most %d expected\n",
+                num_hashes, MAX_HASHES),
+        return false);
+  info->hashes = NULL;
+  info->num_hashes = num_hashes;
+  return true;
+}
 
-    rv = connect(this->sock, ai->ai_addr, ai->ai_addrlen);
+static int get_sock(const struct data *this) {
+  return (this->mode == R) ? this->sock : this->client_sock;
+}
 
-    if (refused(rv))
-      continue;
-    CHECK_OR_WARN(rv, "connect()", ;);
-    return rv;
+static bool receive_all(struct data *this, void *buf, size_t size) {
+  ssize_t rv = recv(get_sock(this), buf, size, MSG_WAITALL);
+  CHECK(SYSCALL(rv), PERROR1("failed to receive header from", this->host),
+        return false);
+  CHECK((size_t)rv == size,
+        fprintf(stderr, "connection closed before header from %s\n",
+                this->host),
+        return false);
+  return true;
+}
+
+static bool queue_header(struct data *this, const void *buf, size_t size) {
+  if (this->channel)
+    return queue_channel_header(this->channel, buf, size);
+  char *pending = realloc(this->pending, this->pending_size + size);
+  CHECK(pending, ERROR("can't allocate memory for header"), return false);
+  memcpy(pending + this->pending_size, buf, size);
+  this->pending = pending;
+  this->pending_size += size;
+  return true;
+}
+
+// Returns 1 once the queued header is all sent, 0 if the socket is full.
+static int send_pending(struct data *this, int flags) {
+  while (this->pending_sent != this->pending_size) {
+    ssize_t rv = send(this->client_sock, this->pending + this->pending_sent,
+                      this->pending_size - this->pending_sent, flags);
+    if (would_block(rv))
+      return 0;
+    CHECK(SYSCALL(rv), PERROR1("failed to send header to", this->host),
+          return -1);
+    this->pending_sent += rv;
   }
+  return 1;
+}
 
-  CHECK_OR_WARN(rv, "connect()", ;);
-  return rv;
+static bool send_all(struct data *this, const void *buf, size_t size) {
+  if (this->joined)
+    return queue_header(this, buf, size);
+  for (size_t sent = 0; sent != size;) {
+    ssize_t rv = send(get_sock(this), (const char *)buf + sent,
+                      size - sent, 0);
+    CHECK(SYSCALL(rv), PERROR1("failed to send header to", this->host),
+          return false);
+    sent += rv;
+  }
+  return true;
+}
+
+// What comes before an encrypted stream is authenticated by its channel.
+static bool receive_signed(struct data *this, void *buf, size_t size) {
+  return receive_all(this, buf, size) &&
+      (!this->channel || add_channel_header(this->channel, buf, size));
+}
+
+static bool send_signed(struct data *this, const void *buf, size_t size) {
+  return send_all(this, buf, size) &&
+      (!this->channel || add_channel_header(this->channel, buf, size));
+}
+
+static_assert(sizeof(struct extent) == 2 * sizeof(uint64_t),
+              "can't send extents on this platform");
+
+static bool receive_extents(struct data *this) {
+  size_t num = this->info.num_extents;
+  if (!num)
+    return true;
+  this->extents = malloc(num * sizeof(struct extent));
+  CHECK(this->extents, ERROR("can't allocate memory for extents"),
+        return false);
+  uint64_t *raw = (uint64_t *)this->extents;
+  if (!receive_signed(this, raw, num * sizeof(struct extent)))
+    return false;
+  for (size_t i = 0; i != 2 * num; ++i)
+    raw[i] = be64toh(raw[i]);
+  // They're checked before anything is written to them.
+  CHECK(this->info.size_known &&
+        check_extents(this->extents, num, this->info.image_size,
+                      this->info.size),
+        fprintf(stderr, "bad extents of stream from %s\n", this->host),
+        return false);
+  this->info.extents = this->extents;
+  return true;
+}
+
+static bool send_extents(struct data *this, const struct stream_info *info) {
+  uint64_t batch[2 * EXTENTS_BATCH];
+  for (size_t i = 0; i != info->num_extents;) {
+    size_t num = 0;
+    for (; num != EXTENTS_BATCH && i != info->num_extents; ++num, ++i) {
+      batch[2 * num] = htobe64(info->extents[i].offset);
+      batch[2 * num + 1] = htobe64(info->extents[i].length);
+    }
+    if (!send_signed(this, batch, num * sizeof(struct extent)))
+      return false;
+  }
+  return true;
+}
+
+static size_t get_bitmap_size(size_t num_hashes) {
+  return (num_hashes + CHAR_BIT - 1) / CHAR_BIT;
+}
+
+static bool is_cached(const struct data *this, size_t block) {
+  return this->cached[block / CHAR_BIT] & (1 << (block % CHAR_BIT));
+}
+
+// The stream's length in blocks of CACHE_BLOCK_SIZE, of which the last one
+// may be short.
+static size_t get_cache_block_length(const struct data *this, size_t block) {
+  uint64_t left = this->info.size - (uint64_t)block * CACHE_BLOCK_SIZE;
+  return (left < CACHE_BLOCK_SIZE) ? left : CACHE_BLOCK_SIZE;
+}
+
+static bool receive_hashes(struct data *this) {
+  size_t num = this->info.num_hashes;
+  if (!num)
+    return true;
+  CHECK(this->info.size_known && !this->info.origin &&
+        num == (this->info.size + CACHE_BLOCK_SIZE - 1) / CACHE_BLOCK_SIZE,
+        fprintf(stderr, "stream from %s has %zu hashes for %"PRIu64" bytes\n",
+                this->host, num, this->info.size),
+        return false);
+  this->hashes = malloc(num * BLOCK_HASH_SIZE);
+  CHECK(this->hashes, ERROR("can't allocate memory for hashes"),
+        return false);
+  if (!receive_signed(this, this->hashes, num * BLOCK_HASH_SIZE))
+    return false;
+  this->info.hashes = this->hashes;
+  return true;
+}
+
+static bool send_hashes(struct data *this, const struct stream_info *info) {
+  return !info->num_hashes ||
+      send_signed(this, info->hashes, info->num_hashes * BLOCK_HASH_SIZE);
+}
+
+// A reader without a cache has none of the blocks, and one with a cache
+// only has the blocks which are intact there. Checking them takes a while,
+// so it's left until the header went on down the chain, for the hops to
+// check their caches all at once: the reader tells the blocks on its first
+// produce(), and the writer learns them on its first consume(). Messages
+// only go after them.
+static bool is_cached_pending(const struct data *this) {
+  return !this->cached && this->info.num_hashes;
+}
+
+static bool send_cached(struct data *this) {
+  size_t num = this->info.num_hashes;
+  if (!num)
+    return true;
+  this->cached = calloc(get_bitmap_size(num), 1);
+  CHECK(this->cached, ERROR("can't allocate memory for cached blocks"),
+        return false);
+  for (size_t i = 0; this->cache && i != num; ++i)
+    if (cache_has(this->cache, this->hashes + i * BLOCK_HASH_SIZE))
+      this->cached[i / CHAR_BIT] |= 1 << (i % CHAR_BIT);
+  return send_all(this, this->cached, get_bitmap_size(num));
+}
+
+static bool receive_cached(struct data *this) {
+  size_t num = this->info.num_hashes;
+  if (!num)
+    return true;
+  this->cached = malloc(get_bitmap_size(num));
+  CHECK(this->cached, ERROR("can't allocate memory for cached blocks"),
+        return false);
+  return receive_all(this, this->cached, get_bitmap_size(num));
+}
+
+// The header is followed by the extents of an incremental stream and the
+// hashes of the blocks, and an encrypted stream's by the salt the session
+// key is derived from and the MAC of all of it, which is checked before
+// the header is acted on.
+static bool receive_header(struct data *this) {
+  char header[HEADER_SIZE];
+  uint32_t flags;
+  if (!receive_signed(this, header, HEADER_SIZE) ||
+      !decode_header(header, &this->info, &flags) ||
+      !receive_extents(this) || !receive_hashes(this))
+    return false;
+
+  CHECK(!(flags & HEADER_ENCRYPTED) == !this->channel,
+        fprintf(stderr, "stream from %s is %s, but %s key was given\n",
+                this->host, (flags & HEADER_ENCRYPTED) ? "encrypted" : "plain",
+                this->channel ? "a" : "no"),
+        return false);
+  this->framed = !this->channel && (flags & HEADER_FRAMED);
+  if (!this->channel)
+    return true;
+
+  unsigned char salt[SALT_SIZE];
+  unsigned char mac[HEADER_MAC_SIZE];
+  return receive_signed(this, salt, SALT_SIZE) &&
+      set_channel_salt(this->channel, salt) &&
+      receive_all(this, mac, HEADER_MAC_SIZE) &&
+      check_channel_header_mac(this->channel, mac);
+}
+
+static bool send_header(struct data *this, const struct stream_info *info) {
+  char header[HEADER_SIZE];
+  encode_header(info, this->channel ? HEADER_ENCRYPTED : HEADER_FRAMED,
+                header);
+  if (!send_signed(this, header, HEADER_SIZE) || !send_extents(this, info) ||
+      !send_hashes(this, info))
+    return false;
+  if (!this->channel)
+    return true;
+
+  unsigned char mac[HEADER_MAC_SIZE];
+  return send_signed(this, get_channel_salt(this->channel), SALT_SIZE) &&
+      get_channel_header_mac(this->channel, mac) &&
+      send_all(this, mac, HEADER_MAC_SIZE);
+}
+
+static bool check_size(struct data *this) {
+  CHECK(!this->info.size_known || this->received == this->info.size,
+        fprintf(stderr, "received %"PRIu64" bytes from %s, "
+                "expected %"PRIu64"\n",
+                this->received, this->host, this->info.size),
+        return false);
+  return true;
+}
+
+static bool refused(int rv) {
+  return rv == -1 && errno == ECONNREFUSED;
 }
 
 static struct addrinfo get_hints(int mode) {
@@ -103,52 +546,126 @@ static bool is_localhost(const struct addrinfo *ai) {
   }
 }
 
-static bool init(void *data, size_t block_size) {
-  GET(struct data, this, data);
+// Forcing the size past the limit of the system takes CAP_NET_ADMIN,
+// without it the size is capped.
+static bool set_buffer(int sock, int force, int option, size_t size) {
+  const int optvalue = size;
+  return SYSCALL(setsockopt(sock, SOL_SOCKET, force, &optvalue,
+                            sizeof(optvalue))) ||
+      SYSCALL(setsockopt(sock, SOL_SOCKET, option, &optvalue,
+                         sizeof(optvalue)));
+}
 
-  bool retval = true;
+// Set on the sockets which connect or listen, and inherited by the ones
+// which are accepted.
+static bool tune(struct data *this, int sock) {
+  if (this->congestion)
+    CHECK_OR_WARN(setsockopt(sock, IPPROTO_TCP, TCP_CONGESTION,
+                             this->congestion, strlen(this->congestion)),
+                  "setsockopt(TCP_CONGESTION)", return false);
+  if (this->bdp)
+    CHECK(set_buffer(sock, SO_SNDBUFFORCE, SO_SNDBUF, this->bdp) &&
+          set_buffer(sock, SO_RCVBUFFORCE, SO_RCVBUF, this->bdp),
+          PERROR1("warning: failed to size socket buffers for", this->host),
+          ;);
+  return true;
+}
 
-  struct addrinfo hints = get_hints(this->mode);
-  struct addrinfo *result;
+static void close_attempt(struct data *this, struct attempt *attempt) {
+  COND_CHECK(attempt->sock, -1, SYSCALL(close(attempt->sock)),
+             PERROR1("warning: close() failed for one of addresses for",
+                     this->host));
+}
 
-  int gai_rv = -1;
-  CHECK((gai_rv = getaddrinfo(strlen(this->host) ? this->host : NULL, this->port,
-                              &hints, &result)) == 0,
-        GAI_PERROR1("getaddrinfo() failed for", this->host, gai_rv),
-        return false);
+// Connecting never blocks: the attempt is watched by the setup fd until
+// the connection is established or refused.
+static void start_attempt(struct data *this, struct attempt *attempt) {
+  const struct addrinfo *ai = attempt->ai;
+  attempt->refused = false;
+  CHECK_OR_WARN(attempt->sock = socket(ai->ai_family,
+                                       ai->ai_socktype | SOCK_NONBLOCK,
+                                       ai->ai_protocol),
+                "socket()", return);
+  if (!tune(this, attempt->sock)) {
+    close_attempt(this, attempt);
+    return;
+  }
+
+  int rv = connect(attempt->sock, ai->ai_addr, ai->ai_addrlen);
+  if (rv == -1 && errno == EINPROGRESS)
+    rv = 0;
+  if (refused(rv)) {
+    attempt->refused = true;
+    close_attempt(this, attempt);
+    return;
+  }
+  CHECK_OR_WARN(rv, "connect()", close_attempt(this, attempt); return);
+
+  struct epoll_event ev = { .events = EPOLLOUT, .data.ptr = attempt };
+  CHECK_OR_WARN(epoll_ctl(this->setup_fd, EPOLL_CTL_ADD, attempt->sock, &ev),
+                "epoll_ctl()", close_attempt(this, attempt));
+}
+
+static void stop_connecting(struct data *this) {
+  for (size_t i = 0; i != this->num_attempts; ++i)
+    close_attempt(this, &this->attempts[i]);
+  this->num_attempts = 0;
+  COND_CHECK(this->timer_fd, -1, SYSCALL(close(this->timer_fd)),
+             PERROR1("failed to close timer for", this->host));
+  COND_CHECK(this->setup_fd, -1, SYSCALL(close(this->setup_fd)),
+             PERROR1("failed to close epoll fd for", this->host));
+  if (this->addresses)
+    freeaddrinfo(this->addresses);
+  this->addresses = NULL;
+}
 
-  for (struct addrinfo *i = result; i != NULL; i = i->ai_next) {
+// All addresses of the host are tried at once, the first one to connect
+// wins.
+static bool start_connecting(struct data *this) {
+  CHECK(SYSCALL(this->setup_fd = epoll_create(1)),
+        PERROR1("epoll_create() failed for", this->host), return false);
+  CHECK(SYSCALL(this->timer_fd = timerfd_create(CLOCK_MONOTONIC,
+                                                TFD_NONBLOCK)),
+        PERROR1("timerfd_create() failed for", this->host), return false);
+  struct epoll_event ev = { .events = EPOLLIN, .data.ptr = NULL };
+  CHECK(SYSCALL(epoll_ctl(this->setup_fd, EPOLL_CTL_ADD, this->timer_fd, &ev)),
+        PERROR1("epoll_ctl() failed for", this->host), return false);
+
+  for (struct addrinfo *i = this->addresses;
+       i != NULL && this->num_attempts != MAX_CONNECT_ADDRESSES;
+       i = i->ai_next) {
     if (is_localhost(i))
       continue;
+    struct attempt *attempt = &this->attempts[this->num_attempts++];
+    attempt->ai = i;
+    attempt->sock = -1;
+    start_attempt(this, attempt);
+  }
 
-    CHECK_OR_WARN(
-        (this->sock = socket(i->ai_family, i->ai_socktype, i->ai_protocol)),
-        "socket()", ;);
-    if (this->mode == S) {
-        int reuse = 1;
-        CHECK_OR_WARN(setsockopt(this->sock, SOL_SOCKET, SO_REUSEADDR,
-                                 &reuse, sizeof(reuse)),
-                      "setsockopt(SO_REUSEADDR)", goto end);
-    }
+  this->deadline = get_time_ns() + CONNECT_TIMEOUT_MS * 1000000ULL;
+  this->retry_delay = CONNECT_RETRY_MIN_MS * 1000000ULL;
+  this->seed = getpid() ^ get_time_ns();
+  return true;
+}
 
-    if (this->sock == -1)
+static bool start_listening(struct data *this) {
+  for (struct addrinfo *i = this->addresses; i != NULL; i = i->ai_next) {
+    if (is_localhost(i))
       continue;
 
-    int rv = -1;
-    switch (this->mode) {
-      case R:
-        rv = try_connect(this, i);
-        break;
-      case S:
-        CHECK_OR_WARN(rv = bind(this->sock, i->ai_addr, i->ai_addrlen),
-                      "bind()", goto end);
-        break;
-      default:
-        assert(0);
-    }
-
-    if (rv != -1)
-      break;
+    CHECK_OR_WARN(
+        (this->sock = socket(i->ai_family, i->ai_socktype | SOCK_NONBLOCK,
+                             i->ai_protocol)),
+        "socket()", continue);
+    int reuse = 1;
+    CHECK_OR_WARN(setsockopt(this->sock, SOL_SOCKET, SO_REUSEADDR,
+                             &reuse, sizeof(reuse)),
+                  "setsockopt(SO_REUSEADDR)", goto end);
+    if (!tune(this, this->sock))
+      goto end;
+    CHECK_OR_WARN(bind(this->sock, i->ai_addr, i->ai_addrlen),
+                  "bind()", goto end);
+    break;
 
 end:
     COND_CHECK(this->sock, -1, SYSCALL(close(this->sock)),
@@ -156,30 +673,220 @@ end:
                        this->host));
   }
 
+  freeaddrinfo(this->addresses);
+  this->addresses = NULL;
+
   CHECK(this->sock != -1,
         fprintf(stderr, "failed to initialize connection for %s\n", this->host),
-        GOTO_WITH(cleanup, retval, false));
+        return false);
+  CHECK(SYSCALL(listen(this->sock, this->late ? MAX_CONSUMERS : 1)),
+        PERROR1("listen() failed for", this->host), return false);
+  return true;
+}
 
-  if (this->mode == S) {
-    CHECK(SYSCALL(listen(this->sock, 1)),
-          PERROR1("listen() failed for", this->host),
-          GOTO_WITH(cleanup, retval, false));
+static bool init(void *data, size_t block_size) {
+  GET(struct data, this, data);
+  if (!this->block_size)
+    this->block_size = block_size;
+  if (this->lo_watermark > this->block_size)
+    this->lo_watermark = this->block_size;
+  CHECK(this->block_size <= INT_MAX, ERROR("too big block size"),
+        return false);
+  // The engine offers a writer at least the low watermark, so the kernel
+  // wakes it up once it has room for that much.
+  if (this->notsent_lowat == LOWAT_BLOCK)
+    this->notsent_lowat = this->lo_watermark ? this->lo_watermark
+                                             : this->block_size;
+  if (this->rcvlowat == LOWAT_BLOCK)
+    this->rcvlowat = this->block_size;
 
-    CHECK(SYSCALL(this->client_sock = accept(this->sock, NULL, NULL)),
-          PERROR1("accept() failed for", this->host),
-          GOTO_WITH(cleanup, retval, false));
+  // Blocks are filled from the cache on the reader's side of the channel.
+  if (this->cache_dir) {
+    CHECK(!this->key_file,
+          fprintf(stderr, "cache can't be used with key for %s\n",
+                  this->host),
+          return false);
+    if (!open_cache(this->cache_dir, &this->cache))
+      return false;
+    CHECK(!this->cache || (this->block = malloc(CACHE_BLOCK_SIZE)),
+          ERROR("can't allocate memory for cache block"), return false);
   }
 
-  CHECK(block_size <= INT_MAX, ERROR("too big block size"), goto cleanup);
-  const int optvalue = block_size;
-  CHECK_OR_WARN(setsockopt(this->mode == S ? this->client_sock : this->sock,
-                           SOL_SOCKET,
-                           this->mode == S ? SO_SNDBUFFORCE : SO_RCVBUFFORCE,
-                           &optvalue, sizeof(optvalue)),
-                "setsockopt(*_BUFFORCE)", ;);
-cleanup:
-  freeaddrinfo(result);
-  return retval;
+  struct addrinfo hints = get_hints(this->mode);
+  int gai_rv = -1;
+  CHECK((gai_rv = getaddrinfo(strlen(this->host) ? this->host : NULL,
+                              this->port, &hints, &this->addresses)) == 0,
+        GAI_PERROR1("getaddrinfo() failed for", this->host, gai_rv),
+        return false);
+
+  return (this->mode == R) ? start_connecting(this) : start_listening(this);
+}
+
+// Once connected, the socket blocks again, the stream itself is moved
+// with MSG_DONTWAIT.
+static bool established(struct data *this) {
+  int sock = (this->mode == S) ? this->client_sock : this->sock;
+  int flags = fcntl(sock, F_GETFL);
+  CHECK(SYSCALL(flags) &&
+        SYSCALL(fcntl(sock, F_SETFL, flags & ~O_NONBLOCK)),
+        PERROR1("fcntl() failed for", this->host), return false);
+
+  if (!this->bdp) {
+    const int optvalue = this->block_size;
+    CHECK_OR_WARN(setsockopt(sock, SOL_SOCKET,
+                             this->mode == S ? SO_SNDBUFFORCE : SO_RCVBUFFORCE,
+                             &optvalue, sizeof(optvalue)),
+                  "setsockopt(*_BUFFORCE)", ;);
+  }
+  if (this->notsent_lowat) {
+    const int optvalue = this->notsent_lowat;
+    CHECK_OR_WARN(setsockopt(sock, IPPROTO_TCP, TCP_NOTSENT_LOWAT,
+                             &optvalue, sizeof(optvalue)),
+                  "setsockopt(TCP_NOTSENT_LOWAT)", ;);
+  }
+  // The sender can't get more than about half the buffer in flight, so a
+  // reader which waited for more would never wake up.
+  if (this->rcvlowat) {
+    int buffer = 0;
+    socklen_t len = sizeof(buffer);
+    CHECK_OR_WARN(getsockopt(sock, SOL_SOCKET, SO_RCVBUF, &buffer, &len),
+                  "getsockopt(SO_RCVBUF)", ;);
+    const int optvalue = (this->rcvlowat < (size_t)buffer / 4) ?
+        this->rcvlowat : buffer / 4;
+    if (optvalue > 1)
+      CHECK_OR_WARN(setsockopt(sock, SOL_SOCKET, SO_RCVLOWAT,
+                               &optvalue, sizeof(optvalue)),
+                    "setsockopt(SO_RCVLOWAT)", ;);
+  }
+  if (this->busy_poll) {
+    const int usec = this->busy_poll;
+    CHECK_OR_WARN(setsockopt(sock, SOL_SOCKET, SO_BUSY_POLL,
+                             &usec, sizeof(usec)),
+                  "setsockopt(SO_BUSY_POLL)", ;);
+  }
+
+  if (this->key_file) {
+    CHECK(this->channel = create_channel(this->key_file, this->workers,
+                                         this->block_size, this->mode == S),
+          ;, return false);
+    CHECK(attach_channel(this->channel, sock), ;, return false);
+  }
+  return true;
+}
+
+// Refused attempts are retried together after a delay which grows, and
+// is jittered so that the nodes of a chain don't retry in lockstep.
+static void schedule_retry(struct data *this) {
+  if (this->retry_at)
+    return;
+  uint64_t delay = this->retry_delay / 2 +
+      (uint64_t)rand_r(&this->seed) % this->retry_delay;
+  this->retry_at = get_time_ns() + delay;
+  if (this->retry_delay < CONNECT_RETRY_MAX_MS * 1000000ULL)
+    this->retry_delay *= 2;
+}
+
+static bool arm_timer(struct data *this) {
+  uint64_t at = this->deadline;
+  if (this->retry_at && this->retry_at < at)
+    at = this->retry_at;
+  struct itimerspec spec = {
+    .it_value = { at / 1000000000, at % 1000000000 }
+  };
+  CHECK(SYSCALL(timerfd_settime(this->timer_fd, TFD_TIMER_ABSTIME, &spec,
+                                NULL)),
+        PERROR1("timerfd_settime() failed for", this->host), return false);
+  return true;
+}
+
+static int connect_step(struct data *this) {
+  struct epoll_event events[1+MAX_CONNECT_ADDRESSES];
+  int num_events = epoll_wait(this->setup_fd, events, arraysize(events), 0);
+  if (num_events == -1 && errno == EINTR)
+    num_events = 0;
+  CHECK(SYSCALL(num_events), PERROR1("epoll_wait() failed for", this->host),
+        return -1);
+
+  for (int i = 0; i != num_events; ++i) {
+    struct attempt *attempt = events[i].data.ptr;
+    if (!attempt) {
+      uint64_t expirations;
+      CHECK(read(this->timer_fd, &expirations, sizeof(expirations)) != -1 ||
+            errno == EAGAIN,
+            PERROR1("failed to read timer for", this->host), return -1);
+      continue;
+    }
+
+    int error = 0;
+    socklen_t len = sizeof(error);
+    if (getsockopt(attempt->sock, SOL_SOCKET, SO_ERROR, &error, &len) == -1)
+      error = errno;
+    if (error == 0) {
+      this->sock = attempt->sock;
+      attempt->sock = -1;
+      stop_connecting(this);
+      return established(this) ? 1 : -1;
+    }
+
+    attempt->refused = (error == ECONNREFUSED);
+    if (!attempt->refused) {
+      errno = error;
+      PERROR1("warning: connect() failed for one of addresses for",
+              this->host);
+    }
+    close_attempt(this, attempt);
+  }
+
+  uint64_t now = get_time_ns();
+  if (this->retry_at && now >= this->retry_at) {
+    this->retry_at = 0;
+    for (size_t i = 0; i != this->num_attempts; ++i)
+      if (this->attempts[i].refused)
+        start_attempt(this, &this->attempts[i]);
+  }
+
+  bool connecting = false;
+  bool retrying = false;
+  for (size_t i = 0; i != this->num_attempts; ++i) {
+    connecting |= this->attempts[i].sock != -1;
+    retrying |= this->attempts[i].refused;
+  }
+  CHECK(connecting || retrying,
+        fprintf(stderr, "failed to connect to %s\n", this->host), return -1);
+  CHECK(now < this->deadline,
+        fprintf(stderr, "timed out connecting to %s\n", this->host),
+        return -1);
+
+  if (retrying)
+    schedule_retry(this);
+  return arm_timer(this) ? 0 : -1;
+}
+
+static int accept_step(struct data *this) {
+  this->client_sock = accept(this->sock, NULL, NULL);
+  if (would_block(this->client_sock))
+    return 0;
+  CHECK(SYSCALL(this->client_sock),
+        PERROR1("accept() failed for", this->host), return -1);
+  return established(this) ? 1 : -1;
+}
+
+static int setup(void *data, int *fd) {
+  GET(struct data, this, data);
+  int rv = -1;
+  switch (this->mode) {
+    case R:
+      rv = connect_step(this);
+      *fd = this->setup_fd;
+      break;
+    case S:
+      rv = accept_step(this);
+      *fd = this->sock;
+      break;
+    default:
+      assert(0);
+  }
+  return rv;
 }
 
 static const char *name(void *data) {
@@ -187,8 +894,24 @@ static const char *name(void *data) {
   return this->host;
 }
 
+// Closing the socket with reports unread would reset the connection, and
+// the next node could lose the end of the stream. So they are drained until
+// the next node has seen the end.
+static void drain_reports(struct data *this) {
+  struct timeval timeout = {DRAIN_TIMEOUT_MS / 1000, 0};
+  CHECK_OR_WARN(setsockopt(this->client_sock, SOL_SOCKET, SO_RCVTIMEO,
+                           &timeout, sizeof(timeout)),
+                "setsockopt(SO_RCVTIMEO)", return);
+  while (recv(this->client_sock, this->reports, sizeof(this->reports), 0) > 0)
+    ;
+}
+
 static void destroy(void *data) {
   GET(struct data, this, data);
+  stop_connecting(this);
+  destroy_channel(this->channel);
+  if (this->mode == S && this->finished)
+    drain_reports(this);
   if (this->mode == S)
     COND_CHECK(
         this->client_sock, -1,
@@ -196,36 +919,630 @@ static void destroy(void *data) {
         PERROR1("failed to close client socket for", this->host));
   COND_CHECK(this->sock, -1, SYSCALL(close(this->sock)),
              PERROR1("failed to close socket for", this->host));
+  COND_CHECK(this->wanted_fd, -1, SYSCALL(close(this->wanted_fd)),
+             PERROR1("failed to close socket for", this->host));
+  while (this->frames) {
+    struct frame *frame = this->frames;
+    this->frames = frame->next;
+    free(frame);
+  }
+  free(this->fetch_buf);
+  close_cache(this->cache);
+  free(this->block);
+  free(this->cached);
+  free(this->hashes);
+  free(this->extents);
+  free(this->pending);
   free(data);
 }
 
+// The header only comes once the whole chain upstream is set up.
+static bool get_info(void *data, struct stream_info *info) {
+  GET(struct data, this, data);
+  if (!receive_header(this))
+    return false;
+  *info = this->info;
+  return true;
+}
+
+// A receiver which joins late gets the stream from elsewhere than its
+// beginning, so it isn't told the hashes of the blocks.
+static bool start(void *data, const struct stream_info *info) {
+  GET(struct data, this, data);
+  this->info = *info;
+  if (this->joined) {
+    this->missed = info->origin;
+    this->info.hashes = NULL;
+    this->info.num_hashes = 0;
+  }
+  // The ranges wanted by the next node are watched apart from the stream.
+  this->framed = !this->channel;
+  if (this->framed && !this->joined)
+    CHECK(SYSCALL(this->wanted_fd = dup(this->client_sock)),
+          PERROR1("dup() failed for", this->host), return false);
+  return send_header(this, &this->info);
+}
+
+static int get_listen_fd(void *data) {
+  GET(struct data, this, data);
+  return this->late ? this->sock : -1;
+}
+
+// The receiver's connection is set up like the first one, only later.
+static bool accept_joiner(void *data, struct consumer *joiner) {
+  GET(struct data, this, data);
+  int sock = accept(this->sock, NULL, NULL);
+  if (would_block(sock))
+    return true;
+  CHECK(SYSCALL(sock), PERROR1("accept() failed for", this->host),
+        return false);
+
+  struct data *copy = malloc(sizeof(struct data) + strlen(this->host) + 1);
+  CHECK(copy, ERROR("can't allocate memory for late receiver"),
+        close(sock); return false);
+  memcpy(copy, this, sizeof(struct data));
+  strcpy(copy->host, this->host);
+  copy->sock = -1;
+  copy->client_sock = sock;
+  copy->channel = NULL;
+  copy->extents = NULL;
+  copy->hashes = NULL;
+  copy->cached = NULL;
+  copy->cache = NULL;
+  copy->block = NULL;
+  copy->pending = NULL;
+  copy->reports_size = 0;
+  copy->wanted_fd = -1;
+  copy->num_wanted = 0;
+  copy->frame_left = 0;
+  copy->header_done = 0;
+  copy->frames = NULL;
+  copy->last_frame = &copy->frames;
+  copy->fetch_buf = NULL;
+  copy->tcp = (struct tcp_sample) {0};
+  copy->late = false;
+  copy->joined = true;
+
+  if (!established(copy)) {
+    destroy(copy);
+    return false;
+  }
+  *joiner = (struct consumer) {&send_ops, copy};
+  return true;
+}
+
+static uint64_t get_missed(void *data) {
+  GET(struct data, this, data);
+  return this->replaying ? this->missed : 0;
+}
+
 static uint32_t get_epoll_event(void *data) {
   GET(struct data, this, data);
+  if (this->channel)
+    return EPOLLIN;
   return (this->mode == R) ? EPOLLIN : EPOLLOUT;
 }
 
 static int get_fd(void *data) {
   GET(struct data, this, data);
+  if (this->channel)
+    return get_channel_fd(this->channel);
   return (this->mode == R) ? this->sock : this->client_sock;
 }
 
+static size_t get_lo_watermark(void *data) {
+  GET(struct data, this, data);
+  return this->lo_watermark;
+}
+
+static size_t get_block_size(void *data) {
+  GET(struct data, this, data);
+  return this->block_size;
+}
+
+static int get_node(void *data) {
+  GET(struct data, this, data);
+  return get_socket_node((this->mode == R) ? this->sock : this->client_sock);
+}
+
+// Sampled as the stream moves, at most every TCP_INFO_INTERVAL_MS unless
+// forced.
+static void sample_tcp(struct data *this, bool force) {
+  uint64_t now = get_time_ns();
+  if (!force &&
+      now - this->tcp.sampled_at < TCP_INFO_INTERVAL_MS * 1000000ULL)
+    return;
+  int sock = (this->mode == R) ? this->sock : this->client_sock;
+  struct tcp_info info;
+  socklen_t len = sizeof(info);
+  if (sock == -1 ||
+      !SYSCALL(getsockopt(sock, IPPROTO_TCP, TCP_INFO, &info, &len)))
+    return;
+
+  struct tcp_sample *sample = &this->tcp;
+  sample->sampled_at = now;
+  sample->rtt_us = info.tcpi_rtt;
+  sample->rttvar_us = info.tcpi_rttvar;
+  if (info.tcpi_rtt > sample->max_rtt_us)
+    sample->max_rtt_us = info.tcpi_rtt;
+  sample->cwnd = info.tcpi_snd_cwnd;
+  sample->retransmits = info.tcpi_total_retrans;
+}
+
+static size_t get_counters(void *data, struct counter *counters) {
+  GET(struct data, this, data);
+  size_t num = 0;
+#define COUNTER(name, value) \
+  counters[num++] = (struct counter) {name, value}
+  sample_tcp(this, true);
+  if (this->tcp.sampled_at) {
+    COUNTER("rtt_us", this->tcp.rtt_us);
+    COUNTER("rttvar_us", this->tcp.rttvar_us);
+    COUNTER("max_rtt_us", this->tcp.max_rtt_us);
+    COUNTER("cwnd", this->tcp.cwnd);
+    COUNTER("retransmits", this->tcp.retransmits);
+  }
+  if (this->cache) {
+    COUNTER("cache_hits", this->cache_hits);
+    COUNTER("cache_misses", this->cache_misses);
+    COUNTER("cached_bytes", this->cached_bytes);
+  }
+  if (this->mode == S && this->cached)
+    COUNTER("deduped_bytes", this->deduped_bytes);
+#undef COUNTER
+  return num;
+}
+
+// Forwarding goes before local consumers, so that the next hops don't wait.
+static int get_priority(void *data) {
+  return 1;
+}
+
+static void encode_frame_header(uint64_t offset, uint32_t length,
+                                char *header) {
+  offset = htobe64(offset);
+  memcpy(header, &offset, 8);
+  length = htobe32(length);
+  memcpy(header + 8, &length, 4);
+}
+
+// Returns 1 once the queued fetched ranges are all sent, 0 if the socket
+// is full.
+static int send_frames(struct data *this, int flags) {
+  while (this->frames) {
+    struct frame *frame = this->frames;
+    ssize_t rv = send(this->client_sock, frame->data + frame->sent,
+                      frame->size - frame->sent, flags);
+    if (would_block(rv))
+      return 0;
+    CHECK(SYSCALL(rv), PERROR1("send() failed for", this->host), return -1);
+    frame->sent += rv;
+    if (frame->sent != frame->size)
+      continue;
+    this->frames = frame->next;
+    if (!this->frames)
+      this->last_frame = &this->frames;
+    free(frame);
+  }
+  return 1;
+}
+
+// A fetched range goes right away if the stream is between frames, and
+// otherwise once its frame is sent. Receivers which joined late don't get
+// them.
+static bool put_fetched(void *data, const struct fetched *fetched) {
+  GET(struct data, this, data);
+  if (!this->framed || this->joined || this->finished)
+    return true;
+  struct frame *frame = malloc(sizeof(struct frame) + FRAME_HEADER_SIZE +
+                               fetched->size);
+  CHECK(frame, ERROR("can't allocate memory for fetched range"),
+        return false);
+  frame->next = NULL;
+  frame->size = FRAME_HEADER_SIZE + fetched->size;
+  frame->sent = 0;
+  encode_frame_header(fetched->offset, fetched->size, frame->data);
+  memcpy(frame->data + FRAME_HEADER_SIZE, fetched->data, fetched->size);
+  *this->last_frame = frame;
+  this->last_frame = &frame->next;
+  return this->frame_left || send_frames(this, MSG_DONTWAIT) != -1;
+}
+
+// The stream is sent in frames of what's offered, and the header of one
+// goes along with its data.
+static ssize_t send_framed(struct data *this, const void *buf, size_t count) {
+  if (!this->frame_left) {
+    if (count > FETCH_SIZE)
+      count = FETCH_SIZE;
+    encode_frame_header(FRAME_STREAM, count, this->frame_header);
+    this->frame_left = count;
+    this->header_done = 0;
+  }
+  if (count > this->frame_left)
+    count = this->frame_left;
+
+  size_t header_left = FRAME_HEADER_SIZE - this->header_done;
+  struct iovec iov[2] = {
+    { this->frame_header + this->header_done, header_left },
+    { (void *)buf, count },
+  };
+  struct msghdr msg = {
+    .msg_iov = header_left ? iov : iov + 1,
+    .msg_iovlen = header_left ? 2 : 1,
+  };
+  ssize_t rv = sendmsg(this->client_sock, &msg, MSG_DONTWAIT);
+  if (would_block(rv))
+    return 0;
+  CHECK(SYSCALL(rv), PERROR1("send() failed for", this->host), return -1);
+  if ((size_t)rv < header_left) {
+    this->header_done += rv;
+    return 0;
+  }
+  this->header_done = FRAME_HEADER_SIZE;
+  rv -= header_left;
+  this->frame_left -= rv;
+  return rv;
+}
+
+// The next hop sees the end of the stream right away, rather than when
+// this process exits.
+static bool finish(void *data) {
+  GET(struct data, this, data);
+  // The receiver still needs the beginning of the stream.
+  if (this->missed && !this->replaying) {
+    this->replaying = true;
+    return true;
+  }
+  // Receivers which come now would have nothing to join.
+  if (this->late)
+    COND_CHECK(this->sock, -1, SYSCALL(close(this->sock)),
+               PERROR1("failed to close socket for", this->host));
+
+  if (this->channel && !channel_flush(this->channel))
+    return false;
+  if (send_pending(this, 0) == -1 || send_frames(this, 0) == -1)
+    return false;
+  CHECK(SYSCALL(shutdown(this->client_sock, SHUT_WR)),
+        PERROR1("shutdown() failed for", this->host), return false);
+  this->finished = true;
+  return true;
+}
+
+// Once the stream is over, the previous node learns it all arrived from the
+// end of the reports.
+static void end_reports(struct data *this) {
+  if (!this->reporting)
+    return;
+  this->reporting = false;
+  CHECK(SYSCALL(shutdown(this->sock, SHUT_WR)),
+        PERROR1("warning: shutdown() failed for", this->host), ;);
+}
+
+// Messages which don't fit into the socket are kept for the next time.
+static void send_messages(struct data *this) {
+  ssize_t rv = send(this->sock, this->reports, this->reports_size,
+                    MSG_DONTWAIT | MSG_NOSIGNAL);
+  if (rv > 0) {
+    this->reports_size -= rv;
+    memmove(this->reports, this->reports + rv, this->reports_size);
+  } else if (rv == -1 && !would_block(rv)) {
+    PERROR1("warning: failed to send reports to", this->host);
+    this->reporting = false;
+  }
+}
+
+// New reports are dropped when the messages kept are too many.
+static bool put_reports(void *data, const struct report *reports,
+                        size_t count) {
+  GET(struct data, this, data);
+  if (!this->reporting || is_cached_pending(this))
+    return true;
+
+  for (size_t i = 0; i != count && sizeof(this->reports) -
+                       this->reports_size >= REPORT_MESSAGE_SIZE; ++i) {
+    this->reports[this->reports_size] = MESSAGE_REPORT;
+    encode_report(&reports[i], this->reports + this->reports_size + 1);
+    this->reports_size += REPORT_MESSAGE_SIZE;
+  }
+  send_messages(this);
+  return true;
+}
+
+static bool fetch(void *data, const struct extent *extent) {
+  GET(struct data, this, data);
+  if (!this->framed || !this->reporting || is_cached_pending(this) ||
+      sizeof(this->reports) - this->reports_size < FETCH_MESSAGE_SIZE)
+    return false;
+
+  char *message = this->reports + this->reports_size;
+  message[0] = MESSAGE_FETCH;
+  uint64_t offset = htobe64(extent->offset);
+  memcpy(message + 1, &offset, 8);
+  uint64_t length = htobe64(extent->length);
+  memcpy(message + 9, &length, 8);
+  this->reports_size += FETCH_MESSAGE_SIZE;
+  send_messages(this);
+  return true;
+}
+
+// The ranges are taken out of the messages as soon as they come, and the
+// reports are left for get_reports(). When those aren't taken in time, the
+// oldest make room for the rest.
+static void receive_messages(struct data *this) {
+  while (!this->reverse_ended && !is_cached_pending(this)) {
+    if (this->reports_size == sizeof(this->reports)) {
+      this->reports_size -= REPORT_MESSAGE_SIZE;
+      memmove(this->reports, this->reports + REPORT_MESSAGE_SIZE,
+              this->reports_size);
+    }
+    ssize_t rv = recv(this->client_sock, this->reports + this->reports_size,
+                      sizeof(this->reports) - this->reports_size,
+                      MSG_DONTWAIT);
+    if (would_block(rv))
+      return;
+    // The end of the messages is waited for when the socket is closed.
+    if (rv <= 0) {
+      this->reverse_ended = true;
+      return;
+    }
+
+    size_t kept = 0;
+    size_t next = 0;
+    for (size_t size = this->reports_size + rv;;) {
+      char *message = this->reports + next;
+      size_t left = size - next;
+      if (left && message[0] == MESSAGE_REPORT && left >= REPORT_MESSAGE_SIZE) {
+        memmove(this->reports + kept, message, REPORT_MESSAGE_SIZE);
+        kept += REPORT_MESSAGE_SIZE;
+        next += REPORT_MESSAGE_SIZE;
+      } else if (left && message[0] == MESSAGE_FETCH &&
+                 left >= FETCH_MESSAGE_SIZE) {
+        struct extent extent;
+        memcpy(&extent.offset, message + 1, 8);
+        extent.offset = be64toh(extent.offset);
+        memcpy(&extent.length, message + 9, 8);
+        extent.length = be64toh(extent.length);
+        if (this->num_wanted != MAX_FETCHES)
+          this->wanted[this->num_wanted++] = extent;
+        next += FETCH_MESSAGE_SIZE;
+      } else if (left && message[0] != MESSAGE_REPORT &&
+                 message[0] != MESSAGE_FETCH) {
+        fprintf(stderr, "warning: bad message from %s\n", this->host);
+        this->reverse_ended = true;
+        this->reports_size = kept;
+        return;
+      } else {
+        memmove(this->reports + kept, message, left);
+        this->reports_size = kept + left;
+        break;
+      }
+    }
+  }
+}
+
+static bool get_reports(void *data, struct report *reports, size_t *count) {
+  GET(struct data, this, data);
+  receive_messages(this);
+
+  size_t whole = 0;
+  while (whole != *count &&
+         this->reports_size - whole * REPORT_MESSAGE_SIZE >=
+             REPORT_MESSAGE_SIZE &&
+         this->reports[whole * REPORT_MESSAGE_SIZE] == MESSAGE_REPORT) {
+    decode_report(this->reports + whole * REPORT_MESSAGE_SIZE + 1,
+                  &reports[whole]);
+    ++whole;
+  }
+  this->reports_size -= whole * REPORT_MESSAGE_SIZE;
+  memmove(this->reports, this->reports + whole * REPORT_MESSAGE_SIZE,
+          this->reports_size);
+  *count = whole;
+  return true;
+}
+
+static int get_wanted_fd(void *data) {
+  GET(struct data, this, data);
+  return this->reverse_ended ? -1 : this->wanted_fd;
+}
+
+static bool get_wanted(void *data, struct extent *extent) {
+  GET(struct data, this, data);
+  receive_messages(this);
+  if (!this->num_wanted)
+    return false;
+  *extent = this->wanted[0];
+  memmove(&this->wanted[0], &this->wanted[1],
+          --this->num_wanted * sizeof(struct extent));
+  return true;
+}
+
+// A block which is in the cache is filled from there, once the previous
+// one is done. One which got damaged since it was checked fails the
+// transfer, but is dropped from the cache for the next one.
+static ssize_t fill(struct data *this, void *buf, size_t count) {
+  size_t block = this->received / CACHE_BLOCK_SIZE;
+  size_t offset = this->received % CACHE_BLOCK_SIZE;
+  if (!offset) {
+    size_t size;
+    if (!cache_get(this->cache, this->hashes + block * BLOCK_HASH_SIZE,
+                   this->block, &size))
+      return -1;
+    ++this->cache_hits;
+  }
+  memcpy(buf, this->block + offset, count);
+  this->received += count;
+  this->cached_bytes += count;
+  return count;
+}
+
+// A block which is received is put into the cache once it's all there and
+// matches its hash.
+static void keep(struct data *this, const void *buf, size_t count) {
+  uint64_t begin = this->received - count;
+  size_t block = begin / CACHE_BLOCK_SIZE;
+  size_t offset = begin % CACHE_BLOCK_SIZE;
+  memcpy(this->block + offset, buf, count);
+  size_t size = offset + count;
+  if (size != get_cache_block_length(this, block))
+    return;
+
+  ++this->cache_misses;
+  const unsigned char *expected = this->hashes + block * BLOCK_HASH_SIZE;
+  unsigned char hash[BLOCK_HASH_SIZE];
+  if (!hash_block(this->block, size, hash))
+    return;
+  CHECK(memcmp(hash, expected, BLOCK_HASH_SIZE) == 0,
+        fprintf(stderr, "warning: block %zu from %s doesn't match its hash\n",
+                block, this->host),
+        return);
+  cache_put(this->cache, expected, this->block, size);
+}
+
+static bool start_frame(struct data *this) {
+  uint64_t offset;
+  memcpy(&offset, this->frame_header, 8);
+  offset = be64toh(offset);
+  uint32_t length;
+  memcpy(&length, this->frame_header + 8, 4);
+  length = be32toh(length);
+  CHECK(length && length <= FETCH_SIZE &&
+        (offset == FRAME_STREAM ||
+         (this->info.size_known && offset < this->info.size &&
+          length <= this->info.size - offset)),
+        fprintf(stderr, "bad frame of stream from %s\n", this->host),
+        return false);
+
+  if (offset == FRAME_STREAM) {
+    this->frame_left = length;
+    return true;
+  }
+  if (!this->fetch_buf)
+    CHECK(this->fetch_buf = malloc(FETCH_SIZE),
+          ERROR("can't allocate memory for fetched ranges"), return false);
+  this->fetch_offset = offset;
+  this->fetch_size = this->fetch_left = length;
+  return true;
+}
+
+// Receives frames up to one of the stream, and returns 1 once there, 0 if
+// it has to wait or a fetched range is to be taken first.
+static int receive_frames(struct data *this, bool *eof) {
+  while (!this->frame_left && !this->fetch_ready) {
+    bool header = !this->fetch_left;
+    char *buf = header ? this->frame_header + this->header_done :
+        this->fetch_buf + this->fetch_size - this->fetch_left;
+    size_t size = header ? FRAME_HEADER_SIZE - this->header_done :
+        this->fetch_left;
+    ssize_t rv = recv(this->sock, buf, size, MSG_DONTWAIT);
+    if (would_block(rv))
+      return 0;
+    CHECK(SYSCALL(rv), PERROR1("recv() failed for", this->host), return -1);
+    if (rv == 0) {
+      CHECK(header && !this->header_done,
+            fprintf(stderr, "stream from %s ends in a frame\n", this->host),
+            return -1);
+      *eof = true;
+      return 0;
+    }
+
+    if (!header) {
+      this->fetch_left -= rv;
+      this->fetch_ready = !this->fetch_left;
+    } else if ((this->header_done += rv) == FRAME_HEADER_SIZE) {
+      this->header_done = 0;
+      if (!start_frame(this))
+        return -1;
+    }
+  }
+  return !this->fetch_ready;
+}
+
+static bool take_fetched(void *data, struct fetched *fetched) {
+  GET(struct data, this, data);
+  if (!this->fetch_ready)
+    return false;
+  *fetched = (struct fetched) {
+    this->fetch_offset, this->fetch_size, this->fetch_buf
+  };
+  this->fetch_ready = false;
+  return true;
+}
+
 static ssize_t produce(void *data, void *buf, size_t count, bool *eof) {
   GET(struct data, this, data);
+  if (is_cached_pending(this) && !send_cached(this))
+    return -1;
+  // Whatever is received goes up to the end of the block at most.
+  bool caching = this->cache && this->cached &&
+      this->received != this->info.size;
+  if (caching) {
+    size_t block = this->received / CACHE_BLOCK_SIZE;
+    size_t left = get_cache_block_length(this, block) -
+        this->received % CACHE_BLOCK_SIZE;
+    if (count > left)
+      count = left;
+    *eof = false;
+    if (is_cached(this, block))
+      return fill(this, buf, count);
+  }
+
+  if (this->channel) {
+    ssize_t rv = channel_recv(this->channel, buf, count, eof);
+    if (rv != -1)
+      this->received += rv;
+    if (*eof)
+      end_reports(this);
+    return (*eof && !check_size(this)) ? -1 : rv;
+  }
+
+  *eof = false;
+  if (this->framed) {
+    int rv = receive_frames(this, eof);
+    if (*eof)
+      end_reports(this);
+    if (rv != 1)
+      return (rv == -1 || (*eof && !check_size(this))) ? -1 : 0;
+    if (count > this->frame_left)
+      count = this->frame_left;
+  }
+
   ssize_t rv = recv(this->sock, buf, count, MSG_DONTWAIT);
   if (would_block(rv)) {
-    *eof = false;
     return 0;
   } else if (rv == 0) {
+    CHECK(!this->frame_left,
+          fprintf(stderr, "stream from %s ends in a frame\n", this->host),
+          return -1);
     *eof = true;
-    return 0;
+    end_reports(this);
+    return check_size(this) ? 0 : -1;
   }
 
   CHECK(SYSCALL(rv), PERROR1("recv() failed for", this->host), return -1);
+  this->received += rv;
+  if (this->framed)
+    this->frame_left -= rv;
+  if (caching)
+    keep(this, buf, rv);
+  sample_tcp(this, false);
   return rv;
 }
 
 static ssize_t produce_signal(void *data, bool *eof) {
   GET(struct data, this, data);
+  if (this->channel) {
+    ssize_t rv = channel_recv_signal(this->channel, eof);
+    if (*eof)
+      end_reports(this);
+    return rv;
+  }
+
+  // The end of a framed stream is only known from where it is in a frame.
+  if (this->framed) {
+    *eof = false;
+    return 0;
+  }
+
   char unused;
   ssize_t rv = recv(this->sock, &unused, 1, MSG_PEEK);
   CHECK(!would_block(rv),
@@ -234,42 +1551,251 @@ static ssize_t produce_signal(void *data, bool *eof) {
   CHECK(SYSCALL(rv),
         PERROR1("recv(MSG_PEEK) failed for", this->host), return -1);
   *eof = (rv == 0);
-  return 0;
+  if (*eof)
+    end_reports(this);
+  return (*eof && !check_size(this)) ? -1 : 0;
 }
 
-static ssize_t consume(void *data, void *buf, size_t count) {
+// Peeking makes the kernel busy-poll the device queue with SO_BUSY_POLL,
+// which waiting on the socket through epoll doesn't.
+static bool poll_received(void *data) {
   GET(struct data, this, data);
-  ssize_t rv = send(this->client_sock, buf, count, MSG_DONTWAIT);
-  if (would_block(rv))
-    return 0;
+  if (this->channel || !this->busy_poll)
+    return false;
 
-  CHECK(SYSCALL(rv), PERROR1("send() failed for", this->host), return -1);
+  char unused;
+  ssize_t rv = recv(this->sock, &unused, 1, MSG_PEEK | MSG_DONTWAIT);
+  return !would_block(rv);
+}
+
+static ssize_t sent(struct data *this, ssize_t rv) {
+  if (rv > 0)
+    this->sent += rv;
+  if (this->replaying && rv > 0)
+    this->replayed += rv;
   return rv;
 }
 
+// How much from the current offset on is either all in the receiver's
+// cache or all not, up to count.
+static size_t get_run(const struct data *this, size_t count, bool *cached) {
+  size_t block = this->sent / CACHE_BLOCK_SIZE;
+  assert(block < this->info.num_hashes);
+  *cached = is_cached(this, block);
+  uint64_t end = (uint64_t)(block + 1) * CACHE_BLOCK_SIZE;
+  while (end - this->sent < count && ++block != this->info.num_hashes &&
+         is_cached(this, block) == *cached)
+    end += CACHE_BLOCK_SIZE;
+  return (count < end - this->sent) ? count : end - this->sent;
+}
+
+// While the beginning of the stream is replayed, the rest of the pass is
+// what the receiver already has, and so are the blocks in its cache.
+// Fetched ranges which are queued go before the next frame.
+static ssize_t consume(void *data, void *buf, size_t count) {
+  GET(struct data, this, data);
+  if (is_cached_pending(this) && !receive_cached(this))
+    return -1;
+  if (this->pending_sent != this->pending_size) {
+    int rv = send_pending(this, MSG_DONTWAIT);
+    if (rv != 1)
+      return rv;
+  }
+  if (!this->frame_left && this->frames) {
+    int rv = send_frames(this, MSG_DONTWAIT);
+    if (rv != 1)
+      return rv;
+  }
+  if (this->replaying) {
+    if (this->replayed == this->missed)
+      return count;
+    if (count > this->missed - this->replayed)
+      count = this->missed - this->replayed;
+  }
+  if (this->cached) {
+    bool cached;
+    count = get_run(this, count, &cached);
+    if (cached) {
+      this->deduped_bytes += count;
+      return sent(this, count);
+    }
+  }
+
+  if (this->channel)
+    return sent(this, channel_send(this->channel, buf, count));
+
+  ssize_t rv = send_framed(this, buf, count);
+  if (rv > 0)
+    sample_tcp(this, false);
+  return sent(this, rv);
+}
+
+static ssize_t consume_signal(void *data) {
+  GET(struct data, this, data);
+  if (this->channel)
+    return sent(this, channel_send_signal(this->channel));
+  return zero_consume_signal(data);
+}
+
 static const struct producer_ops recv_ops = {
   .init             = init,
+  .setup            = setup,
   .name             = name,
   .destroy          = destroy,
+  .get_info         = get_info,
 
   .get_epoll_event  = get_epoll_event,
   .get_fd           = get_fd,
+  .get_lo_watermark = get_lo_watermark,
+  .get_block_size   = get_block_size,
+  .get_read_ahead   = get_single_read_ahead,
   .produce          = produce,
   .signal           = produce_signal,
+  .poll             = poll_received,
+
+  .get_node         = get_node,
+  .get_counters     = get_counters,
+  .put_reports      = put_reports,
+  .can_rewind       = cannot_rewind,
+  .rewind           = rewind_nothing,
+  .set_private_ring = ignore_private_ring,
+  .fetch            = fetch,
+  .take_fetched     = take_fetched,
+  .get_fetched_fd   = get_no_fetched_fd,
 };
 
 static const struct consumer_ops send_ops = {
   .init             = init,
+  .setup            = setup,
   .name             = name,
   .destroy          = destroy,
+  .start            = start,
 
   .get_epoll_event  = get_epoll_event,
   .get_fd           = get_fd,
-  .get_lo_watermark = get_zero_lo_watermark,
+  .get_lo_watermark = get_lo_watermark,
+  .get_block_size   = get_block_size,
+  .get_priority     = get_priority,
   .consume          = consume,
-  .signal           = zero_consume_signal,
+  .signal           = consume_signal,
+  .poll             = poll_nothing,
+  .finish           = finish,
+  .get_spill        = get_no_spill,
+  .map_ring         = map_no_ring,
+
+  .get_node         = get_node,
+  .get_counters     = get_counters,
+  .get_reports      = get_reports,
+
+  .get_listen_fd    = get_listen_fd,
+  .accept_joiner    = accept_joiner,
+  .get_missed       = get_missed,
+  .get_wanted_fd    = get_wanted_fd,
+  .get_wanted       = get_wanted,
+  .put_fetched      = put_fetched,
 };
 
+static bool parse_options(struct data *this, char *options) {
+  enum {
+    BLOCK, LO, KEY, WORKERS, BUSY_POLL, LATE, CC, BDP, NOTSENT_LOWAT, RCVLOWAT,
+    CACHE
+  };
+  char *const tokens[] = {
+    [BLOCK] = "block",
+    [LO] = "lo",
+    [KEY] = "key",
+    [WORKERS] = "workers",
+    [BUSY_POLL] = "busy_poll",
+    [LATE] = "late",
+    [CC] = "cc",
+    [BDP] = "bdp",
+    [NOTSENT_LOWAT] = "notsent_lowat",
+    [RCVLOWAT] = "rcvlowat",
+    [CACHE] = "cache",
+    NULL
+  };
+
+  while (*options) {
+    char *value = NULL;
+    switch (getsubopt(&options, tokens, &value)) {
+    case BLOCK:
+      CHECK(value && parse_size(value, &this->block_size),
+            fprintf(stderr, "bad block option for %s\n", this->host),
+            return false);
+      break;
+    case LO:
+      CHECK(value && parse_size(value, &this->lo_watermark),
+            fprintf(stderr, "bad lo option for %s\n", this->host),
+            return false);
+      break;
+    case KEY:
+      CHECK(value && *value,
+            fprintf(stderr, "bad key option for %s\n", this->host),
+            return false);
+      this->key_file = value;
+      break;
+    case WORKERS:
+      CHECK(value && parse_size(value, &this->workers) &&
+            this->workers >= 1 && this->workers <= MAX_CRYPTO_WORKERS,
+            fprintf(stderr, "bad workers option for %s\n", this->host),
+            return false);
+      break;
+    case BUSY_POLL:
+      CHECK(value && parse_size(value, &this->busy_poll) &&
+            this->busy_poll <= INT_MAX,
+            fprintf(stderr, "bad busy_poll option for %s\n", this->host),
+            return false);
+      break;
+    case LATE:
+      CHECK(this->mode == S && !value,
+            fprintf(stderr, "bad late option for %s\n", this->host),
+            return false);
+      this->late = true;
+      break;
+    case CC:
+      CHECK(value && *value,
+            fprintf(stderr, "bad cc option for %s\n", this->host),
+            return false);
+      this->congestion = value;
+      break;
+    case BDP:
+      CHECK(value && parse_size(value, &this->bdp) && this->bdp <= INT_MAX,
+            fprintf(stderr, "bad bdp option for %s\n", this->host),
+            return false);
+      break;
+    case NOTSENT_LOWAT:
+      CHECK(this->mode == S && (!value ||
+            (parse_size(value, &this->notsent_lowat) &&
+             this->notsent_lowat <= INT_MAX)),
+            fprintf(stderr, "bad notsent_lowat option for %s\n", this->host),
+            return false);
+      if (!value)
+        this->notsent_lowat = LOWAT_BLOCK;
+      break;
+    case RCVLOWAT:
+      CHECK(this->mode == R && (!value ||
+            (parse_size(value, &this->rcvlowat) &&
+             this->rcvlowat <= INT_MAX)),
+            fprintf(stderr, "bad rcvlowat option for %s\n", this->host),
+            return false);
+      if (!value)
+        this->rcvlowat = LOWAT_BLOCK;
+      break;
+    case CACHE:
+      CHECK(this->mode == R && value && *value,
+            fprintf(stderr, "bad cache option for %s\n", this->host),
+            return false);
+      this->cache_dir = value;
+      break;
+    default:
+      fprintf(stderr, "unknown option %s for %s\n", value, this->host);
+      return false;
+    }
+  }
+  return true;
+}
+
+// The spec is host[:port] optionally followed by comma-separated options.
 static struct data *construct(const char *spec, int mode) {
   assert(spec);
   struct data *data = malloc(sizeof(struct data) + strlen(spec) + 1);
@@ -278,17 +1804,86 @@ static struct data *construct(const char *spec, int mode) {
     data->sock = -1;
     data->client_sock = -1;
 
+    data->addresses = NULL;
+    data->num_attempts = 0;
+    data->setup_fd = -1;
+    data->timer_fd = -1;
+    data->retry_at = 0;
+
+    memset(&data->info, 0, sizeof(data->info));
+    data->received = 0;
+    data->extents = NULL;
+    data->hashes = NULL;
+    data->cached = NULL;
+    data->cache_dir = NULL;
+    data->cache = NULL;
+    data->block = NULL;
+    data->sent = 0;
+    data->cache_hits = 0;
+    data->cache_misses = 0;
+    data->cached_bytes = 0;
+    data->deduped_bytes = 0;
+
+    data->block_size = 0;
+    data->lo_watermark = 0;
+    data->busy_poll = 0;
+
+    data->congestion = NULL;
+    data->bdp = 0;
+    data->notsent_lowat = 0;
+    data->rcvlowat = 0;
+    data->tcp = (struct tcp_sample) {0};
+
+    data->channel = NULL;
+    data->key_file = NULL;
+    data->workers = DEFAULT_CRYPTO_WORKERS;
+
+    data->reporting = (mode == R);
+    data->finished = false;
+    data->reports_size = 0;
+    data->wanted_fd = -1;
+    data->reverse_ended = false;
+    data->num_wanted = 0;
+
+    data->framed = false;
+    data->frame_left = 0;
+    data->header_done = 0;
+    data->frames = NULL;
+    data->last_frame = &data->frames;
+    data->fetch_offset = 0;
+    data->fetch_size = 0;
+    data->fetch_left = 0;
+    data->fetch_ready = false;
+    data->fetch_buf = NULL;
+
+    data->late = false;
+    data->joined = false;
+    data->pending = NULL;
+    data->pending_size = 0;
+    data->pending_sent = 0;
+    data->missed = 0;
+    data->replayed = 0;
+    data->replaying = false;
+
     data->mode = mode;
-    char *colon = strchr(spec, ':');
+    strcpy(data->host, spec);
+
+    char *options = strchr(data->host, ',');
+    if (options) {
+      *options++ = 0;
+      if (!parse_options(data, options))
+        goto cleanup;
+    }
+
+    char *colon = strchr(data->host, ':');
     if (colon) {
-      strncpy(data->host, spec, colon - spec);
-      if (strlen(spec) > strlen(data->host) + 1 + PORT_MAX_CHARS) {
-        fputs("port too long", stderr);
+      *colon++ = 0;
+      if (strlen(colon) > PORT_MAX_CHARS) {
+        fputs("port too long\n", stderr);
         goto cleanup;
       }
-      strncpy(data->port, colon+1, PORT_MAX_CHARS+1);
+      strcpy(data->port, colon);
     } else {
-      strcpy(data->host, spec);
       strcpy(data->port, DEFAULT_PORT);
     }
   }
@@ -300,7 +1895,7 @@ cleanup:
   return NULL;
 }
 
-struct producer get_socket_reader(const char *spec) {
+struct producer get_socket_reader(const char *spec, size_t read_ahead) {
   return (struct producer) {&recv_ops, construct(spec, R)};
 }
 
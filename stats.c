@@ -31,12 +31,59 @@ bool dump_stats(struct state *state, const char *filename) {
     DUMP_SIMPLE_VALUE(waited_cycles, ",");
     DUMP_SIMPLE_VALUE(buffer_underruns, ",");
     DUMP_SIMPLE_VALUE(buffer_overruns, ",");
+    DUMP_SIMPLE_VALUE(spin_ns, ",");
+    DUMP_SIMPLE_VALUE(sleep_ns, ",");
+    DUMP_SIMPLE_VALUE(work_ns, ",");
+    DUMP_SIMPLE_VALUE(spin_wakeups, ",");
+    DUMP_SIMPLE_VALUE(spin_timeouts, ",");
 
     PUT("\"consumer_slowdowns\": {");
     for (size_t i = 0; i != state->num_consumers; ++i)
       DUMP_VALUE(CALL0(state->consumers[i], name),
                  state->stats->consumer_slowdowns[i],
                  i == state->num_consumers - 1 ? "" : ",");
+    PUT("},");
+
+    PUT("\"spilled_bytes\": {");
+    for (size_t i = 0; i != state->num_consumers; ++i)
+      DUMP_VALUE(CALL0(state->consumers[i], name),
+                 state->stats->spilled_bytes[i],
+                 i == state->num_consumers - 1 ? "" : ",");
+    PUT("},");
+
+    PUT("\"endpoints\": {");
+    const char *separator = "";
+    for (size_t i = 0; i != 1 + state->num_consumers; ++i) {
+      struct counter counters[MAX_COUNTERS];
+      size_t num_counters = (i == 0) ?
+          CALL(state->producer, get_counters, counters) :
+          CALL(state->consumers[i-1], get_counters, counters);
+      assert(num_counters <= MAX_COUNTERS);
+      if (!num_counters)
+        continue;
+
+      const char *name = (i == 0) ?
+          CALL0(state->producer, name) :
+          CALL0(state->consumers[i-1], name);
+      CHECK(fprintf(output, "%s\"%s\": {", separator, name) > 0,
+            PERROR1("failed to dump counters for", name),
+            GOTO_WITH(cleanup, rv, false));
+      for (size_t j = 0; j != num_counters; ++j)
+        DUMP_VALUE(counters[j].name, counters[j].value,
+                   j == num_counters - 1 ? "" : ",");
+      PUT("}");
+      separator = ",";
+    }
+    PUT("},");
+
+    PUT("\"stream\": {");
+    CHECK(fprintf(output, "\"source\": \"%s\"", state->info.source) > 0,
+          perror("failed to dump stream source"),
+          GOTO_WITH(cleanup, rv, false));
+    if (state->info.size_known) {
+      PUT(",");
+      DUMP_VALUE("size", state->info.size, "");
+    }
     PUT("}");
   }
 
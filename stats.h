@@ -11,9 +11,26 @@ struct stats {
   uint64_t buffer_underruns;
   uint64_t buffer_overruns;
   uint64_t consumer_slowdowns[MAX_CONSUMERS];
+  uint64_t spilled_bytes[MAX_CONSUMERS];
+
+  // Where the time of the engine went with busy-polling: spinning, asleep
+  // in epoll_wait() or working, and how spins ended.
+  uint64_t spin_ns;
+  uint64_t sleep_ns;
+  uint64_t work_ns;
+  uint64_t spin_wakeups;
+  uint64_t spin_timeouts;
+};
+
+#define EMPTY_STATS {0, 0, 0, 0, {0}, {0}, 0, 0, 0, 0, 0}
+
+// Endpoint-specific counters, reported under the endpoint's name.
+struct counter {
+  const char *name;
+  uint64_t value;
 };
 
-#define EMPTY_STATS {0, 0, 0, 0, {0}}
+#define MAX_COUNTERS 8
 
 #define INC(stats, counter) \
   do \
@@ -21,5 +38,11 @@ struct stats {
       ++stats->counter; \
   while (0)
 
+#define ADD(stats, counter, value) \
+  do \
+    if (stats) \
+      stats->counter += (value); \
+  while (0)
+
 struct state;
 bool dump_stats(struct state *state, const char *filename);
@@ -8,15 +8,102 @@
 #include <stddef.h>
 #include <sys/types.h>
 
+struct consumer;
+struct counter;
+struct report;
+
+#define SOURCE_MAX_CHARS 63
+#define BLOCK_HASH_SIZE 32
+
+// A range of an image in bytes.
+struct extent {
+  uint64_t offset;
+  uint64_t length;
+};
+
+// What is known about the stream before it starts, passed down the chain.
+struct stream_info {
+  bool size_known;
+  uint64_t size;
+  uint64_t block_size;
+  char source[SOURCE_MAX_CHARS+1];
+  // Offset in the source the stream starts at. Receivers which join late
+  // get the stream from there to the end, and then its beginning.
+  uint64_t origin;
+  // A stripe of an image is the part of it at base, the whole image is
+  // image_size long. Otherwise base is 0 and image_size is size.
+  uint64_t base;
+  uint64_t image_size;
+  // An incremental stream is the data of these extents of the image, one
+  // after another, with size their total length. The list is kept by the
+  // producer.
+  const struct extent *extents;
+  size_t num_extents;
+  // The parts of a sparse image which aren't in its extents are holes,
+  // rather than left as they are.
+  bool sparse;
+  // Hashes of the stream's blocks of CACHE_BLOCK_SIZE, BLOCK_HASH_SIZE bytes
+  // each, if the source advertises them, so that the blocks which a hop
+  // has in its cache aren't sent to it. The list is kept by the producer.
+  const unsigned char *hashes;
+  size_t num_hashes;
+};
+
+// Scratch area where the engine moves the backlog of a lagging consumer,
+// so that the consumer doesn't hold up the producer.
+struct spill {
+  int fd;
+  uint64_t size;
+};
+
+// Data of a range of the stream fetched ahead of its turn.
+struct fetched {
+  uint64_t offset;
+  size_t size;
+  const char *data;
+};
+
 struct producer_ops {
   METHOD(bool, init, size_t block_size);
+  // Finishes what init started without blocking: returns 1 once the endpoint
+  // is ready, 0 if it has to wait for fd to be readable, -1 on error.
+  METHOD(int, setup, int *fd);
   METHOD0(const char *, name);
   METHOD0(void, destroy);
+  METHOD(bool, get_info, struct stream_info *info);
 
   METHOD0(uint32_t, get_epoll_event);
   METHOD0(int, get_fd);
+  METHOD0(size_t, get_lo_watermark);
+  METHOD0(size_t, get_block_size);
+  METHOD0(size_t, get_read_ahead);
   METHOD(ssize_t, produce, void *buf, size_t count, bool *eof);
   METHOD(ssize_t, signal, bool *eof);
+  // Whether signal() would find something right away, checked cheaply and
+  // without blocking while the engine busy-polls.
+  METHOD0(bool, poll);
+
+  // NUMA node of the device behind the endpoint, or -1 if unknown.
+  METHOD0(int, get_node);
+  METHOD(size_t, get_counters, struct counter *counters);
+  // Relays reports to the previous node, false if there's none.
+  METHOD(bool, put_reports, const struct report *reports, size_t count);
+  // Whether the stream can be started over for receivers which join late.
+  METHOD0(bool, can_rewind);
+  // Starts the stream over, ending it after end bytes, false if it can't.
+  METHOD(bool, rewind, uint64_t end);
+  // Asks for a range of the stream ahead of the rest of it, false if the
+  // producer can't get it that way.
+  METHOD(bool, fetch, const struct extent *extent);
+  // Takes the next range which was fetched, false if there's none yet. Its
+  // data stays the producer's until the next call.
+  METHOD(bool, take_fetched, struct fetched *fetched);
+  // Readable when fetched ranges may be ready to take, for producers which
+  // get them on their own time, or -1.
+  METHOD0(int, get_fetched_fd);
+  // Whether the engine's buffer is its own rather than seen by other
+  // processes, so that the input may be mapped into it instead of copied.
+  METHOD(void, set_private_ring, bool private_ring);
 };
 
 struct producer {
@@ -25,14 +112,47 @@ struct producer {
 
 struct consumer_ops {
   METHOD(bool, init, size_t block_size);
+  METHOD(int, setup, int *fd);
   METHOD0(const char *, name);
   METHOD0(void, destroy);
+  METHOD(bool, start, const struct stream_info *info);
 
   METHOD0(uint32_t, get_epoll_event);
   METHOD0(int, get_fd);
   METHOD0(size_t, get_lo_watermark);
+  METHOD0(size_t, get_block_size);
+  // Consumers with higher priority are served first.
+  METHOD0(int, get_priority);
   METHOD(ssize_t, consume, void *buf, size_t count);
   METHOD0(ssize_t, signal);
+  METHOD0(bool, poll);
+  METHOD0(bool, finish);
+  METHOD(bool, get_spill, struct spill *spill);
+  // Maps a ring of the size which other processes can see, for the engine
+  // to use as its buffer; ring is left NULL if the consumer has none.
+  METHOD(bool, map_ring, size_t size, char **ring);
+
+  // NUMA node of the device behind the endpoint, or -1 if unknown.
+  METHOD0(int, get_node);
+  METHOD(size_t, get_counters, struct counter *counters);
+  // Takes up to count reports which came from the next node, false if
+  // there's none.
+  METHOD(bool, get_reports, struct report *reports, size_t *count);
+
+  // Receivers which join while the stream runs come on the listening fd,
+  // or -1, and are taken as new consumers. Once the stream is over, they
+  // are given the part at its beginning which they missed.
+  METHOD0(int, get_listen_fd);
+  METHOD(bool, accept_joiner, struct consumer *joiner);
+  METHOD0(uint64_t, get_missed);
+
+  // Ranges of the stream which are wanted ahead of their turn, here or
+  // further down the chain, come when the fd is readable; it's -1 once no
+  // more will. They are fetched from the producer and given to all the
+  // consumers.
+  METHOD0(int, get_wanted_fd);
+  METHOD(bool, get_wanted, struct extent *extent);
+  METHOD(bool, put_fetched, const struct fetched *fetched);
 };
 
 struct consumer {
@@ -49,6 +169,16 @@ struct state {
   size_t num_consumers;
   struct consumer consumers[MAX_CONSUMERS];
   struct stats *stats;
+  struct stream_info info;
+  // NUMA node to place the buffer on, or -1 to leave it to the kernel.
+  int node;
+  // Buffer preallocated by the daemon, used if it's big enough.
+  char *ring;
+  size_t ring_size;
+  // Where the source of the stream puts the view of the chain, if anywhere.
+  const char *chain_filename;
+  // How long the engine spins before it sleeps waiting for the endpoints.
+  uint64_t busy_poll_ns;
 };
 
-#define EMPTY_STATE {{0, 0}, 0, {{0, 0}}, NULL}
+#define EMPTY_STATE {{0, 0}, 0, {{0, 0}}, NULL, {0}, -1, NULL, 0, NULL, 0}
@@ -0,0 +1,182 @@
+#include "macro.h"
+#include "trace.h"
+
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+struct record {
+  uint64_t begin_ns;
+  uint64_t duration_ns;
+  uint64_t offset;
+  uint64_t size;
+  const char *who;
+  enum trace_event event;
+};
+
+// Buffers of all threads which trace are linked, so that any of them can
+// dump the lot. Each is a ring which keeps the latest events, as those
+// before a failure matter most, and only counts the ones it overwrote.
+struct tracer {
+  struct tracer *next;
+  pid_t tid;
+  size_t capacity;
+  size_t size;
+  size_t next_record;
+  uint64_t dropped;
+  struct record records[];
+};
+
+_Thread_local struct tracer *tracer = NULL;
+
+static struct tracer *tracers = NULL;
+static pthread_mutex_t tracers_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static const char *const event_names[NUM_TRACE_EVENTS] = {
+  [TRACE_submit] = "submit",
+  [TRACE_complete] = "complete",
+  [TRACE_overrun] = "overrun",
+  [TRACE_underrun] = "underrun",
+  [TRACE_wakeup] = "wakeup",
+};
+
+bool start_tracing(size_t capacity) {
+  if (tracer)
+    return true;
+
+  struct tracer *buffer =
+      malloc(sizeof(struct tracer) + capacity * sizeof(struct record));
+  CHECK(buffer, ERROR("can't allocate memory for trace"), return false);
+  buffer->tid = syscall(SYS_gettid);
+  buffer->capacity = capacity;
+  buffer->size = 0;
+  buffer->next_record = 0;
+  buffer->dropped = 0;
+
+  pthread_mutex_lock(&tracers_lock);
+  buffer->next = tracers;
+  tracers = buffer;
+  pthread_mutex_unlock(&tracers_lock);
+
+  tracer = buffer;
+  return true;
+}
+
+void record_event(enum trace_event event, const char *who, uint64_t begin_ns,
+                  uint64_t duration_ns, uint64_t offset, uint64_t size) {
+  if (!tracer->capacity)
+    return;
+  if (tracer->size == tracer->capacity)
+    ++tracer->dropped;
+  else
+    ++tracer->size;
+  tracer->records[tracer->next_record] =
+      (struct record) {begin_ns, duration_ns, offset, size, who, event};
+  tracer->next_record = (tracer->next_record + 1) % tracer->capacity;
+}
+
+// Names of endpoints are those of files and hosts, which may need escaping.
+static bool put_string(FILE *output, const char *string) {
+  if (fputc('"', output) == EOF)
+    return false;
+  for (const unsigned char *c = (const unsigned char *)string; *c; ++c) {
+    int rv;
+    if (*c == '"' || *c == '\\')
+      rv = fprintf(output, "\\%c", *c);
+    else if (*c < 0x20 || *c == 0x7f)
+      rv = fprintf(output, "\\u%04x", *c);
+    else
+      rv = fputc(*c, output);
+    if (rv < 0)
+      return false;
+  }
+  return fputc('"', output) != EOF;
+}
+
+// Events without a duration are instant ones. The others overlap, like aio
+// requests in flight, so they are async ones which begin and end apart,
+// each keyed by its endpoint and offset. Timestamps are in us.
+static bool put_event(FILE *output, const struct record *record,
+                      pid_t pid, pid_t tid, char phase) {
+  const char *who = record->who ? record->who : "engine";
+  uint64_t ns = record->begin_ns;
+  if (phase == 'e')
+    ns += record->duration_ns;
+  if (fprintf(output, "{\"name\": \"%s\", \"ph\": \"%c\", \"pid\": %d, "
+              "\"tid\": %d, \"ts\": %.3f", event_names[record->event],
+              phase, pid, tid, ns / 1000.0) < 0)
+    return false;
+  if (phase != 'i' &&
+      (fputs(", \"cat\": ", output) == EOF || !put_string(output, who) ||
+       fprintf(output, ", \"id\": \"0x%"PRIx64"\"", record->offset) < 0))
+    return false;
+  if (phase == 'e')
+    return fputc('}', output) != EOF;
+  return fputs(", \"args\": {\"endpoint\": ", output) != EOF &&
+      put_string(output, who) &&
+      fprintf(output, ", \"offset\": %"PRIu64", \"size\": %"PRIu64"}}",
+              record->offset, record->size) >= 0;
+}
+
+bool dump_trace(const char *filename) {
+  bool rv = true;
+  FILE *output = NULL;
+  pthread_mutex_lock(&tracers_lock);
+  CHECK(output = fopen(filename, "w"),
+        PERROR1("fopen() failed for", filename), GOTO_WITH(cleanup, rv, false));
+
+#define PUT(string) \
+  CHECK(fputs(string, output) != EOF, \
+        perror("failed to format trace"), GOTO_WITH(cleanup, rv, false))
+
+  PUT("{\"displayTimeUnit\": \"ns\", \"traceEvents\": [");
+  const char *separator = "\n";
+  pid_t pid = getpid();
+  for (struct tracer *i = tracers; i; i = i->next) {
+    // The oldest event is the next to be overwritten.
+    size_t first = (i->size == i->capacity) ? i->next_record : 0;
+    for (size_t j = 0; j != i->size; ++j) {
+      const struct record *record = &i->records[(first + j) % i->capacity];
+      PUT(separator);
+      if (!record->duration_ns) {
+        CHECK(put_event(output, record, pid, i->tid, 'i'),
+              perror("failed to dump trace event"),
+              GOTO_WITH(cleanup, rv, false));
+      } else {
+        CHECK(put_event(output, record, pid, i->tid, 'b') &&
+              fputs(",\n", output) != EOF &&
+              put_event(output, record, pid, i->tid, 'e'),
+              perror("failed to dump trace event"),
+              GOTO_WITH(cleanup, rv, false));
+      }
+      separator = ",\n";
+    }
+    if (i->dropped)
+      fprintf(stderr, "warning: trace of thread %d lost its first %"PRIu64
+              " events\n", i->tid, i->dropped);
+  }
+  PUT("\n]}\n");
+
+#undef PUT
+
+cleanup:
+  pthread_mutex_unlock(&tracers_lock);
+  if (output)
+    CHECK(fclose(output) == 0, PERROR1("fclose() failed for", filename),
+          rv = false);
+  return rv;
+}
+
+// Only once the threads which trace are done.
+void stop_tracing(void) {
+  pthread_mutex_lock(&tracers_lock);
+  while (tracers) {
+    struct tracer *next = tracers->next;
+    free(tracers);
+    tracers = next;
+  }
+  pthread_mutex_unlock(&tracers_lock);
+  tracer = NULL;
+}
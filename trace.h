@@ -0,0 +1,54 @@
+#pragma once
+
+#include <inttypes.h>
+#include <stdbool.h>
+#include <stddef.h>
+
+// Events of a transfer which the counters in stats only sum up. A thread
+// which traces records them into a ring allocated up front, which keeps the
+// latest ones, and they are dumped in Chrome trace format, which Perfetto
+// reads as well. Each event is also a USDT probe of provider ndd, if the
+// build has sys/sdt.h, taking the endpoint, offset, size and duration in ns:
+//
+//   submit    an aio request is submitted at a position in the file
+//   complete  it's done after the duration since submission
+//   overrun   the producer waited for the buffer held by the endpoint
+//   underrun  the endpoint waited for the producer
+//   wakeup    the engine woke up with size events after the duration
+enum trace_event {
+  TRACE_submit,
+  TRACE_complete,
+  TRACE_overrun,
+  TRACE_underrun,
+  TRACE_wakeup,
+  NUM_TRACE_EVENTS
+};
+
+struct tracer;
+extern _Thread_local struct tracer *tracer;
+
+extern bool start_tracing(size_t capacity);
+extern void record_event(enum trace_event event, const char *who,
+                         uint64_t begin_ns, uint64_t duration_ns,
+                         uint64_t offset, uint64_t size);
+extern bool dump_trace(const char *filename);
+extern void stop_tracing(void);
+
+#if defined(__has_include)
+#if __has_include(<sys/sdt.h>)
+#include <sys/sdt.h>
+#define PROBE(event, who, offset, size, duration_ns) \
+  DTRACE_PROBE4(ndd, event, who, offset, size, duration_ns)
+#endif
+#endif
+
+#ifndef PROBE
+#define PROBE(event, who, offset, size, duration_ns) ((void)0)
+#endif
+
+#define TRACE(event, who, begin_ns, duration_ns, offset, size) \
+  do { \
+    PROBE(event, who, offset, size, duration_ns); \
+    if (tracer) \
+      record_event(TRACE_##event, who, begin_ns, duration_ns, offset, size); \
+  } while (0)
@@ -1,15 +1,160 @@
 #include "util.h"
+#include "struct.h"
 
+#include <assert.h>
 #include <errno.h>
+#include <limits.h>
+#include <stdio.h>
+#include <time.h>
+#include <unistd.h>
 
 bool would_block(int rv) {
   return rv == -1 && (errno == EAGAIN || errno == EWOULDBLOCK);
 }
 
-size_t get_zero_lo_watermark(void *data) {
+static bool strtoll_overflew(long long value) {
+  return (value == LLONG_MIN || value == LLONG_MAX) && errno == ERANGE;
+}
+
+static bool strtol_overflew(long value) {
+  return (value == LONG_MIN || value == LONG_MAX) && errno == ERANGE;
+}
+
+static bool size_overflew(size_t value) {
+  return sizeof(size_t) == sizeof(long) ?
+      strtol_overflew(value) :
+      strtoll_overflew(value);
+}
+
+bool parse_size(const char *str, size_t *value) {
+  static_assert(sizeof(size_t) == sizeof(long long) ||
+                sizeof(size_t) == sizeof(long),
+                "can't manipulate buffer sizes on this platform");
+  char *end = NULL;
+  size_t raw_size = (sizeof(size_t) == sizeof(long)) ?
+      strtol(str, &end, 10) :
+      strtoll(str, &end, 10);
+  if (*str == 0 || *end != 0 || raw_size == 0 || size_overflew(raw_size))
+    return false;
+  *value = raw_size;
+  return true;
+}
+
+uint64_t get_time_ns(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+size_t get_no_counters(void *data, struct counter *counters) {
   return 0;
 }
 
+int setup_nothing(void *data, int *fd) {
+  return 1;
+}
+
+bool finish_nothing(void *data) {
+  return true;
+}
+
+bool get_no_spill(void *data, struct spill *spill) {
+  return false;
+}
+
+bool start_nothing(void *data, const struct stream_info *info) {
+  return true;
+}
+
+void set_local_source(struct stream_info *info, const char *name) {
+  char host[SOURCE_MAX_CHARS+1] = "";
+  gethostname(host, sizeof(host) - 1);
+  // The identity is informational only, so long names are just cut.
+  if (snprintf(info->source, sizeof(info->source), "%s:%s", host, name) < 0)
+    info->source[0] = 0;
+}
+
+bool is_whole_stream(const struct stream_info *info) {
+  return !info->origin && !info->base && info->image_size == info->size &&
+      !info->num_extents;
+}
+
+size_t get_single_read_ahead(void *data) {
+  return 1;
+}
+
+int get_no_priority(void *data) {
+  return 0;
+}
+
+int get_no_node(void *data) {
+  return -1;
+}
+
 ssize_t zero_consume_signal(void *data) {
   return 0;
 }
+
+bool map_no_ring(void *data, size_t size, char **ring) {
+  return true;
+}
+
+bool poll_nothing(void *data) {
+  return false;
+}
+
+bool cannot_rewind(void *data) {
+  return false;
+}
+
+bool rewind_nothing(void *data, uint64_t end) {
+  return false;
+}
+
+void ignore_private_ring(void *data, bool private_ring) {
+}
+
+bool fetch_nothing(void *data, const struct extent *extent) {
+  return false;
+}
+
+bool take_nothing_fetched(void *data, struct fetched *fetched) {
+  return false;
+}
+
+int get_no_fetched_fd(void *data) {
+  return -1;
+}
+
+int get_no_listen_fd(void *data) {
+  return -1;
+}
+
+bool accept_no_joiner(void *data, struct consumer *joiner) {
+  return true;
+}
+
+uint64_t get_no_missed(void *data) {
+  return 0;
+}
+
+int get_no_wanted_fd(void *data) {
+  return -1;
+}
+
+bool get_nothing_wanted(void *data, struct extent *extent) {
+  return false;
+}
+
+bool ignore_fetched(void *data, const struct fetched *fetched) {
+  return true;
+}
+
+bool put_no_reports(void *data, const struct report *reports, size_t count) {
+  return false;
+}
+
+bool get_no_reports(void *data, struct report *reports, size_t *count) {
+  *count = 0;
+  return false;
+}
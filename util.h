@@ -1,10 +1,62 @@
 #pragma once
 
+#include <inttypes.h>
 #include <stdbool.h>
 #include <stdlib.h>
 
 bool would_block(int rv);
 
-size_t get_zero_lo_watermark(void *data);
+bool parse_size(const char *str, size_t *value);
+
+uint64_t get_time_ns(void);
+
+struct counter;
+size_t get_no_counters(void *data, struct counter *counters);
+
+int setup_nothing(void *data, int *fd);
+
+bool finish_nothing(void *data);
+
+struct spill;
+bool get_no_spill(void *data, struct spill *spill);
+
+bool map_no_ring(void *data, size_t size, char **ring);
+
+struct stream_info;
+bool start_nothing(void *data, const struct stream_info *info);
+
+void set_local_source(struct stream_info *info, const char *name);
+bool is_whole_stream(const struct stream_info *info);
+
+size_t get_single_read_ahead(void *data);
+
+int get_no_priority(void *data);
+
+int get_no_node(void *data);
+
+struct report;
+bool put_no_reports(void *data, const struct report *reports, size_t count);
+bool get_no_reports(void *data, struct report *reports, size_t *count);
 
 ssize_t zero_consume_signal(void *data);
+
+bool poll_nothing(void *data);
+
+bool cannot_rewind(void *data);
+bool rewind_nothing(void *data, uint64_t end);
+void ignore_private_ring(void *data, bool private_ring);
+
+struct extent;
+struct fetched;
+bool fetch_nothing(void *data, const struct extent *extent);
+bool take_nothing_fetched(void *data, struct fetched *fetched);
+int get_no_fetched_fd(void *data);
+
+struct consumer;
+int get_no_listen_fd(void *data);
+bool accept_no_joiner(void *data, struct consumer *joiner);
+uint64_t get_no_missed(void *data);
+
+int get_no_wanted_fd(void *data);
+bool get_nothing_wanted(void *data, struct extent *extent);
+bool ignore_fetched(void *data, const struct fetched *fetched);